@@ -0,0 +1,234 @@
+#include "archive_file_source.hpp"
+
+#include <mbgl/storage/resource.hpp>
+#include <mbgl/storage/response.hpp>
+#include <mbgl/util/async_request.hpp>
+#include <mbgl/util/run_loop.hpp>
+#include <cstdio>
+#include <stdexcept>
+
+#include "compression.hpp"
+
+namespace mbgl {
+
+    namespace {
+
+        // mbgl's PMTiles source takes any URL after the protocol; only local
+        // files are read here.
+        const std::string mbtilesProtocol = "mbtiles://";
+        const std::string pmtilesProtocol = "pmtiles://file://";
+
+        bool hasPrefix(const std::string& url, const std::string& prefix) {
+            return url.compare(0, prefix.size(), prefix) == 0;
+        }
+
+        // Splits ".../file.mbtiles/z/x/y" into the archive path and the tile.
+        bool parseTileUrl(const std::string& path, std::string& archive, int& z, int& x, int& y) {
+            size_t yStart = path.rfind('/');
+            if (yStart == std::string::npos || yStart == 0) return false;
+            size_t xStart = path.rfind('/', yStart - 1);
+            if (xStart == std::string::npos || xStart == 0) return false;
+            size_t zStart = path.rfind('/', xStart - 1);
+            if (zStart == std::string::npos) return false;
+
+            try {
+                z = std::stoi(path.substr(zStart + 1, xStart - zStart - 1));
+                x = std::stoi(path.substr(xStart + 1, yStart - xStart - 1));
+                y = std::stoi(path.substr(yStart + 1));
+            } catch (const std::exception&) {
+                return false;
+            }
+            archive = path.substr(0, zStart);
+            return z >= 0 && z < 31 && x >= 0 && y >= 0 && x < (1 << z) && y < (1 << z);
+        }
+
+        std::string jsonString(const std::string& value) {
+            std::string out = "\"";
+            for (char c : value) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                } else if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+            }
+            return out + "\"";
+        }
+
+        std::string tileJSON(const std::string& tileUrl, int minZoom, int maxZoom, const std::string& bounds) {
+            std::string json = "{\"tilejson\":\"3.0.0\",\"scheme\":\"xyz\",\"tiles\":[" + jsonString(tileUrl) + "]" +
+                               ",\"minzoom\":" + std::to_string(minZoom) +
+                               ",\"maxzoom\":" + std::to_string(maxZoom);
+            if (!bounds.empty()) {
+                json += ",\"bounds\":[" + bounds + "]";
+            }
+            return json + "}";
+        }
+
+        Response dataResponse(std::string data) {
+            Response response;
+            if (isGzipped(data.data(), data.size())) {
+                data = gunzip(data.data(), data.size());
+            }
+            response.data = std::make_shared<const std::string>(std::move(data));
+            return response;
+        }
+
+        Response errorResponse(Response::Error::Reason reason, const std::string& message) {
+            Response response;
+            response.error = std::make_unique<Response::Error>(reason, message);
+            return response;
+        }
+
+    } // namespace
+
+    ArchiveFileSource::ArchiveFileSource(std::unique_ptr<FileSource> upstream_)
+        : upstream(std::move(upstream_)) {
+    }
+
+    ArchiveFileSource::~ArchiveFileSource() = default;
+
+    std::unique_ptr<AsyncRequest> ArchiveFileSource::request(const Resource& resource, Callback callback) {
+        Response response;
+        try {
+            if (hasPrefix(resource.url, mbtilesProtocol)) {
+                response = mbtilesResponse(resource, resource.url.substr(mbtilesProtocol.size()));
+            } else if (hasPrefix(resource.url, pmtilesProtocol)) {
+                response = pmtilesResponse(resource, resource.url.substr(pmtilesProtocol.size()));
+            } else if (upstream) {
+                return upstream->request(resource, std::move(callback));
+            } else {
+                response = errorResponse(Response::Error::Reason::Other, "no file source for " + resource.url);
+            }
+        } catch (const std::exception& e) {
+            response = errorResponse(Response::Error::Reason::Other, e.what());
+        }
+
+        // Answer from the run loop like any other file source, never from
+        // inside request().
+        return util::RunLoop::Get()->invokeCancellable(
+            [callback, response = std::move(response)] { callback(response); });
+    }
+
+    Response ArchiveFileSource::mbtilesResponse(const Resource& resource, const std::string& path) {
+        std::string archive = path;
+        int z = 0, x = 0, y = 0;
+        bool tile = resource.kind == Resource::Kind::Tile;
+        if (tile && !parseTileUrl(path, archive, z, x, y)) {
+            return errorResponse(Response::Error::Reason::NotFound, "invalid tile URL " + resource.url);
+        }
+
+        // Only the reader is shared; decompression happens after unlocking.
+        std::unique_lock<std::mutex> lock(mutex);
+        auto& reader = mbtiles[archive];
+        if (!reader) {
+            reader = std::make_unique<MBTilesReader>(archive);
+        }
+
+        if (!tile) {
+            std::map<std::string, std::string> metadata = reader->metadata();
+            auto value = [&](const char* key, const std::string& fallback) {
+                auto it = metadata.find(key);
+                return it == metadata.end() ? fallback : it->second;
+            };
+            return dataResponse(tileJSON(mbtilesProtocol + archive + "/{z}/{x}/{y}",
+                                         std::stoi(value("minzoom", "0")),
+                                         std::stoi(value("maxzoom", "14")),
+                                         value("bounds", "")));
+        }
+
+        std::string data;
+        bool found = reader->readTile(z, x, (1 << z) - 1 - y, data);
+        lock.unlock();
+        if (!found) {
+            Response response;
+            response.noContent = true;
+            return response;
+        }
+        return dataResponse(std::move(data));
+    }
+
+    Response ArchiveFileSource::pmtilesResponse(const Resource& resource, const std::string& path) {
+        std::string archive = path;
+        int z = 0, x = 0, y = 0;
+        bool tile = resource.kind == Resource::Kind::Tile;
+        if (tile && !parseTileUrl(path, archive, z, x, y)) {
+            return errorResponse(Response::Error::Reason::NotFound, "invalid tile URL " + resource.url);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        auto& reader = pmtiles[archive];
+        if (!reader) {
+            reader = std::make_unique<PMTilesReader>(archive);
+        }
+        const PMTilesHeader& header = reader->header();
+
+        if (!tile) {
+            std::string bounds = std::to_string(header.minLonE7 / 1e7) + "," + std::to_string(header.minLatE7 / 1e7) + "," +
+                                 std::to_string(header.maxLonE7 / 1e7) + "," + std::to_string(header.maxLatE7 / 1e7);
+            return dataResponse(tileJSON(pmtilesProtocol + archive + "/{z}/{x}/{y}", header.minZoom, header.maxZoom, bounds));
+        }
+
+        if (header.tileCompression != PMTilesCompression::None && header.tileCompression != PMTilesCompression::Gzip) {
+            return errorResponse(Response::Error::Reason::Other, "only uncompressed or gzip compressed PMTiles tiles are supported");
+        }
+
+        std::string data;
+        bool found = reader->readTile(z, x, y, data);
+        lock.unlock();
+        if (!found) {
+            Response response;
+            response.noContent = true;
+            return response;
+        }
+        return dataResponse(std::move(data));
+    }
+
+    bool ArchiveFileSource::canRequest(const Resource& resource) const {
+        return hasPrefix(resource.url, mbtilesProtocol) || hasPrefix(resource.url, pmtilesProtocol) ||
+               (upstream && upstream->canRequest(resource));
+    }
+
+    void ArchiveFileSource::pause() {
+        if (upstream) upstream->pause();
+    }
+
+    void ArchiveFileSource::resume() {
+        if (upstream) upstream->resume();
+    }
+
+    void ArchiveFileSource::setProperty(const std::string& key, const mapbox::base::Value& value) {
+        if (upstream) upstream->setProperty(key, value);
+    }
+
+    mapbox::base::Value ArchiveFileSource::getProperty(const std::string& key) const {
+        return upstream ? upstream->getProperty(key) : mapbox::base::Value();
+    }
+
+    void ArchiveFileSource::setResourceOptions(ResourceOptions options) {
+        if (upstream) {
+            upstream->setResourceOptions(options.clone());
+        }
+        resourceOptions = std::move(options);
+    }
+
+    ResourceOptions ArchiveFileSource::getResourceOptions() {
+        return upstream ? upstream->getResourceOptions() : resourceOptions.clone();
+    }
+
+    void ArchiveFileSource::setClientOptions(ClientOptions options) {
+        if (upstream) {
+            upstream->setClientOptions(options.clone());
+        }
+        clientOptions = std::move(options);
+    }
+
+    ClientOptions ArchiveFileSource::getClientOptions() {
+        return upstream ? upstream->getClientOptions() : clientOptions.clone();
+    }
+
+} // namespace mbgl
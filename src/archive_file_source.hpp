@@ -0,0 +1,59 @@
+#ifndef ARCHIVE_FILE_SOURCE_HPP
+#define ARCHIVE_FILE_SOURCE_HPP
+
+#include <mbgl/storage/file_source.hpp>
+#include <mbgl/storage/resource_options.hpp>
+#include <mbgl/util/client_options.hpp>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "mbtiles.hpp"
+#include "pmtiles.hpp"
+
+namespace mbgl {
+
+    // Serves local archives in mbgl's URL syntax, mbtiles:///path/to/file.mbtiles
+    // and pmtiles://file:///path/to/file.pmtiles, and passes every other request
+    // on to `upstream`, which may be null. It is registered as mbgl's Mbtiles
+    // and Pmtiles file source, which the resource loader asks before the
+    // network. A source URL yields a TileJSON whose tile URLs point back into
+    // the archive. Each archive is opened once per instance and read through a
+    // memory mapping, with no network stack involved. mbgl creates an instance
+    // for every render thread, so the threads read through readers of their
+    // own; the lock only covers the lookup and the read, not decompression.
+    class ArchiveFileSource : public FileSource {
+    public:
+        explicit ArchiveFileSource(std::unique_ptr<FileSource> upstream = nullptr);
+        ~ArchiveFileSource() override;
+
+        std::unique_ptr<AsyncRequest> request(const Resource& resource, Callback callback) override;
+        bool canRequest(const Resource& resource) const override;
+
+        void pause() override;
+        void resume() override;
+
+        void setProperty(const std::string& key, const mapbox::base::Value& value) override;
+        mapbox::base::Value getProperty(const std::string& key) const override;
+
+        void setResourceOptions(ResourceOptions options) override;
+        ResourceOptions getResourceOptions() override;
+        void setClientOptions(ClientOptions options) override;
+        ClientOptions getClientOptions() override;
+
+    private:
+        Response mbtilesResponse(const Resource& resource, const std::string& path);
+        Response pmtilesResponse(const Resource& resource, const std::string& path);
+
+        std::unique_ptr<FileSource> upstream;
+        ResourceOptions resourceOptions; // kept for getResourceOptions() without an upstream
+        ClientOptions clientOptions;
+        std::map<std::string, std::unique_ptr<MBTilesReader>> mbtiles;
+        std::map<std::string, std::unique_ptr<PMTilesReader>> pmtiles;
+        std::mutex mutex; // guards the readers, not the responses built from them
+    };
+
+} // namespace mbgl
+
+#endif // ARCHIVE_FILE_SOURCE_HPP
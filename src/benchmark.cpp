@@ -0,0 +1,529 @@
+#include <mbgl/util/image.hpp>
+#include <mbgl/util/logging.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "coordinates.hpp"
+#include "image_encoding.hpp"
+#include "mbtiles.hpp"
+#include "renderer.hpp"
+#include "tile_scheduler.hpp"
+
+// Micro benchmarks of the hot paths and an offline end-to-end render, written
+// as JSON so runs of different builds can be compared.
+
+namespace fs = std::filesystem;
+using namespace mbgl;
+
+namespace
+{
+
+    struct BenchmarkResult
+    {
+        std::string name;
+        uint64_t iterations = 0;
+        double seconds = 0;
+        uint64_t items = 0; // tiles, coordinates or rows handled in total
+        uint64_t bytes = 0; // bytes produced or consumed in total, 0 if not meaningful
+    };
+
+    struct BenchmarkSettings
+    {
+        double minSeconds = 1.0; // every micro benchmark runs at least this long
+        std::string filter;      // only run benchmarks whose name contains this
+        int renderZoom = 6;      // max zoom of the end-to-end render
+    };
+
+    // Keeps the compiler from dropping a computed value.
+    volatile uint64_t sink;
+
+    double secondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool selected(const BenchmarkSettings &settings, const std::string &name)
+    {
+        return name.find(settings.filter) != std::string::npos;
+    }
+
+    // Runs `body` until minSeconds have passed and adds the result, unless the
+    // filter skips it. Every call handles `items` items and returns the bytes
+    // it produced.
+    void repeat(std::vector<BenchmarkResult> &results, const std::string &name, const BenchmarkSettings &settings,
+                uint64_t items, const std::function<uint64_t()> &body)
+    {
+        if (!selected(settings, name))
+        {
+            return;
+        }
+
+        BenchmarkResult result;
+        result.name = name;
+        body(); // warm up caches and lazy initialisation
+
+        auto start = std::chrono::steady_clock::now();
+        do
+        {
+            result.bytes += body();
+            result.items += items;
+            result.iterations++;
+        } while (secondsSince(start) < settings.minSeconds);
+        result.seconds = secondsSince(start);
+        results.push_back(result);
+    }
+
+    // Fixture images, the same in every run. "gradient" compresses well,
+    // "noise" is the worst case for every encoder, "map" is flat areas
+    // with hard edges and some transparency, like a rendered tile, and
+    // "flat" is land and water only, like a tile without features.
+    PremultipliedImage fixtureImage(const std::string &kind)
+    {
+        constexpr uint32_t side = 512;
+        PremultipliedImage image({side, side});
+        std::mt19937 random(42);
+
+        for (uint32_t y = 0; y < side; y++)
+        {
+            for (uint32_t x = 0; x < side; x++)
+            {
+                uint8_t *pixel = image.data.get() + (y * side + x) * 4;
+                uint8_t r, g, b, a = 255;
+                if (kind == "gradient")
+                {
+                    r = static_cast<uint8_t>(x / 2);
+                    g = static_cast<uint8_t>(y / 2);
+                    b = static_cast<uint8_t>((x + y) / 4);
+                }
+                else if (kind == "flat")
+                {
+                    bool water = x + y / 2 > 300;
+                    r = water ? 170 : 242;
+                    g = water ? 211 : 239;
+                    b = water ? 223 : 233;
+                }
+                else if (kind == "noise")
+                {
+                    uint32_t value = random();
+                    r = value & 0xff;
+                    g = (value >> 8) & 0xff;
+                    b = (value >> 16) & 0xff;
+                    a = (value >> 24) | 0x80;
+                }
+                else
+                {
+                    // Blocks of land and water crossed by roads.
+                    bool water = ((x / 96) + (y / 80)) % 3 == 0;
+                    bool road = (x + 2 * y) % 128 < 6 || (3 * x + y) % 200 < 4;
+                    r = road ? 250 : water ? 170 : 242;
+                    g = road ? 200 : water ? 211 : 239;
+                    b = road ? 120 : water ? 223 : 233;
+                    a = (x < 32 && y < 32) ? 0 : 255;
+                }
+
+                // Premultiply like mbgl's renderer output.
+                pixel[0] = static_cast<uint8_t>(r * a / 255);
+                pixel[1] = static_cast<uint8_t>(g * a / 255);
+                pixel[2] = static_cast<uint8_t>(b * a / 255);
+                pixel[3] = a;
+            }
+        }
+        return image;
+    }
+
+    void benchmarkCoordinates(const BenchmarkSettings &settings, std::vector<BenchmarkResult> &results)
+    {
+        for (int span : {1, 8})
+        {
+            constexpr int zoom = 14;
+            constexpr int side = 256;
+            repeat(results, "coordinates/center/span" + std::to_string(span), settings, side * side, [&]
+                   {
+                double total = 0;
+                for (int y = 0; y < side; y++)
+                {
+                    for (int x = 0; x < side; x++)
+                    {
+                        LatLng center = calculateNormalizedCenterCoords(x * 37, y * 53, zoom, span);
+                        total += center.latitude() + center.longitude();
+                    }
+                }
+                sink = static_cast<uint64_t>(total);
+                return uint64_t(0); });
+        }
+    }
+
+    void benchmarkEncoders(const BenchmarkSettings &settings, std::vector<BenchmarkResult> &results)
+    {
+        for (const std::string kind : {"map", "gradient", "noise", "flat"})
+        {
+            PremultipliedImage image = fixtureImage(kind);
+
+            repeat(results, "encode/webp/" + kind, settings, 1, [&]
+                   { return uint64_t(encodeWebP(image).size()); });
+            repeat(results, "encode/jpeg/" + kind, settings, 1, [&]
+                   { return uint64_t(encodeJPEG(image).size()); });
+            repeat(results, "encode/png/" + kind, settings, 1, [&]
+                   { return uint64_t(encodePNG(image).size()); });
+
+            // What a render worker does: one encoder per format for every
+            // tile, with the settings of a preset.
+            for (auto [name, format] : {std::pair{"webp", ImageFormat::WEBP}, std::pair{"jpeg", ImageFormat::JPEG},
+                                        std::pair{"png", ImageFormat::PNG}})
+            {
+                TileEncoder encoder(format);
+                for (const std::string preset : {"fast", "balanced", "smallest"})
+                {
+                    EncoderSettings encoderSettings = encoderPreset(preset);
+                    repeat(results, std::string("encode/") + name + "-" + preset + "/" + kind, settings, 1, [&]
+                           { return uint64_t(encoder.encode(image, encoderSettings).size()); });
+                }
+            }
+        }
+    }
+
+    // Inserts encoded tiles the way the writer does, in every storage mode,
+    // merges shards and reads tiles back the way the pyramid top builder
+    // does. Each run writes a fresh database.
+    void benchmarkStorage(const BenchmarkSettings &settings, const fs::path &directory, std::vector<BenchmarkResult> &results)
+    {
+        // A mix of distinct tiles and repeated ocean tiles, as in a world render.
+        std::vector<std::string> tiles;
+        for (const std::string kind : {"map", "gradient", "noise"})
+        {
+            tiles.push_back(encodeWebP(fixtureImage(kind)));
+        }
+        std::string ocean = encodeWebP(PremultipliedImage({512, 512}));
+
+        constexpr int zoom = 8;
+        constexpr int side = 1 << zoom;
+        struct Mode
+        {
+            const char *name;
+            bool deduplicate;
+            bool bulkLoad;
+        };
+
+        for (const Mode &mode : {Mode{"plain", false, false}, Mode{"dedup", true, false}, Mode{"bulk", false, true}})
+        {
+            std::string path = (directory / (std::string("storage-") + mode.name + ".mbtiles")).string();
+            repeat(results, std::string("mbtiles/insert/") + mode.name, settings, side * side, [&]
+                   {
+                fs::remove(path);
+                createMBTilesDatabase(path.c_str(), ImageFormat::WEBP, mode.deduplicate, mode.bulkLoad);
+                MBTilesWriter writer(path.c_str(), mode.deduplicate, mode.bulkLoad);
+                for (int y = 0; y < side; y++)
+                {
+                    for (int x = 0; x < side; x++)
+                    {
+                        const std::string &data = (x + y) % 4 == 0 ? ocean : tiles[(x * 7 + y) % tiles.size()];
+                        writer.insertTile(zoom, x, y, data.data(), data.size());
+                    }
+                }
+                writer.finish();
+                return writer.byteCount(); });
+        }
+
+        // Merges the shards of a render, each holding a band of columns,
+        // into a fresh output the way the merge command does.
+        if (selected(settings, "mbtiles/merge"))
+        {
+            constexpr int shards = 4;
+            std::vector<std::string> shardPaths;
+            for (int shard = 0; shard < shards; shard++)
+            {
+                std::string shardPath = (directory / ("storage-shard" + std::to_string(shard) + ".mbtiles")).string();
+                fs::remove(shardPath);
+                createMBTilesDatabase(shardPath.c_str(), ImageFormat::WEBP);
+                MBTilesWriter writer(shardPath.c_str());
+                for (int y = 0; y < side; y++)
+                {
+                    for (int x = shard * side / shards; x < (shard + 1) * side / shards; x++)
+                    {
+                        const std::string &data = (x + y) % 4 == 0 ? ocean : tiles[(x * 7 + y) % tiles.size()];
+                        writer.insertTile(zoom, x, y, data.data(), data.size());
+                    }
+                }
+                writer.finish();
+                shardPaths.push_back(shardPath);
+            }
+
+            std::string path = (directory / "storage-merged.mbtiles").string();
+            repeat(results, "mbtiles/merge", settings, side * side, [&]
+                   {
+                fs::remove(path);
+                mergeMBTiles(shardPaths, path, false);
+                return static_cast<uint64_t>(fs::file_size(path)); });
+        }
+
+        // Reads the tiles back in random order.
+        if (!selected(settings, "mbtiles/read/random"))
+        {
+            return;
+        }
+        std::string path = (directory / "storage-read.mbtiles").string();
+        {
+            createMBTilesDatabase(path.c_str(), ImageFormat::WEBP);
+            MBTilesWriter writer(path.c_str());
+            for (int y = 0; y < side; y++)
+            {
+                for (int x = 0; x < side; x++)
+                {
+                    const std::string &data = tiles[(x * 7 + y) % tiles.size()];
+                    writer.insertTile(zoom, x, y, data.data(), data.size());
+                }
+            }
+            writer.finish();
+        }
+        MBTilesReader reader(path);
+        std::vector<std::pair<int, int>> order;
+        for (int y = 0; y < side; y++)
+        {
+            for (int x = 0; x < side; x++)
+            {
+                order.emplace_back(x, y);
+            }
+        }
+        std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+        repeat(results, "mbtiles/read/random", settings, order.size(), [&]
+               {
+            uint64_t bytes = 0;
+            std::string data;
+            for (const auto &[x, y] : order)
+            {
+                if (reader.readTile(zoom, x, y, data))
+                {
+                    bytes += data.size();
+                }
+            }
+            return bytes; });
+    }
+
+    // A style with a local GeoJSON source of fixed synthetic features and no
+    // text, so rendering needs neither the network nor glyphs. mbgl cuts the
+    // source into vector tiles itself.
+    std::string writeFixtureStyle(const fs::path &directory)
+    {
+        std::ostringstream features;
+        std::mt19937 random(7);
+        std::uniform_real_distribution<double> lon(-170, 170), lat(-75, 75), size(0.5, 8);
+        for (int i = 0; i < 400; i++)
+        {
+            double x = lon(random), y = lat(random), s = size(random);
+            features << (i ? "," : "")
+                     << "{\"type\":\"Feature\",\"properties\":{\"class\":" << i % 4 << "},"
+                     << "\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[["
+                     << x << "," << y << "],[" << x + s << "," << y << "],[" << x + s << "," << y + s * 0.7 << "],["
+                     << x + s * 0.3 << "," << y + s << "],[" << x << "," << y << "]]]}}";
+            features << ",{\"type\":\"Feature\",\"properties\":{\"class\":" << i % 3 << "},"
+                     << "\"geometry\":{\"type\":\"LineString\",\"coordinates\":[["
+                     << x << "," << y << "],[" << x + 2 * s << "," << y - s << "],[" << x + 3 * s << "," << y + s << "]]}}";
+        }
+
+        std::ofstream geojson(directory / "features.geojson");
+        geojson << "{\"type\":\"FeatureCollection\",\"features\":[" << features.str() << "]}";
+
+        fs::path stylePath = directory / "style.json";
+        std::ofstream style(stylePath);
+        style << R"({
+  "version": 8,
+  "sources": {
+    "features": { "type": "geojson", "data": "file://)"
+              << (directory / "features.geojson").string() << R"(", "maxzoom": 14 }
+  },
+  "layers": [
+    { "id": "background", "type": "background", "paint": { "background-color": "#aad3df" } },
+    { "id": "land", "type": "fill", "source": "features", "filter": ["==", "$type", "Polygon"],
+      "paint": { "fill-color": ["match", ["get", "class"], 0, "#f2efe9", 1, "#c8facc", 2, "#e0dfdf", "#d9d0c9"],
+                 "fill-outline-color": "#999999" } },
+    { "id": "roads", "type": "line", "source": "features", "filter": ["==", "$type", "LineString"],
+      "paint": { "line-color": ["match", ["get", "class"], 0, "#e892a2", 1, "#fcd6a4", "#ffffff"],
+                 "line-width": ["interpolate", ["linear"], ["zoom"], 0, 0.5, 10, 6] } }
+  ]
+})";
+        return "file://" + stylePath.string();
+    }
+
+    // Renders zooms 0 to renderZoom of the fixture style through the regular
+    // worker path in this process and throws the tiles away.
+    void benchmarkRender(const BenchmarkSettings &settings, const fs::path &directory, std::vector<BenchmarkResult> &results)
+    {
+        RenderOptions options;
+        options.styleUrl = writeFixtureStyle(directory);
+        options.maxZoom = settings.renderZoom;
+        options.sourceCacheMegabytes = 0;
+
+        for (int metatile : {1, 4})
+        {
+            std::string name = "render/fixture/z" + std::to_string(settings.renderZoom) + "/metatile" + std::to_string(metatile);
+            if (!selected(settings, name))
+            {
+                continue;
+            }
+
+            options.metatile = metatile;
+            TileScheduler scheduler(scheduleLevels(options), 1, {}, options.order);
+            registerFileSources(options, false);
+
+            int devNull = open("/dev/null", O_WRONLY);
+            auto start = std::chrono::steady_clock::now();
+            renderTiles(0, scheduler, options, devNull);
+            double seconds = secondsSince(start);
+            close(devNull);
+
+            BenchmarkResult result;
+            result.name = name;
+            result.iterations = 1;
+            result.seconds = seconds;
+            result.items = scheduler.worker(0).tiles.load();
+            results.push_back(result);
+        }
+    }
+
+    void writeResults(std::ostream &out, const std::vector<BenchmarkResult> &results)
+    {
+        out << "{\n  \"timestamp\": " << std::time(nullptr) << ",\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const BenchmarkResult &result = results[i];
+            out << (i ? ",\n" : "\n") << "    {\"name\": \"" << result.name << "\""
+                << ", \"iterations\": " << result.iterations
+                << ", \"seconds\": " << result.seconds
+                << ", \"ns_per_item\": " << (result.items > 0 ? result.seconds * 1e9 / result.items : 0.0)
+                << ", \"items_per_second\": " << (result.seconds > 0 ? result.items / result.seconds : 0.0)
+                << ", \"bytes_per_item\": " << (result.items > 0 ? static_cast<double>(result.bytes) / result.items : 0.0)
+                << ", \"bytes_per_second\": " << (result.seconds > 0 ? result.bytes / result.seconds : 0.0) << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+    void printHelp(const char *programName)
+    {
+        std::cout << "Usage: " << programName << " [options]\n\n"
+                  << "Options:\n"
+                  << "  -f, --filter <text>             Only run benchmarks whose name contains this text\n"
+                  << "  -t, --min-time <seconds>        Minimum run time of every micro benchmark (default: 1)\n"
+                  << "  -z, --zoom <maxZoom>            Max zoom of the end-to-end render (default: 6)\n"
+                  << "  -o, --output <file>             Write the JSON results here instead of stdout\n"
+                  << "  -h, --help                      Display this help message\n";
+    }
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Log::setObserver(std::make_unique<Log::NullObserver>());
+
+    BenchmarkSettings settings;
+    std::string outputPath;
+
+    static struct option long_options[] = {
+        {"filter", required_argument, nullptr, 'f'},
+        {"min-time", required_argument, nullptr, 't'},
+        {"zoom", required_argument, nullptr, 'z'},
+        {"output", required_argument, nullptr, 'o'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:t:z:o:h", long_options, nullptr)) != -1)
+    {
+        try
+        {
+            switch (opt)
+            {
+            case 'f':
+                settings.filter = optarg;
+                break;
+            case 't':
+                settings.minSeconds = std::stod(optarg);
+                break;
+            case 'z':
+                settings.renderZoom = std::clamp(std::stoi(optarg), 0, 12);
+                break;
+            case 'o':
+                outputPath = optarg;
+                break;
+            case 'h':
+                printHelp(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                printHelp(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: Invalid value for -" << static_cast<char>(opt) << ". " << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    fs::path directory = fs::temp_directory_path() / ("tilerender-benchmark-" + std::to_string(getpid()));
+    fs::create_directories(directory);
+
+    struct Group
+    {
+        const char *prefix;
+        std::function<void(std::vector<BenchmarkResult> &)> run;
+    };
+    std::vector<Group> groups = {
+        {"coordinates/", [&](auto &results)
+         { benchmarkCoordinates(settings, results); }},
+        {"encode/", [&](auto &results)
+         { benchmarkEncoders(settings, results); }},
+        {"mbtiles/", [&](auto &results)
+         { benchmarkStorage(settings, directory, results); }},
+        {"render/", [&](auto &results)
+         { benchmarkRender(settings, directory, results); }},
+    };
+
+    std::vector<BenchmarkResult> results;
+    for (const Group &group : groups)
+    {
+        std::cerr << "Running " << group.prefix << "..." << std::endl;
+        try
+        {
+            group.run(results);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Benchmark group " << group.prefix << " failed: " << e.what() << std::endl;
+            fs::remove_all(directory);
+            return EXIT_FAILURE;
+        }
+    }
+    fs::remove_all(directory);
+
+    if (outputPath.empty())
+    {
+        writeResults(std::cout, results);
+    }
+    else
+    {
+        std::ofstream file(outputPath, std::ios::trunc);
+        writeResults(file, results);
+        if (!file)
+        {
+            std::cerr << "Failed to write " << outputPath << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,66 @@
+#include "compression.hpp"
+
+#include <stdexcept>
+#include <zlib.h>
+
+bool isGzipped(const char *data, size_t size)
+{
+    return size >= 2 && static_cast<unsigned char>(data[0]) == 0x1f && static_cast<unsigned char>(data[1]) == 0x8b;
+}
+
+std::string gunzip(const char *data, size_t size)
+{
+    z_stream stream{};
+    // 32 + MAX_WBITS detects gzip and zlib headers automatically.
+    if (inflateInit2(&stream, 32 + MAX_WBITS) != Z_OK)
+    {
+        throw std::runtime_error("failed to initialize zlib");
+    }
+
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    stream.avail_in = static_cast<uInt>(size);
+
+    std::string output;
+    char buffer[16384];
+    int rc;
+    do
+    {
+        stream.next_out = reinterpret_cast<Bytef *>(buffer);
+        stream.avail_out = sizeof(buffer);
+        rc = inflate(&stream, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END)
+        {
+            inflateEnd(&stream);
+            throw std::runtime_error("corrupt gzip data");
+        }
+        output.append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (rc != Z_STREAM_END);
+
+    inflateEnd(&stream);
+    return output;
+}
+
+std::string gzip(const std::string &data)
+{
+    z_stream stream{};
+    // 16 + MAX_WBITS writes a gzip instead of a zlib header.
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error("failed to initialize zlib");
+    }
+
+    std::string output(deflateBound(&stream, data.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef *>(output.data());
+    stream.avail_out = static_cast<uInt>(output.size());
+
+    int rc = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (rc != Z_STREAM_END)
+    {
+        throw std::runtime_error("failed to compress data");
+    }
+    output.resize(stream.total_out);
+    return output;
+}
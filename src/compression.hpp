@@ -0,0 +1,16 @@
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <cstddef>
+#include <string>
+
+// True if the data starts with the gzip magic bytes.
+bool isGzipped(const char *data, size_t size);
+
+// Inflates gzip (or zlib) data. Throws std::runtime_error on corrupt input.
+std::string gunzip(const char *data, size_t size);
+
+// Compresses data into a gzip stream at the highest compression level.
+std::string gzip(const std::string &data);
+
+#endif // COMPRESSION_HPP
@@ -0,0 +1,255 @@
+#include "connection_pool.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+bool sendAll(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        sent += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Appends whatever the client has sent so far without waiting for more.
+// Returns false once the client closed the connection or it failed.
+static bool receiveAvailable(int fd, std::string &buffer, size_t limit)
+{
+    char chunk[4096];
+    while (buffer.size() <= limit)
+    {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (n > 0)
+        {
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+        else if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+    return true;
+}
+
+static std::string headerTooLargeResponse()
+{
+    std::string body = "Request header too large\n";
+    return "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+           "Content-Type: text/plain\r\n"
+           "Content-Length: " +
+           std::to_string(body.size()) + "\r\n" +
+           "Access-Control-Allow-Origin: *\r\n"
+           "Connection: close\r\n\r\n" +
+           body;
+}
+
+ConnectionPool::ConnectionPool(int threads, int idleSeconds, Handler handler)
+    : threads(threads), idleTimeout(idleSeconds), handler(std::move(handler))
+{
+}
+
+void ConnectionPool::serve(int listenFd, const std::atomic<bool> &stop)
+{
+    if (pipe(wakeFds) != 0)
+    {
+        throw std::runtime_error(std::string("Can't create a pipe: ") + std::strerror(errno));
+    }
+    fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+    stopping = false;
+
+    std::vector<std::thread> answerThreads;
+    for (int i = 0; i < threads; i++)
+    {
+        answerThreads.emplace_back([this]
+                                   { answerLoop(); });
+    }
+
+    // Connections waiting for (the rest of) their next request head, polled
+    // after the listener and the wake-up pipe.
+    std::vector<Connection> waiting;
+    std::vector<pollfd> polled;
+    while (!stop)
+    {
+        polled.assign({{listenFd, POLLIN, 0}, {wakeFds[0], POLLIN, 0}});
+        for (const Connection &connection : waiting)
+        {
+            polled.push_back({connection.fd, POLLIN, 0});
+        }
+
+        // Wakes up regularly to notice a stop request and expired connections.
+        poll(polled.data(), polled.size(), 500);
+        auto now = std::chrono::steady_clock::now();
+
+        std::vector<Connection> stillWaiting;
+        for (size_t i = 0; i < waiting.size(); i++)
+        {
+            Connection &connection = waiting[i];
+            bool open = polled[i + 2].revents == 0 || receiveAvailable(connection.fd, connection.buffer, maxRequestHeader);
+            if (connection.buffer.find("\r\n\r\n") != std::string::npos)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    pending.push_back(std::move(connection));
+                }
+                requestReady.notify_one();
+                continue;
+            }
+            if (open && connection.buffer.size() > maxRequestHeader)
+            {
+                sendAll(connection.fd, headerTooLargeResponse());
+                open = false;
+            }
+            if (!open || now >= connection.deadline)
+            {
+                close(connection.fd);
+                continue;
+            }
+            stillWaiting.push_back(std::move(connection));
+        }
+        waiting = std::move(stillWaiting);
+
+        if (polled[1].revents != 0)
+        {
+            char drained[256];
+            if (read(wakeFds[0], drained, sizeof(drained)) < 0 && errno != EINTR)
+            {
+                throw std::runtime_error(std::string("Can't read the wake-up pipe: ") + std::strerror(errno));
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Connection &connection : returned)
+            {
+                connection.deadline = now + idleTimeout;
+                waiting.push_back(std::move(connection));
+            }
+            returned.clear();
+        }
+
+        if (polled[0].revents != 0)
+        {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd >= 0)
+            {
+                // A client that stops reading a response gives up its thread
+                // after the same time.
+                timeval timeout{static_cast<time_t>(idleTimeout.count()), 0};
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                waiting.push_back({fd, std::string(), now + idleTimeout});
+            }
+        }
+    }
+
+    // Requests being answered are cut short by shutting their connections
+    // down, and everything else is just closed.
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (int fd : answering)
+        {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    requestReady.notify_all();
+    for (std::thread &thread : answerThreads)
+    {
+        thread.join();
+    }
+
+    for (const std::deque<Connection> *connections : {&pending, &returned})
+    {
+        for (const Connection &connection : *connections)
+        {
+            close(connection.fd);
+        }
+    }
+    pending.clear();
+    returned.clear();
+    for (const Connection &connection : waiting)
+    {
+        close(connection.fd);
+    }
+    close(wakeFds[0]);
+    close(wakeFds[1]);
+}
+
+void ConnectionPool::answerLoop()
+{
+    while (true)
+    {
+        Connection connection;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            requestReady.wait(lock, [this]
+                              { return stopping || !pending.empty(); });
+            if (stopping)
+            {
+                return;
+            }
+            connection = std::move(pending.front());
+            pending.pop_front();
+            answering.insert(connection.fd);
+        }
+
+        int fd = connection.fd;
+        bool handBack = answer(connection);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            answering.erase(fd);
+            handBack = handBack && !stopping;
+            if (handBack)
+            {
+                returned.push_back(std::move(connection));
+            }
+        }
+        if (handBack)
+        {
+            // A full pipe already has the polling thread awake.
+            [[maybe_unused]] ssize_t written = write(wakeFds[1], "", 1);
+        }
+        else
+        {
+            close(fd);
+        }
+    }
+}
+
+// Answers every complete request head in the buffer, which is more than one
+// if the client pipelines them. Returns false if the connection has to be
+// closed.
+bool ConnectionPool::answer(Connection &connection)
+{
+    size_t end;
+    while ((end = connection.buffer.find("\r\n\r\n")) != std::string::npos)
+    {
+        std::string head = connection.buffer.substr(0, end);
+        connection.buffer.erase(0, end + 4);
+        if (!handler(connection.fd, head))
+        {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,67 @@
+#ifndef CONNECTION_POOL_HPP
+#define CONNECTION_POOL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+// Writes all of `data`, returns false if the connection is gone or the client
+// stopped reading.
+bool sendAll(int fd, const std::string &data);
+
+// Serves HTTP/1.1 connections with a fixed number of threads. A single thread
+// polls the listening socket and every connection that is between requests,
+// reading request heads as they trickle in; a connection only takes one of
+// the threads once its request head is complete and hands it back after the
+// response. A connection whose next request head hasn't fully arrived
+// `idleSeconds` after it was accepted or last answered is closed, so idle
+// keep-alive connections and slow clients never hold a thread.
+class ConnectionPool
+{
+public:
+    // Answers one request, `head` being everything before the blank line.
+    // Returns false if the connection has to be closed afterwards.
+    using Handler = std::function<bool(int fd, const std::string &head)>;
+
+    ConnectionPool(int threads, int idleSeconds, Handler handler);
+
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+    // Accepts connections on `listenFd` and answers their requests until
+    // `stop` is set, then closes every connection once the requests being
+    // answered are done.
+    void serve(int listenFd, const std::atomic<bool> &stop);
+
+private:
+    struct Connection
+    {
+        int fd = -1;
+        std::string buffer; // received bytes not answered yet
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    void answerLoop();
+    bool answer(Connection &connection);
+
+    static constexpr size_t maxRequestHeader = 16384;
+
+    const int threads;
+    const std::chrono::seconds idleTimeout;
+    const Handler handler;
+
+    std::mutex mutex;
+    std::condition_variable requestReady;
+    std::deque<Connection> pending;  // complete request head, waiting for a thread
+    std::deque<Connection> returned; // answered, to be polled again
+    std::unordered_set<int> answering;
+    bool stopping = false;
+    int wakeFds[2] = {-1, -1}; // tells the polling thread about returned connections
+};
+
+#endif // CONNECTION_POOL_HPP
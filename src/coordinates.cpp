@@ -14,10 +14,10 @@ namespace mbgl
         return LatLng{lat, lon, mbgl::LatLng::Unwrapped};
     }
 
-    LatLng calculateNormalizedCenterCoords(int x, int y, int zoom)
+    LatLng calculateNormalizedCenterCoords(int x, int y, int zoom, int span)
     {
         LatLng nw = convertTilesToCoordinates(x, y, zoom);
-        LatLng se = convertTilesToCoordinates(x + 1, y + 1, zoom);
+        LatLng se = convertTilesToCoordinates(x + span, y + span, zoom);
 
         double mercatorNwY = std::log(std::tan(M_PI / 4.0 + (nw.latitude() * M_PI) / 360.0));
         double mercatorSeY = std::log(std::tan(M_PI / 4.0 + (se.latitude() * M_PI) / 360.0));
@@ -8,7 +8,8 @@ namespace mbgl
 
     LatLng convertTilesToCoordinates(int x, int y, int zoom);
 
-    LatLng calculateNormalizedCenterCoords(int x, int y, int zoom);
+    // Center of the span x span tile block whose north-west tile is (x, y).
+    LatLng calculateNormalizedCenterCoords(int x, int y, int zoom, int span = 1);
 
 } // namespace mbgl
 
@@ -0,0 +1,196 @@
+#include "encoder_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+EncoderPool::EncoderPool(int threadCount, size_t queueDepth, const std::vector<ImageFormat> &formats,
+                         const EncoderProfile &profile, StageHistograms &stages, Sink sink)
+    : formats(formats),
+      profile(profile),
+      encoders(makeEncoders()),
+      stages(stages),
+      sink(std::move(sink)),
+      queueDepth(std::max<size_t>(queueDepth, 1)),
+      maxSpareImages(this->queueDepth + threadCount + 1)
+{
+    for (int i = 0; i < threadCount; i++)
+    {
+        threads.emplace_back(&EncoderPool::run, this);
+    }
+}
+
+EncoderPool::~EncoderPool()
+{
+    finish();
+}
+
+void EncoderPool::submit(EncodeJob &&job)
+{
+    if (threads.empty())
+    {
+        encode(job, encoders);
+        recycle(std::move(job.image));
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [&]
+                 { return queue.size() < queueDepth; });
+    unfinished.insert(nextSequence);
+    queue.emplace_back(nextSequence++, std::move(job));
+    notEmpty.notify_one();
+}
+
+void EncoderPool::submitEncoded(int output, int zoom, int x, int tmsY, std::string_view data)
+{
+    std::lock_guard<std::mutex> lock(sinkMutex);
+    sink(output, zoom, x, tmsY, data);
+}
+
+mbgl::PremultipliedImage EncoderPool::takeImage(mbgl::Size size)
+{
+    {
+        std::lock_guard<std::mutex> lock(spareMutex);
+        for (auto image = spareImages.rbegin(); image != spareImages.rend(); ++image)
+        {
+            if (image->size == size)
+            {
+                mbgl::PremultipliedImage taken = std::move(*image);
+                spareImages.erase(std::next(image).base());
+                return taken;
+            }
+        }
+    }
+    return mbgl::PremultipliedImage(size);
+}
+
+// Keeps an encoded image for takeImage(). The pool never holds more images
+// than can be in flight at once.
+void EncoderPool::recycle(mbgl::PremultipliedImage &&image)
+{
+    std::lock_guard<std::mutex> lock(spareMutex);
+    if (image.valid() && spareImages.size() < maxSpareImages)
+    {
+        spareImages.push_back(std::move(image));
+    }
+}
+
+void EncoderPool::checkpoint(std::function<void()> reached)
+{
+    std::lock_guard<std::mutex> sinkLock(sinkMutex);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!unfinished.empty())
+        {
+            checkpoints.push_back({nextSequence, std::move(reached)});
+            return;
+        }
+    }
+    reached();
+}
+
+void EncoderPool::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    notEmpty.notify_all();
+
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    threads.clear();
+}
+
+std::vector<std::unique_ptr<mbgl::TileEncoder>> EncoderPool::makeEncoders() const
+{
+    std::vector<std::unique_ptr<mbgl::TileEncoder>> tileEncoders;
+    tileEncoders.reserve(formats.size());
+    for (ImageFormat format : formats)
+    {
+        tileEncoders.push_back(std::make_unique<mbgl::TileEncoder>(format));
+    }
+    return tileEncoders;
+}
+
+void EncoderPool::run()
+{
+    std::vector<std::unique_ptr<mbgl::TileEncoder>> threadEncoders = makeEncoders();
+    while (true)
+    {
+        uint64_t sequence;
+        EncodeJob job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [&]
+                          { return stopping || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            sequence = queue.front().first;
+            job = std::move(queue.front().second);
+            queue.pop_front();
+        }
+        notFull.notify_one();
+
+        encode(job, threadEncoders);
+        {
+            std::lock_guard<std::mutex> sinkLock(sinkMutex);
+            complete(sequence);
+        }
+        recycle(std::move(job.image));
+    }
+}
+
+// Runs with the sink lock held.
+void EncoderPool::complete(uint64_t sequence)
+{
+    std::vector<std::function<void()>> reached;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        unfinished.erase(sequence);
+        uint64_t oldest = unfinished.empty() ? nextSequence : *unfinished.begin();
+        while (!checkpoints.empty() && checkpoints.front().sequence <= oldest)
+        {
+            reached.push_back(std::move(checkpoints.front().reached));
+            checkpoints.pop_front();
+        }
+    }
+
+    for (auto &callback : reached)
+    {
+        callback();
+    }
+}
+
+// Hands the job to the sink once per format. The render is paid for once,
+// only the encoding is repeated.
+void EncoderPool::encode(const EncodeJob &job, std::vector<std::unique_ptr<mbgl::TileEncoder>> &tileEncoders)
+{
+    for (size_t format = 0; format < tileEncoders.size(); format++)
+    {
+        std::string_view encodedData = encodeTimed(job, *tileEncoders[format]);
+        std::lock_guard<std::mutex> lock(sinkMutex);
+        sink(static_cast<int>(job.size * tileEncoders.size() + format), job.zoom, job.x, job.tmsY, encodedData);
+    }
+}
+
+// Records the unpremultiply pass and the rest of the encoding as separate
+// stages. The data is valid until the encoder's next tile.
+std::string_view EncoderPool::encodeTimed(const EncodeJob &job, mbgl::TileEncoder &tileEncoder)
+{
+    uint64_t unpremultiplyNanoseconds = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::string_view encodedData = tileEncoder.encode(job.image, profile.at(job.zoom), &unpremultiplyNanoseconds);
+    uint64_t total = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    if (unpremultiplyNanoseconds > 0)
+    {
+        stages.record(Stage::Unpremultiply, job.zoom, unpremultiplyNanoseconds);
+    }
+    stages.record(Stage::Encode, job.zoom, total - std::min(total, unpremultiplyNanoseconds));
+    return encodedData;
+}
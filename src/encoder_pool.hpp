@@ -0,0 +1,107 @@
+#ifndef ENCODER_POOL_HPP
+#define ENCODER_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <mbgl/util/image.hpp>
+
+#include "image_encoding.hpp"
+#include "run_metrics.hpp"
+
+// A rendered tile waiting to be encoded.
+struct EncodeJob
+{
+    int size; // index of the tile size the image was rendered or halved for
+    int zoom;
+    int x;
+    int tmsY;
+    mbgl::PremultipliedImage image;
+};
+
+// Encodes rendered tiles on a set of background threads so the render loop can
+// move on to the next frame. The queue is bounded, so submit() blocks once
+// `queueDepth` images are waiting. With zero threads every job is encoded
+// synchronously inside submit(). Every job is encoded in each of the pool's
+// formats in turn by the thread that took it, and the tile of size index s in
+// format f goes to output s * formats + f. Every thread keeps its own
+// TileEncoder per format, and encoded images are kept for takeImage(), so a
+// warmed up pool hands tiles to the sink without allocating. Encode times are
+// recorded in `stages`.
+class EncoderPool
+{
+public:
+    // Receives every encoded tile. Calls are serialized by the pool. `data`
+    // is only valid during the call.
+    using Sink = std::function<void(int output, int zoom, int x, int tmsY, std::string_view data)>;
+
+    EncoderPool(int threads, size_t queueDepth, const std::vector<ImageFormat> &formats, const EncoderProfile &profile,
+                StageHistograms &stages, Sink sink);
+    ~EncoderPool();
+
+    EncoderPool(const EncoderPool &) = delete;
+    EncoderPool &operator=(const EncoderPool &) = delete;
+
+    void submit(EncodeJob &&job);
+
+    // Passes an already encoded tile straight to the sink.
+    void submitEncoded(int output, int zoom, int x, int tmsY, std::string_view data);
+
+    // An image of the size to render the next tile into, one that has been
+    // encoded already if there is one. Its pixels are undefined.
+    mbgl::PremultipliedImage takeImage(mbgl::Size size);
+
+    // Calls `reached` under the sink lock as soon as every tile submitted so
+    // far has been handed to the sink, without waiting for it here.
+    void checkpoint(std::function<void()> reached);
+
+    // Encodes everything still queued and stops the threads.
+    void finish();
+
+private:
+    struct Checkpoint
+    {
+        uint64_t sequence; // jobs numbered below it have to reach the sink first
+        std::function<void()> reached;
+    };
+
+    void run();
+    void encode(const EncodeJob &job, std::vector<std::unique_ptr<mbgl::TileEncoder>> &tileEncoders);
+    void complete(uint64_t sequence);
+    std::string_view encodeTimed(const EncodeJob &job, mbgl::TileEncoder &tileEncoder);
+    void recycle(mbgl::PremultipliedImage &&image);
+    std::vector<std::unique_ptr<mbgl::TileEncoder>> makeEncoders() const;
+
+    std::vector<ImageFormat> formats;
+    EncoderProfile profile;
+    std::vector<std::unique_ptr<mbgl::TileEncoder>> encoders; // used by submit() when there are no threads
+    StageHistograms &stages;
+    Sink sink;
+    size_t queueDepth;
+
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<std::pair<uint64_t, EncodeJob>> queue;
+    bool stopping = false;
+
+    uint64_t nextSequence = 0;
+    std::set<uint64_t> unfinished; // queued or being encoded
+    std::deque<Checkpoint> checkpoints;
+
+    std::mutex spareMutex;
+    std::vector<mbgl::PremultipliedImage> spareImages;
+    size_t maxSpareImages;
+
+    std::mutex sinkMutex;
+    std::vector<std::thread> threads;
+};
+
+#endif // ENCODER_POOL_HPP
@@ -1,73 +1,330 @@
 #include "image_encoding.hpp"
+#include "pixel_ops.hpp"
 #include <webp/encode.h>
 #include <jpeglib.h>
-#include <mbgl/util/premultiply.hpp>
+#include <zlib.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
 #include <vector>
 
 namespace mbgl {
 
-    std::string encodeWebP(const PremultipliedImage& pre) {
-        const auto src = util::unpremultiply(pre.clone());
+    namespace {
 
-        uint8_t* output_data = nullptr;
-        size_t output_size = WebPEncodeRGBA(
-            src.data.get(), src.size.width, src.size.height, src.stride(), 75.0f, &output_data);
+        // Adds the time spent in `convert` to `nanoseconds`, if given.
+        template <typename Convert>
+        void timed(uint64_t* nanoseconds, Convert&& convert) {
+            if (!nanoseconds) {
+                convert();
+                return;
+            }
+            auto start = std::chrono::steady_clock::now();
+            convert();
+            *nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
 
-        if (output_size == 0 || output_data == nullptr) {
-            throw std::runtime_error("WebP encoding failed");
+        // libjpeg destination writing into the encoder's output buffer, which
+        // only ever grows.
+        struct JPEGDestination {
+            jpeg_destination_mgr manager;
+            std::vector<uint8_t>* output;
+        };
+
+        // WebP writer appending to the encoder's output buffer.
+        int appendWebP(const uint8_t* data, size_t size, const WebPPicture* picture) {
+            auto* output = static_cast<std::vector<uint8_t>*>(picture->custom_ptr);
+            output->insert(output->end(), data, data + size);
+            return 1;
+        }
+
+        void startJPEGOutput(j_compress_ptr cinfo) {
+            auto* destination = reinterpret_cast<JPEGDestination*>(cinfo->dest);
+            std::vector<uint8_t>& output = *destination->output;
+            output.resize(std::max<size_t>(output.capacity(), 16384));
+            destination->manager.next_output_byte = output.data();
+            destination->manager.free_in_buffer = output.size();
+        }
+
+        // Called once the buffer is full.
+        boolean growJPEGOutput(j_compress_ptr cinfo) {
+            auto* destination = reinterpret_cast<JPEGDestination*>(cinfo->dest);
+            std::vector<uint8_t>& output = *destination->output;
+            size_t used = output.size();
+            output.resize(used * 2);
+            destination->manager.next_output_byte = output.data() + used;
+            destination->manager.free_in_buffer = output.size() - used;
+            return TRUE;
+        }
+
+        void endJPEGOutput(j_compress_ptr cinfo) {
+            auto* destination = reinterpret_cast<JPEGDestination*>(cinfo->dest);
+            destination->output->resize(destination->output->size() - destination->manager.free_in_buffer);
+        }
+
+        void appendBigEndian(std::vector<uint8_t>& output, uint32_t value) {
+            for (int shift = 24; shift >= 0; shift -= 8) {
+                output.push_back(static_cast<uint8_t>(value >> shift));
+            }
+        }
+
+        void appendPNGChunk(std::vector<uint8_t>& output, const char* type, const uint8_t* data, size_t size) {
+            appendBigEndian(output, static_cast<uint32_t>(size));
+            size_t start = output.size();
+            output.insert(output.end(), type, type + 4);
+            output.insert(output.end(), data, data + size);
+            appendBigEndian(output, static_cast<uint32_t>(crc32(0, output.data() + start, static_cast<uInt>(size + 4))));
         }
 
-        std::string webpData(reinterpret_cast<char*>(output_data), output_size);
-        WebPFree(output_data);
+    } // namespace
 
-        return webpData;
+    // The parts of the encoders that live as long as the TileEncoder.
+    struct TileEncoder::Compressor {
+        jpeg_compress_struct jpeg;
+        jpeg_error_mgr jpegErrors;
+        JPEGDestination jpegDestination;
+        z_stream zlib{};
+        int zlibLevel = -1; // -1 until the palette PNG deflater is initialised
+
+        explicit Compressor(std::vector<uint8_t>& output) {
+            jpeg.err = jpeg_std_error(&jpegErrors);
+            jpeg_create_compress(&jpeg);
+            jpegDestination.manager.init_destination = startJPEGOutput;
+            jpegDestination.manager.empty_output_buffer = growJPEGOutput;
+            jpegDestination.manager.term_destination = endJPEGOutput;
+            jpegDestination.output = &output;
+            jpeg.dest = &jpegDestination.manager;
+        }
+
+        ~Compressor() {
+            jpeg_destroy_compress(&jpeg);
+            if (zlibLevel >= 0) {
+                deflateEnd(&zlib);
+            }
+        }
+    };
+
+    TileEncoder::TileEncoder(ImageFormat format)
+        : format_(format), compressor(std::make_unique<Compressor>(output)) {
+    }
+
+    TileEncoder::~TileEncoder() = default;
+
+    std::string_view TileEncoder::encode(const PremultipliedImage& image, const EncoderSettings& settings,
+                                         uint64_t* unpremultiplyNanoseconds) {
+        switch (format_) {
+        case ImageFormat::JPEG:
+            return encodeJPEG(image, settings, unpremultiplyNanoseconds);
+        case ImageFormat::PNG:
+            if (settings.pngPalette && encodePalettePNG(image, settings.pngLevel)) {
+                return {reinterpret_cast<const char*>(output.data()), output.size()};
+            }
+            png = encodePNG(image);
+            return png;
+        case ImageFormat::WEBP:
+        default:
+            return encodeWebP(image, settings, unpremultiplyNanoseconds);
+        }
     }
 
-    std::string encodeJPEG(const PremultipliedImage& pre) {
-        const auto src = util::unpremultiply(pre.clone());
+    std::string_view TileEncoder::encodeWebP(const PremultipliedImage& pre, const EncoderSettings& settings,
+                                             uint64_t* unpremultiplyNanoseconds) {
+        // Balanced is what WebPEncodeRGBA() uses.
+        WebPConfig config;
+        if (!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, settings.quality)) {
+            throw std::runtime_error("WebP encoder version mismatch");
+        }
+        config.lossless = 0;
+        config.method = settings.webpMethod;
+
+        pixels.resize(pre.bytes());
+        timed(unpremultiplyNanoseconds, [&] { unpremultiplyRGBA(pre.data.get(), pixels.data(), pre.size.area()); });
 
-        struct jpeg_compress_struct cinfo;
-        struct jpeg_error_mgr jerr;
+        // The picture's YUV planes and libwebp's own state are allocated by
+        // every WebPEncode() call; its API has no way to keep them.
+        WebPPicture picture;
+        if (!WebPPictureInit(&picture)) {
+            throw std::runtime_error("WebP encoder version mismatch");
+        }
+        picture.width = static_cast<int>(pre.size.width);
+        picture.height = static_cast<int>(pre.size.height);
+        picture.writer = appendWebP;
+        picture.custom_ptr = &output;
 
-        unsigned char* mem = nullptr;
-        unsigned long mem_size = 0;
+        output.clear();
+        bool encoded = WebPPictureImportRGBA(&picture, pixels.data(), static_cast<int>(pre.stride())) &&
+                       WebPEncode(&config, &picture);
+        WebPPictureFree(&picture);
 
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_compress(&cinfo);
+        if (!encoded || output.empty()) {
+            throw std::runtime_error("WebP encoding failed");
+        }
+        return {reinterpret_cast<const char*>(output.data()), output.size()};
+    }
 
-        jpeg_mem_dest(&cinfo, &mem, &mem_size);
+    std::string_view TileEncoder::encodeJPEG(const PremultipliedImage& pre, const EncoderSettings& settings,
+                                             uint64_t* unpremultiplyNanoseconds) {
+        jpeg_compress_struct& cinfo = compressor->jpeg;
 
-        cinfo.image_width = src.size.width;
-        cinfo.image_height = src.size.height;
+        cinfo.image_width = pre.size.width;
+        cinfo.image_height = pre.size.height;
         cinfo.input_components = 3; // RGB
         cinfo.in_color_space = JCS_RGB;
 
         jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, 75, TRUE);
+        jpeg_set_quality(&cinfo, static_cast<int>(std::lround(settings.quality)), TRUE);
+        cinfo.optimize_coding = settings.jpegOptimize ? TRUE : FALSE;
+        cinfo.dct_method = settings.jpegFastDCT ? JDCT_IFAST : JDCT_ISLOW;
+        if (settings.jpegProgressive) {
+            jpeg_simple_progression(&cinfo);
+        }
 
+        // Finishing leaves the compressor ready for the next image.
         jpeg_start_compress(&cinfo, TRUE);
 
-        std::vector<JSAMPLE> row_buffer(src.size.width * 3);
+        pixels.resize(pre.size.width * 3);
         while (cinfo.next_scanline < cinfo.image_height) {
-            const uint8_t* src_row = src.data.get() + cinfo.next_scanline * src.stride();
-            for (size_t i = 0; i < src.size.width; ++i) {
-                row_buffer[i * 3 + 0] = src_row[i * 4 + 0]; // R
-                row_buffer[i * 3 + 1] = src_row[i * 4 + 1]; // G
-                row_buffer[i * 3 + 2] = src_row[i * 4 + 2]; // B
-            }
+            const uint8_t* src_row = pre.data.get() + cinfo.next_scanline * pre.stride();
+            timed(unpremultiplyNanoseconds, [&] { unpremultiplyRGB(src_row, pixels.data(), pre.size.width); });
 
-            JSAMPROW row_pointer = &row_buffer[0];
+            JSAMPROW row_pointer = pixels.data();
             jpeg_write_scanlines(&cinfo, &row_pointer, 1);
         }
 
         jpeg_finish_compress(&cinfo);
-        jpeg_destroy_compress(&cinfo);
+        return {reinterpret_cast<const char*>(output.data()), output.size()};
+    }
 
-        std::string jpegData(reinterpret_cast<char*>(mem), mem_size);
-        free(mem);
+    // Writes the tile as a palette PNG with the smallest bit depth that
+    // holds its colours into `output`. Returns false, leaving the output
+    // alone, if it has more than 256 colours.
+    bool TileEncoder::encodePalettePNG(const PremultipliedImage& pre, int level) {
+        // Open addressing from colour to palette index, with room to spare.
+        constexpr size_t slots = 1024;
+        std::array<uint32_t, slots> keys;
+        std::array<int16_t, slots> indexOf;
+        indexOf.fill(-1);
+        std::array<uint32_t, 256> colors;
+        size_t colorCount = 0;
 
-        return jpegData;
+        const size_t area = pre.size.area();
+        pixels.resize(area);
+        const uint8_t* data = pre.data.get();
+        for (size_t i = 0; i < area; i++) {
+            uint32_t color;
+            std::memcpy(&color, data + i * 4, 4);
+            size_t slot = (color * 2654435761u) >> 22;
+            while (indexOf[slot] >= 0 && keys[slot] != color) {
+                slot = (slot + 1) % slots;
+            }
+            if (indexOf[slot] < 0) {
+                if (colorCount == colors.size()) {
+                    return false;
+                }
+                keys[slot] = color;
+                indexOf[slot] = static_cast<int16_t>(colorCount);
+                colors[colorCount++] = color;
+            }
+            pixels[i] = static_cast<uint8_t>(indexOf[slot]);
+        }
+
+        // Colours that aren't opaque go first, so tRNS stops at the last of
+        // them.
+        std::array<uint8_t, 256> remap;
+        std::array<uint8_t, 256 * 4> palette; // straight alpha RGBA
+        size_t translucent = 0;
+        for (size_t pass = 0, next = 0; pass < 2; pass++) {
+            for (size_t i = 0; i < colorCount; i++) {
+                bool opaque = reinterpret_cast<const uint8_t*>(&colors[i])[3] == 0xff;
+                if (opaque == (pass == 1)) {
+                    remap[i] = static_cast<uint8_t>(next);
+                    unpremultiplyRGBA(reinterpret_cast<const uint8_t*>(&colors[i]), &palette[next * 4], 1);
+                    next++;
+                    translucent += pass == 0;
+                }
+            }
+        }
+
+        const int depth = colorCount <= 2 ? 1 : colorCount <= 4 ? 2 : colorCount <= 16 ? 4 : 8;
+        const uint32_t width = pre.size.width;
+        const size_t rowBytes = (size_t(width) * depth + 7) / 8;
+        scanlines.assign((rowBytes + 1) * pre.size.height, 0);
+        for (uint32_t y = 0; y < pre.size.height; y++) {
+            uint8_t* row = scanlines.data() + y * (rowBytes + 1) + 1; // after the filter type, 0 for none
+            const uint8_t* indices = pixels.data() + size_t(y) * width;
+            for (uint32_t x = 0; x < width; x++) {
+                size_t bit = size_t(x) * depth;
+                row[bit / 8] |= static_cast<uint8_t>(remap[indices[x]] << (8 - depth - bit % 8));
+            }
+        }
+
+        z_stream& zlib = compressor->zlib;
+        if (compressor->zlibLevel < 0) {
+            if (deflateInit(&zlib, level) != Z_OK) {
+                throw std::runtime_error("failed to initialize zlib");
+            }
+            compressor->zlibLevel = level;
+        } else {
+            deflateReset(&zlib);
+            if (level != compressor->zlibLevel) {
+                deflateParams(&zlib, level, Z_DEFAULT_STRATEGY);
+                compressor->zlibLevel = level;
+            }
+        }
+        deflated.resize(deflateBound(&zlib, scanlines.size()));
+        zlib.next_in = scanlines.data();
+        zlib.avail_in = static_cast<uInt>(scanlines.size());
+        zlib.next_out = deflated.data();
+        zlib.avail_out = static_cast<uInt>(deflated.size());
+        if (deflate(&zlib, Z_FINISH) != Z_STREAM_END) {
+            throw std::runtime_error("PNG compression failed");
+        }
+
+        static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        output.assign(signature, signature + sizeof(signature));
+
+        uint8_t header[13] = {};
+        for (int i = 0; i < 4; i++) {
+            header[i] = static_cast<uint8_t>(width >> (24 - 8 * i));
+            header[4 + i] = static_cast<uint8_t>(pre.size.height >> (24 - 8 * i));
+        }
+        header[8] = static_cast<uint8_t>(depth);
+        header[9] = 3; // palette colour type; compression, filter and interlace stay 0
+        appendPNGChunk(output, "IHDR", header, sizeof(header));
+
+        std::array<uint8_t, 256 * 3> rgb;
+        std::array<uint8_t, 256> alpha;
+        for (size_t i = 0; i < colorCount; i++) {
+            std::memcpy(&rgb[i * 3], &palette[i * 4], 3);
+            alpha[i] = palette[i * 4 + 3];
+        }
+        appendPNGChunk(output, "PLTE", rgb.data(), colorCount * 3);
+        if (translucent > 0) {
+            appendPNGChunk(output, "tRNS", alpha.data(), translucent);
+        }
+        appendPNGChunk(output, "IDAT", deflated.data(), zlib.total_out);
+        appendPNGChunk(output, "IEND", nullptr, 0);
+        return true;
+    }
+
+    std::string encodeWebP(const PremultipliedImage& image, const EncoderSettings& settings, uint64_t* unpremultiplyNanoseconds) {
+        return encodeImage(image, ImageFormat::WEBP, settings, unpremultiplyNanoseconds);
+    }
+
+    std::string encodeJPEG(const PremultipliedImage& image, const EncoderSettings& settings, uint64_t* unpremultiplyNanoseconds) {
+        return encodeImage(image, ImageFormat::JPEG, settings, unpremultiplyNanoseconds);
+    }
+
+    std::string encodeImage(const PremultipliedImage& image, ImageFormat format, const EncoderSettings& settings,
+                            uint64_t* unpremultiplyNanoseconds) {
+        TileEncoder encoder(format);
+        return std::string(encoder.encode(image, settings, unpremultiplyNanoseconds));
     }
 
 } // namespace mbgl
@@ -86,4 +343,173 @@ std::string imageString(ImageFormat format)
     default:
         throw std::runtime_error("Invalid image format");
     }
-}
\ No newline at end of file
+}
+
+EncoderSettings encoderPreset(const std::string &name)
+{
+    EncoderSettings settings;
+    if (name == "fast")
+    {
+        settings.webpMethod = 0;
+        settings.jpegFastDCT = true;
+        settings.pngLevel = 1;
+    }
+    else if (name == "smallest")
+    {
+        settings.webpMethod = 6;
+        settings.jpegOptimize = true;
+        settings.jpegProgressive = true;
+        settings.pngLevel = 9;
+    }
+    else if (name != "balanced")
+    {
+        throw std::invalid_argument("Unknown encoder preset '" + name + "', use fast, balanced or smallest.");
+    }
+    return settings;
+}
+
+std::string encoderSettingsString(const EncoderSettings &settings)
+{
+    for (const char *name : {"balanced", "fast", "smallest"})
+    {
+        if (settings == encoderPreset(name))
+        {
+            return name;
+        }
+    }
+
+    std::ostringstream text;
+    text << "quality=" << settings.quality << ",method=" << settings.webpMethod
+         << ",optimize=" << settings.jpegOptimize << ",progressive=" << settings.jpegProgressive
+         << ",fast-dct=" << settings.jpegFastDCT << ",palette=" << settings.pngPalette
+         << ",png-level=" << settings.pngLevel;
+    return text.str();
+}
+
+namespace
+{
+
+    int parseSetting(const std::string &key, const std::string &value, int min, int max)
+    {
+        size_t end = 0;
+        int number = -1;
+        try
+        {
+            number = std::stoi(value, &end);
+        }
+        catch (const std::exception &)
+        {
+        }
+        if (end != value.size() || number < min || number > max)
+        {
+            throw std::invalid_argument(key + " must be between " + std::to_string(min) + " and " + std::to_string(max) + ".");
+        }
+        return number;
+    }
+
+    void applySetting(const std::string &item, EncoderSettings &settings)
+    {
+        size_t equals = item.find('=');
+        if (equals == std::string::npos)
+        {
+            settings = encoderPreset(item);
+            return;
+        }
+
+        std::string key = item.substr(0, equals);
+        std::string value = item.substr(equals + 1);
+        if (key == "quality")
+        {
+            settings.quality = static_cast<float>(parseSetting(key, value, 0, 100));
+        }
+        else if (key == "method")
+        {
+            settings.webpMethod = parseSetting(key, value, 0, 6);
+        }
+        else if (key == "optimize")
+        {
+            settings.jpegOptimize = parseSetting(key, value, 0, 1);
+        }
+        else if (key == "progressive")
+        {
+            settings.jpegProgressive = parseSetting(key, value, 0, 1);
+        }
+        else if (key == "fast-dct")
+        {
+            settings.jpegFastDCT = parseSetting(key, value, 0, 1);
+        }
+        else if (key == "palette")
+        {
+            settings.pngPalette = parseSetting(key, value, 0, 1);
+        }
+        else if (key == "png-level")
+        {
+            settings.pngLevel = parseSetting(key, value, 0, 9);
+        }
+        else
+        {
+            throw std::invalid_argument("Unknown encoder setting '" + key + "'.");
+        }
+    }
+
+} // namespace
+
+void EncoderProfile::apply(const std::string &text)
+{
+    int minZoom = 0;
+    int maxZoom = zoomLevels - 1;
+    std::string list = text;
+
+    size_t colon = text.find(':');
+    if (colon != std::string::npos)
+    {
+        std::string range = text.substr(0, colon);
+        list = text.substr(colon + 1);
+        size_t dash = range.find('-');
+        minZoom = parseSetting("Zoom", range.substr(0, dash), 0, zoomLevels - 1);
+        if (dash == std::string::npos)
+        {
+            maxZoom = minZoom;
+        }
+        else if (dash + 1 < range.size())
+        {
+            maxZoom = parseSetting("Zoom", range.substr(dash + 1), minZoom, zoomLevels - 1);
+        }
+    }
+
+    // Parse into a copy, so a bad item changes nothing.
+    std::array<EncoderSettings, zoomLevels> changed = zooms;
+    std::istringstream items(list);
+    std::string item;
+    bool any = false;
+    while (std::getline(items, item, ','))
+    {
+        for (int zoom = minZoom; zoom <= maxZoom; zoom++)
+        {
+            applySetting(item, changed[zoom]);
+        }
+        any = true;
+    }
+    if (!any)
+    {
+        throw std::invalid_argument("No preset or setting given.");
+    }
+    zooms = changed;
+}
+
+std::string EncoderProfile::describe(int maxZoom) const
+{
+    std::string text;
+    for (int zoom = 0; zoom <= maxZoom;)
+    {
+        int last = zoom;
+        while (last < maxZoom && at(last + 1) == at(zoom))
+        {
+            last++;
+        }
+        text += (text.empty() ? "" : ", ") + std::to_string(zoom) + (last > zoom ? "-" + std::to_string(last) : "") +
+                " " + encoderSettingsString(at(zoom));
+        zoom = last + 1;
+    }
+    return text;
+}
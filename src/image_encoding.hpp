@@ -1,23 +1,115 @@
 #ifndef IMAGE_ENCODING_HPP
 #define IMAGE_ENCODING_HPP
 
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <mbgl/util/image.hpp>
 
-namespace mbgl {
-
-    std::string encodeWebP(const PremultipliedImage& image);
-
-    std::string encodeJPEG(const PremultipliedImage& image);
-
-} // namespace mbgl
-
 enum class ImageFormat {
     PNG,
     JPEG,
     WEBP
 };
 
+// How hard the encoders work for smaller tiles. The defaults are the
+// "balanced" preset.
+struct EncoderSettings {
+    float quality = 75;           // WebP and JPEG, 0 to 100
+    int webpMethod = 4;           // 0 is fastest, 6 smallest
+    bool jpegOptimize = false;    // optimal Huffman tables
+    bool jpegProgressive = false;
+    bool jpegFastDCT = false;     // faster, slightly less accurate transform
+    bool pngPalette = true;       // tiles of 256 colours or fewer as palette PNGs
+    int pngLevel = 6;             // zlib level of palette PNGs, 0 to 9
+
+    bool operator==(const EncoderSettings&) const = default;
+};
+
+// "fast", "balanced" or "smallest". Throws std::invalid_argument.
+EncoderSettings encoderPreset(const std::string& name);
+
+// The preset name if the settings are one, else their key=value list.
+std::string encoderSettingsString(const EncoderSettings& settings);
+
+// Encoder settings of every zoom level.
+class EncoderProfile {
+public:
+    static constexpr int zoomLevels = 23;
+
+    const EncoderSettings& at(int zoom) const { return zooms[zoom < 0 ? 0 : zoom < zoomLevels ? zoom : zoomLevels - 1]; }
+
+    // Applies a -E value to its zooms: an optional "z:" or "z0-z1:" prefix
+    // (an open "z0-" runs to the last zoom), then a comma separated list of
+    // presets and key=value pairs applied in order, e.g. "smallest",
+    // "fast,quality=80" or "12-:method=2". Throws std::invalid_argument.
+    void apply(const std::string& text);
+
+    // Ranges of zooms up to maxZoom with the same settings, e.g.
+    // "0-9 smallest, 10-14 fast".
+    std::string describe(int maxZoom) const;
+
+private:
+    std::array<EncoderSettings, zoomLevels> zooms;
+};
+
+namespace mbgl {
+
+    // With `unpremultiplyNanoseconds`, the time spent converting the pixels
+    // to straight alpha is added to it. PNG is converted inside mbgl and
+    // adds nothing. A PNG tile of 256 colours or fewer is written as a
+    // palette PNG if the settings allow it, which is lossless.
+    std::string encodeWebP(const PremultipliedImage& image, const EncoderSettings& settings = {},
+                           uint64_t* unpremultiplyNanoseconds = nullptr);
+
+    std::string encodeJPEG(const PremultipliedImage& image, const EncoderSettings& settings = {},
+                           uint64_t* unpremultiplyNanoseconds = nullptr);
+
+    std::string encodeImage(const PremultipliedImage& image, ImageFormat format, const EncoderSettings& settings = {},
+                            uint64_t* unpremultiplyNanoseconds = nullptr);
+
+    // Encodes tile after tile in one format. The straight alpha pixels, the
+    // JPEG compressor and the output buffer are kept from one tile to the
+    // next, so once they have grown to the tile size encoding allocates
+    // nothing of its own. Not thread safe, use one per thread.
+    class TileEncoder {
+    public:
+        explicit TileEncoder(ImageFormat format);
+        ~TileEncoder();
+
+        TileEncoder(const TileEncoder&) = delete;
+        TileEncoder& operator=(const TileEncoder&) = delete;
+
+        // The returned bytes stay valid until the next call. Output is the
+        // same as encodeImage()'s.
+        std::string_view encode(const PremultipliedImage& image, const EncoderSettings& settings = {},
+                                uint64_t* unpremultiplyNanoseconds = nullptr);
+
+        ImageFormat format() const { return format_; }
+
+    private:
+        struct Compressor;
+
+        std::string_view encodeWebP(const PremultipliedImage& image, const EncoderSettings& settings,
+                                    uint64_t* unpremultiplyNanoseconds);
+        std::string_view encodeJPEG(const PremultipliedImage& image, const EncoderSettings& settings,
+                                    uint64_t* unpremultiplyNanoseconds);
+        bool encodePalettePNG(const PremultipliedImage& image, int level);
+
+        ImageFormat format_;
+        std::unique_ptr<Compressor> compressor;
+        std::vector<uint8_t> pixels;    // straight alpha input of the compressor, or palette indices
+        std::vector<uint8_t> scanlines; // palette PNG rows before deflating
+        std::vector<uint8_t> deflated;
+        std::vector<uint8_t> output;
+        std::string png;                // mbgl's PNG encoder returns its own string
+    };
+
+} // namespace mbgl
+
 std::string imageString(ImageFormat format);
 
 #endif // IMAGE_ENCODING_HPP
@@ -1,171 +1,331 @@
-#include <mbgl/map/map.hpp>
-#include <mbgl/map/map_options.hpp>
-#include <mbgl/util/image.hpp>
-#include <mbgl/util/run_loop.hpp>
 #include <mbgl/util/logging.hpp>
-#include <mbgl/gfx/headless_frontend.hpp>
-#include <mbgl/style/style.hpp>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string>
+#include <cerrno>
+#include <iomanip>
 #include <cstdint>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <thread>
 #include <vector>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <sqlite3.h>
+#include <poll.h>
 #include <getopt.h>
 #include <filesystem>
 
 #include "image_encoding.hpp"
 #include "mbtiles.hpp"
-#include "coordinates.hpp"
+#include "pmtiles.hpp"
+#include "pyramid.hpp"
+#include "renderer.hpp"
+#include "run_metrics.hpp"
+#include "source_diff.hpp"
+#include "tile_cover.hpp"
+#include "tile_order.hpp"
+#include "tile_scheduler.hpp"
+#include "tile_server.hpp"
+#include "tile_shard.hpp"
+#include "tile_stream.hpp"
 
 namespace fs = std::filesystem;
 
-void renderTiles(int processId, int numProcesses, int maxZoom, const char *style_url, ImageFormat imageFormat, const char *dbPath)
+void printHelp(const char *programName)
 {
-    double pixelRatio = 1.0;
-    uint32_t width = 512;
-    uint32_t height = 512;
-
-    using namespace mbgl;
-
-    util::RunLoop loop;
-
-    HeadlessFrontend frontend({width, height}, static_cast<float>(pixelRatio));
-    Map map(
-        frontend,
-        MapObserver::nullObserver(),
-        MapOptions()
-            .withMapMode(MapMode::Tile)
-            .withSize(frontend.getSize())
-            .withPixelRatio(static_cast<float>(pixelRatio)),
-        ResourceOptions()
-            .withCachePath("")
-            .withMaximumCacheSize(0)
-            .withAssetPath("")
-            .withApiKey(""));
+    std::cout << "Usage: " << programName << " [options]\n"
+              << "       " << programName << " serve [options]   Render tiles on request over HTTP\n"
+              << "       " << programName << " merge -o <output.mbtiles> [-d] <input.mbtiles>...   Merge the outputs of --shard runs\n\n"
+              << "Options:\n"
+              << "  -s, --style <style_url>         URL of the style to use, can be a local file or a remote URL (required!)\n"
+              << "  -z, --zoom <maxZoom>            Maximum zoom level (integer)\n"
+              << "  -p, --processes <numProcesses>  Number of parallel processes (integer)\n"
+              << "  -o, --output <outputDbPath>     Path to the output database, .mbtiles or .pmtiles\n"
+              << "  -f, --format <list>             Image formats to write from one render: 'webp', 'jpg' or 'png', e.g. webp,png\n"
+              << "  -E, --encoder <settings>        Encoder preset 'fast', 'balanced' or 'smallest' and key=value settings,\n"
+              << "                                  for the zooms of an optional 'z0-z1:' prefix, repeatable (default: balanced)\n"
+              << "  -m, --metatile <N>              Render N x N tiles per frame: 1, 2, 4 or 8 (default: 1)\n"
+              << "  -b, --buffer <pixels>           Extra pixels rendered around each frame (default: 0)\n"
+              << "  -c, --chunk <N>                 Tiles per side of the chunks handed to workers (default: 8)\n"
+              << "  -e, --encoders <N>              Encoder threads per process, 0 encodes on the render thread (default: 0)\n"
+              << "  -q, --queue-depth <N>           Rendered tiles that may wait for an encoder thread (default: 8)\n"
+              << "  -u, --prune-uniform <zoom>      From this zoom on, copy uniform tiles down to the max zoom instead of rendering below them\n"
+              << "  -d, --dedup                     Store identical tiles once (MBTiles images/map layout)\n"
+              << "  -R, --render-from-zoom <zoom>   Render only from this zoom on and downsample the zooms below it\n"
+              << "  -B, --bbox <w,s,e,n>            Only render tiles touching this longitude/latitude box\n"
+              << "  -P, --polygon <file.geojson>    Only render tiles touching the (multi)polygons of this GeoJSON file\n"
+              << "  -C, --cache <dir>               Share downloaded styles, sprites, glyphs and source tiles between workers and runs\n"
+              << "  -r, --resume                    Continue an interrupted render into the existing output\n"
+              << "  -L, --bulk-load                 Write the output without journal or fsync and build its index at the end\n"
+              << "  -t, --threads                   Run the -p workers as threads of one process instead of forked processes\n"
+              << "  -S, --tile-sizes <list>         Tile sizes in pixels to write from one render, e.g. 256,512 (default: 512)\n"
+              << "  -O, --order <order>             Render order: 'row', 'zorder' or 'hilbert' (default: hilbert)\n"
+              << "  -M, --source-cache <MB>         Memory for recently used vector source tiles, split between workers, 0 disables (default: 256)\n"
+              << "  -x, --metrics <file>            Write run metrics to this file, Prometheus text for .prom, JSON otherwise\n"
+              << "  -U, --update <old,new>          Re-render only the tiles showing source tiles that differ between two archives\n"
+              << "  -N, --shard <i/N>               Render only the i-th of N equal, spatially coherent shares of the tiles\n"
+              << "  -h, --help                      Display this help message\n\n"
+              << "Serve options (-p renderers, -o optional MBTiles every rendered tile is written back to):\n"
+              << "  -l, --listen <[address:]port>   Address to listen on (default: 0.0.0.0:8080)\n"
+              << "  -T, --tile-cache <MB>           Memory for encoded tiles (default: 512)\n\n"
+              << "Example:\n"
+              << "  " << programName << " -s https://demotiles.maplibre.org/style.json -z 6 -p 24 -o demotiles.mbtiles -f webp\n";
+}
 
-    map.getStyle().loadURL(style_url);
+static bool isPMTilesPath(const std::string &path)
+{
+    return fs::path(path).extension() == ".pmtiles";
+}
 
-    sqlite3 *db;
-    int rc = sqlite3_open(dbPath, &db);
-    if (rc)
+// Opens the output of one tile size and format. MBTiles outputs have to exist already.
+static std::unique_ptr<TileSink> openTileSink(const std::string &path, ImageFormat format, bool deduplicate, bool bulkLoad)
+{
+    if (!isPMTilesPath(path))
     {
-        std::cerr << "Can't open database: " << sqlite3_errmsg(db) << std::endl;
-        sqlite3_close(db);
-        exit(1);
+        return std::make_unique<MBTilesWriter>(path.c_str(), deduplicate, bulkLoad);
     }
 
-    const char *insertSQL = "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?);";
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(db, insertSQL, -1, &stmt, nullptr);
-    if (rc != SQLITE_OK)
+    PMTilesTileType tileType = PMTilesTileType::WEBP;
+    if (format == ImageFormat::PNG)
+    {
+        tileType = PMTilesTileType::PNG;
+    }
+    else if (format == ImageFormat::JPEG)
     {
-        std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-        sqlite3_close(db);
-        exit(1);
+        tileType = PMTilesTileType::JPEG;
     }
+    return std::make_unique<PMTilesWriter>(path, tileType);
+}
 
-    for (int zoom = 0; zoom <= maxZoom; zoom++)
+// With several tile sizes or image formats every output gets its own file
+// next to the given path: tiles.mbtiles becomes tiles-256.mbtiles,
+// tiles-512.mbtiles, ... for sizes, tiles-webp.mbtiles, tiles-png.mbtiles, ...
+// for formats and tiles-512-webp.mbtiles, ... for both. Paths are in output
+// order, see outputCount().
+static std::vector<std::string> outputPaths(const std::string &outputPath, const RenderOptions &options)
+{
+    if (outputCount(options) == 1)
     {
-        int numOfTiles = 1 << zoom;
+        return {outputPath};
+    }
 
-        rc = sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
-        if (rc != SQLITE_OK)
+    fs::path path(outputPath);
+    std::vector<std::string> paths;
+    for (size_t output = 0; output < outputCount(options); output++)
+    {
+        std::string suffix;
+        if (options.tileSizes.size() > 1)
         {
-            std::cerr << "Failed to begin transaction: " << sqlite3_errmsg(db) << std::endl;
+            suffix += "-" + std::to_string(outputTileSize(options, output));
         }
-
-        for (int x = 0; x < numOfTiles; x++)
+        if (options.imageFormats.size() > 1)
         {
-            for (int y = processId; y < numOfTiles; y += numProcesses)
-            {
-
-                LatLng center = calculateNormalizedCenterCoords(x, y, zoom);
+            suffix += "-" + imageString(outputFormat(options, output));
+        }
+        fs::path named = path;
+        named.replace_filename(path.stem().string() + suffix + path.extension().string());
+        paths.push_back(named.string());
+    }
+    return paths;
+}
 
-                map.jumpTo(CameraOptions()
-                               .withCenter(center)
-                               .withZoom(zoom));
+// Prints tiles done, rate and time left. On a terminal the line is redrawn in
+// place, otherwise a new line is written every time.
+static void printProgress(uint64_t tiles, uint64_t expectedTiles, double seconds, bool terminal)
+{
+    double rate = seconds > 0 ? tiles / seconds : 0;
+    std::cout << (terminal ? "\r" : "") << "Progress: " << tiles << "/" << expectedTiles << " tiles ("
+              << std::fixed << std::setprecision(1) << (expectedTiles > 0 ? 100.0 * tiles / expectedTiles : 100.0) << "%), "
+              << static_cast<uint64_t>(rate) << " tiles/s, ETA ";
+    if (rate > 0 && tiles < expectedTiles)
+    {
+        uint64_t left = static_cast<uint64_t>((expectedTiles - tiles) / rate);
+        std::cout << left / 3600 << "h" << std::setw(2) << std::setfill('0') << left / 60 % 60 << "m"
+                  << std::setw(2) << left % 60 << "s" << std::setfill(' ');
+    }
+    else
+    {
+        std::cout << "-";
+    }
+    std::cout << std::defaultfloat << (terminal ? "   " : "\n") << std::flush;
+}
 
-                auto image = frontend.render(map).image;
-                std::string encodedData;
+// Parses a comma separated list of tile sizes into options.tileSizes, largest
+// first. Every size has to be a power of two so the smaller ones can be halved
+// from the largest.
+static void parseTileSizes(const std::string &list, RenderOptions &options)
+{
+    std::vector<uint32_t> sizes;
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = std::min(list.find(',', start), list.size());
+        int size = std::stoi(list.substr(start, end - start));
+        if (size < 64 || size > 4096 || (size & (size - 1)) != 0)
+        {
+            throw std::out_of_range("Tile sizes must be powers of two between 64 and 4096.");
+        }
+        sizes.push_back(static_cast<uint32_t>(size));
+        start = end + 1;
+    }
 
-                switch (imageFormat)
-                {
-                case ImageFormat::WEBP:
-                    encodedData = encodeWebP(image);
-                    break;
-                case ImageFormat::JPEG:
-                    encodedData = encodeJPEG(image);
-                    break;
-                case ImageFormat::PNG:
-                    encodedData = encodePNG(image);
-                    break;
-                default:
-                    encodedData = encodeWebP(image);
-                    break;
-                }
+    std::sort(sizes.begin(), sizes.end(), std::greater<uint32_t>());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+    options.tileSizes = sizes;
+}
 
-                int tmsY = (1 << zoom) - 1 - y;
+// Parses a comma separated list of image formats into options.imageFormats,
+// in the order given. Every format gets its own outputs from the same render.
+static void parseImageFormats(std::string list, RenderOptions &options)
+{
+    std::transform(list.begin(), list.end(), list.begin(), [](unsigned char c)
+                   { return std::tolower(c); });
 
-                rc = sqlite3_bind_int(stmt, 1, zoom);
-                rc |= sqlite3_bind_int(stmt, 2, x);
-                rc |= sqlite3_bind_int(stmt, 3, tmsY);
-                rc |= sqlite3_bind_blob(stmt, 4, encodedData.data(), encodedData.size(), SQLITE_TRANSIENT);
+    std::vector<ImageFormat> formats;
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = std::min(list.find(',', start), list.size());
+        std::string name = list.substr(start, end - start);
+        ImageFormat format;
+        if (name == "webp")
+        {
+            format = ImageFormat::WEBP;
+        }
+        else if (name == "jpg" || name == "jpeg")
+        {
+            format = ImageFormat::JPEG;
+        }
+        else if (name == "png")
+        {
+            format = ImageFormat::PNG;
+        }
+        else
+        {
+            throw std::invalid_argument("Choose 'webp', 'jpg', or 'png', or a comma separated list of them.");
+        }
+        if (std::find(formats.begin(), formats.end(), format) == formats.end())
+        {
+            formats.push_back(format);
+        }
+        start = end + 1;
+    }
+    options.imageFormats = formats;
+}
 
-                if (rc != SQLITE_OK)
-                {
-                    std::cerr << "Failed to bind parameters: " << sqlite3_errmsg(db) << std::endl;
-                }
+// Comma separated names of the image formats, for metadata and messages.
+static std::string imageFormatList(const RenderOptions &options)
+{
+    std::string list;
+    for (ImageFormat format : options.imageFormats)
+    {
+        list += (list.empty() ? "" : ",") + imageString(format);
+    }
+    return list;
+}
 
-                rc = sqlite3_step(stmt);
-                if (rc != SQLITE_DONE)
-                {
-                    std::cerr << "Failed to execute statement: " << sqlite3_errmsg(db) << std::endl;
-                }
+// tilerender merge: combines the outputs of --shard runs into one file.
+static int mergeMain(int argc, char *argv[])
+{
+    std::string outputPath;
+    bool deduplicate = false;
 
-                sqlite3_reset(stmt);
-                sqlite3_clear_bindings(stmt);
-            }
-        }
+    static struct option long_options[] = {
+        {"output", required_argument, nullptr, 'o'},
+        {"dedup", no_argument, nullptr, 'd'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}};
 
-        rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
-        if (rc != SQLITE_OK)
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:dh", long_options, nullptr)) != -1)
+    {
+        switch (opt)
         {
-            std::cerr << "Failed to commit transaction: " << sqlite3_errmsg(db) << std::endl;
+        case 'o':
+            outputPath = optarg;
+            break;
+        case 'd':
+            deduplicate = true;
+            break;
+        default:
+            std::cout << "Usage: tilerender merge -o <output.mbtiles> [-d] <input.mbtiles>...\n";
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
         }
     }
 
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
-}
+    std::vector<std::string> inputs(argv + optind, argv + argc);
+    if (outputPath.empty() || inputs.empty())
+    {
+        std::cerr << "Error: merge needs an output (-o) and at least one input.\n";
+        return EXIT_FAILURE;
+    }
+    if (isPMTilesPath(outputPath) || fs::exists(outputPath))
+    {
+        std::cerr << "Error: The output of merge has to be a new MBTiles file.\n";
+        return EXIT_FAILURE;
+    }
 
-void printHelp(const char *programName)
-{
-    std::cout << "Usage: " << programName << " [options]\n\n"
-              << "Options:\n"
-              << "  -s, --style <style_url>         URL of the style to use, can be a local file or a remote URL (required!)\n"
-              << "  -z, --zoom <maxZoom>            Maximum zoom level (integer)\n"
-              << "  -p, --processes <numProcesses>  Number of parallel processes (integer)\n"
-              << "  -o, --output <outputDbPath>     Path to the output database\n"
-              << "  -f, --format <imageFormat>      Image format: 'webp', 'jpg', or 'png'\n"
-              << "  -h, --help                      Display this help message\n\n"
-              << "Example:\n"
-              << "  " << programName << " -s https://demotiles.maplibre.org/style.json -z 6 -p 24 -o demotiles.mbtiles -f webp\n";
+    auto start = std::chrono::steady_clock::now();
+    MergeResult result;
+    try
+    {
+        result = mergeMBTiles(inputs, outputPath, deduplicate);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error: Can't merge. " << e.what() << std::endl;
+        fs::remove(outputPath);
+        return EXIT_FAILURE;
+    }
+
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    std::cout << "Merged " << result.tiles << " tiles from " << inputs.size() << " files into " << outputPath << " in "
+              << seconds.count() << " s (" << static_cast<uint64_t>(result.tiles / std::max(seconds.count(), 1e-9)) << " tiles/s)." << std::endl;
+    if (result.duplicates > 0)
+    {
+        std::cerr << "Warning: " << result.duplicates << " tiles were in more than one input, the first one was kept." << std::endl;
+    }
+    return EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && std::string(argv[1]) == "merge")
+    {
+        return mergeMain(argc - 1, argv + 1);
+    }
 
     mbgl::Log::setObserver(std::make_unique<mbgl::Log::NullObserver>());
 
-    std::string style_url;
-    int maxZoom = 5;
+    RenderOptions options;
     int numProcesses = std::thread::hardware_concurrency();
     if (numProcesses == 0) numProcesses = 1; // fallback to 1 process if hardware_concurrency() returns 0
     std::string outputPath = "./tiles.mbtiles";
-    ImageFormat imageFormat = ImageFormat::WEBP;
+    bool deduplicate = false;
+    std::string bboxArg;
+    std::string polygonPath;
+    bool resume = false;
+    bool threaded = false;
+    bool bulkLoad = false;
+    std::string metricsPath;
+    std::string updateArg;
+    bool outputGiven = false;
+    bool serveOptionGiven = false;
+    std::string shardArg;
+    ServeOptions serveOptions;
+
+    // `serve` is the only subcommand; the options that follow are parsed as
+    // usual.
+    bool serving = argc > 1 && std::string(argv[1]) == "serve";
+    if (serving)
+    {
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
 
     // Command-line options parsing
     static struct option long_options[] = {
@@ -174,23 +334,46 @@ int main(int argc, char *argv[])
         {"processes", required_argument, nullptr, 'p'},
         {"output", required_argument, nullptr, 'o'},
         {"format", required_argument, nullptr, 'f'},
+        {"metatile", required_argument, nullptr, 'm'},
+        {"buffer", required_argument, nullptr, 'b'},
+        {"chunk", required_argument, nullptr, 'c'},
+        {"encoders", required_argument, nullptr, 'e'},
+        {"encoder", required_argument, nullptr, 'E'},
+        {"queue-depth", required_argument, nullptr, 'q'},
+        {"prune-uniform", required_argument, nullptr, 'u'},
+        {"dedup", no_argument, nullptr, 'd'},
+        {"render-from-zoom", required_argument, nullptr, 'R'},
+        {"bbox", required_argument, nullptr, 'B'},
+        {"polygon", required_argument, nullptr, 'P'},
+        {"cache", required_argument, nullptr, 'C'},
+        {"resume", no_argument, nullptr, 'r'},
+        {"tile-sizes", required_argument, nullptr, 'S'},
+        {"threads", no_argument, nullptr, 't'},
+        {"bulk-load", no_argument, nullptr, 'L'},
+        {"order", required_argument, nullptr, 'O'},
+        {"source-cache", required_argument, nullptr, 'M'},
+        {"metrics", required_argument, nullptr, 'x'},
+        {"update", required_argument, nullptr, 'U'},
+        {"listen", required_argument, nullptr, 'l'},
+        {"tile-cache", required_argument, nullptr, 'T'},
+        {"shard", required_argument, nullptr, 'N'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, 0, nullptr, 0}};
 
     int opt;
     // Parse command-line options
-    while ((opt = getopt_long(argc, argv, "s:z:p:o:f:h", long_options, nullptr)) != -1)
+    while ((opt = getopt_long(argc, argv, "s:z:p:o:f:E:m:b:c:e:q:u:dR:B:P:C:rS:tLO:M:x:U:l:T:N:h", long_options, nullptr)) != -1)
     {
         switch (opt)
         {
         case 's':
-            style_url = optarg;
+            options.styleUrl = optarg;
             break;
         case 'z':
             try
             {
-                maxZoom = std::stoi(optarg);
-                if (maxZoom < 0 || maxZoom > 22)
+                options.maxZoom = std::stoi(optarg);
+                if (options.maxZoom < 0 || options.maxZoom > 22)
                 {
                     throw std::out_of_range("Zoom level must be between 0 and 22.");
                 }
@@ -218,34 +401,241 @@ int main(int argc, char *argv[])
             break;
         case 'o':
             outputPath = optarg;
+            outputGiven = true;
             break;
         case 'f':
-        {
-            std::string formatStr = optarg;
-            // Convert to lowercase for case-insensitive comparison
-            std::transform(formatStr.begin(), formatStr.end(), formatStr.begin(),
-                           [](unsigned char c)
-                           { return std::tolower(c); });
-
-            if (formatStr == "webp")
+            try
+            {
+                parseImageFormats(optarg, options);
+            }
+            catch (const std::exception &e)
             {
-                imageFormat = ImageFormat::WEBP;
+                std::cerr << "Error: Invalid image format specified. " << e.what() << "\n";
+                return EXIT_FAILURE;
             }
-            else if (formatStr == "jpg" || formatStr == "jpeg")
+            break;
+        case 'E':
+            try
             {
-                imageFormat = ImageFormat::JPEG;
+                options.encoderProfile.apply(optarg);
             }
-            else if (formatStr == "png")
+            catch (const std::exception &e)
             {
-                imageFormat = ImageFormat::PNG;
+                std::cerr << "Error: Invalid encoder settings '" << optarg << "'. " << e.what() << "\n";
+                return EXIT_FAILURE;
             }
-            else
+            break;
+        case 'm':
+            try
+            {
+                options.metatile = std::stoi(optarg);
+                if (options.metatile < 1 || options.metatile > 8 || (options.metatile & (options.metatile - 1)) != 0)
+                {
+                    throw std::out_of_range("Metatile size must be 1, 2, 4 or 8.");
+                }
+            }
+            catch (const std::exception &e)
             {
-                std::cerr << "Error: Invalid image format specified. Choose 'webp', 'jpg', or 'png'.\n";
+                std::cerr << "Error: Invalid metatile size. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            try
+            {
+                options.buffer = std::stoi(optarg);
+                if (options.buffer < 0 || options.buffer > static_cast<int>(tileSize))
+                {
+                    throw std::out_of_range("Buffer must be between 0 and " + std::to_string(tileSize) + " pixels.");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid buffer. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            try
+            {
+                options.chunkSize = std::stoi(optarg);
+                if (options.chunkSize < 1 || options.chunkSize > 256 || (options.chunkSize & (options.chunkSize - 1)) != 0)
+                {
+                    throw std::out_of_range("Chunk size must be a power of two between 1 and 256.");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid chunk size. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'e':
+            try
+            {
+                options.encoderThreads = std::stoi(optarg);
+                if (options.encoderThreads < 0 || options.encoderThreads > 64)
+                {
+                    throw std::out_of_range("Encoder threads must be between 0 and 64.");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid number of encoder threads. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'q':
+            try
+            {
+                options.queueDepth = std::stoi(optarg);
+                if (options.queueDepth < 1)
+                {
+                    throw std::out_of_range("Queue depth must be at least 1.");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid queue depth. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'u':
+            try
+            {
+                options.pruneZoom = std::stoi(optarg);
+                if (options.pruneZoom < 0 || options.pruneZoom > 22)
+                {
+                    throw std::out_of_range("Prune zoom must be between 0 and 22.");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid prune zoom. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            deduplicate = true;
+            break;
+        case 'R':
+            try
+            {
+                options.renderFromZoom = std::stoi(optarg);
+                if (options.renderFromZoom < 0 || options.renderFromZoom > 22)
+                {
+                    throw std::out_of_range("Zoom level must be between 0 and 22.");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid render-from zoom. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            bboxArg = optarg;
+            break;
+        case 'P':
+            polygonPath = optarg;
+            break;
+        case 'C':
+            options.cacheDirectory = optarg;
+            break;
+        case 'r':
+            resume = true;
+            break;
+        case 't':
+            threaded = true;
+            break;
+        case 'L':
+            bulkLoad = true;
+            break;
+        case 'S':
+            try
+            {
+                parseTileSizes(optarg, options);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid tile sizes. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'O':
+            try
+            {
+                options.order = parseTileOrder(optarg);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid order. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'M':
+            try
+            {
+                options.sourceCacheMegabytes = std::stoi(optarg);
+                if (options.sourceCacheMegabytes < 0 || options.sourceCacheMegabytes > 65536)
+                {
+                    throw std::out_of_range("Source cache must be between 0 and 65536 MB.");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid source cache size. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'x':
+            metricsPath = optarg;
+            break;
+        case 'U':
+            updateArg = optarg;
+            break;
+        case 'N':
+            shardArg = optarg;
+            break;
+        case 'l':
+            serveOptionGiven = true;
+            try
+            {
+                std::string listen = optarg;
+                size_t colon = listen.rfind(':');
+                if (colon != std::string::npos)
+                {
+                    serveOptions.address = listen.substr(0, colon);
+                }
+                serveOptions.port = std::stoi(listen.substr(colon == std::string::npos ? 0 : colon + 1));
+                if (serveOptions.port < 1 || serveOptions.port > 65535)
+                {
+                    throw std::out_of_range("Port must be between 1 and 65535.");
+                }
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid listen address. " << e.what() << "\n";
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'T':
+            serveOptionGiven = true;
+            try
+            {
+                int megabytes = std::stoi(optarg);
+                if (megabytes < 0 || megabytes > 1048576)
+                {
+                    throw std::out_of_range("Tile cache must be between 0 and 1048576 MB.");
+                }
+                serveOptions.cacheBytes = static_cast<size_t>(megabytes) << 20;
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << "Error: Invalid tile cache size. " << e.what() << "\n";
                 return EXIT_FAILURE;
             }
             break;
-        }
         case 'h':
             printHelp(argv[0]);
             return EXIT_SUCCESS;
@@ -255,56 +645,422 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (style_url.empty())
+    if (options.styleUrl.empty())
     {
         std::cerr << "Error: Style URL is required.\n\n";
         printHelp(argv[0]);
         return EXIT_FAILURE;
     }
 
-    if (fs::exists(outputPath))
+    if (serving && (resume || bulkLoad || options.renderFromZoom > 0 || options.pruneZoom >= 0 || !updateArg.empty() || !metricsPath.empty() || !shardArg.empty()))
     {
-        std::cerr << "Error: Output file '" << outputPath << "' already exists.\nPlease choose a different output path or remove the existing file before proceeding.\n\n";
-        printHelp(argv[0]);
+        std::cerr << "Error: --resume, --bulk-load, --render-from-zoom, --prune-uniform, --update, --metrics and --shard don't apply to serve.\n";
         return EXIT_FAILURE;
     }
 
-    if (style_url.find("http://") != 0 && style_url.find("https://") != 0 && style_url.find("file://") != 0)
+    if (!serving && serveOptionGiven)
     {
-        style_url = "file://" + style_url;
+        std::cerr << "Error: --listen and --tile-cache only apply to serve.\n";
+        return EXIT_FAILURE;
     }
 
-    std::cout << "===================================" << std::endl;
-    std::cout << "Style URL: " << style_url << std::endl;
-    std::cout << "Max Zoom: " << maxZoom << std::endl;
-    std::cout << "Number of Processes: " << numProcesses << std::endl;
-    std::cout << "Image Format: " << imageString(imageFormat) << std::endl;
-    std::cout << "Output Path: " << outputPath << std::endl;
-    std::cout << "===================================" << std::endl
-              << std::endl;
-
-    std::cout << ">>> Starting Rendering..." << std::endl;
-
-    std::vector<pid_t> pids;
-    std::vector<std::string> dbPaths;
+    std::vector<std::string> paths = outputPaths(outputPath, options);
+    bool updating = !updateArg.empty();
+    bool resuming = resume && fs::exists(paths.front());
+    for (const std::string &path : paths)
+    {
+        if (serving)
+        {
+            if (outputGiven && isPMTilesPath(path))
+            {
+                std::cerr << "Error: Tiles can only be written back to MBTiles.\n";
+                return EXIT_FAILURE;
+            }
+        }
+        else if (fs::exists(path) != (resuming || updating))
+        {
+            if (updating)
+            {
+                std::cerr << "Error: Output file '" << path << "' is missing, only an existing render can be updated.\n\n";
+            }
+            else if (resuming)
+            {
+                std::cerr << "Error: Output file '" << path << "' is missing, can't resume.\n\n";
+            }
+            else
+            {
+                std::cerr << "Error: Output file '" << path << "' already exists.\nPlease choose a different output path, remove the existing file or continue it with --resume.\n\n";
+            }
+            printHelp(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (resume && bulkLoad)
+    {
+        std::cerr << "Error: --bulk-load writes without a journal, so its output can't be resumed.\n";
+        return EXIT_FAILURE;
+    }
+
+    bool pmtiles = isPMTilesPath(outputPath);
+    if (pmtiles && (resume || bulkLoad))
+    {
+        std::cerr << "Error: PMTiles outputs are written in one go at the end, --resume and --bulk-load only apply to MBTiles.\n";
+        return EXIT_FAILURE;
+    }
+
+    std::string updateOld;
+    std::string updateNew;
+    if (updating)
+    {
+        size_t comma = updateArg.find(',');
+        if (comma == std::string::npos || comma == 0 || comma == updateArg.size() - 1)
+        {
+            std::cerr << "Error: --update expects the old and the new source archive, separated by a comma.\n";
+            return EXIT_FAILURE;
+        }
+        updateOld = updateArg.substr(0, comma);
+        updateNew = updateArg.substr(comma + 1);
+
+        // Tiles are patched in place: PMTiles can't be, the pyramid zooms
+        // would have to be rebuilt and the area is the change itself.
+        if (pmtiles || resume || bulkLoad || options.renderFromZoom > 0 || !bboxArg.empty() || !polygonPath.empty())
+        {
+            std::cerr << "Error: --update patches an MBTiles output in place and can't be combined with --resume, --bulk-load, --render-from-zoom, --bbox or --polygon.\n";
+            return EXIT_FAILURE;
+        }
+
+        // The images/map layout can't be told from the options of this run.
+        deduplicate = isDeduplicatedMBTiles(paths.front().c_str());
+    }
+
+    int shardIndex = 0;
+    int shardCount = 1;
+    if (!shardArg.empty())
+    {
+        try
+        {
+            parseShard(shardArg, shardIndex, shardCount);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: Invalid shard. " << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+
+        // The zooms a pyramid builds at the end need the tiles of every
+        // shard, and merge only reads MBTiles.
+        if (pmtiles || options.renderFromZoom > 0)
+        {
+            std::cerr << "Error: --shard writes MBTiles to merge afterwards and can't be combined with --render-from-zoom or a PMTiles output.\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.renderFromZoom > options.maxZoom)
+    {
+        std::cerr << "Error: --render-from-zoom can't be above the max zoom.\n";
+        return EXIT_FAILURE;
+    }
+
+    if (options.renderFromZoom > 0 && options.pruneZoom >= 0 && options.pruneZoom <= options.renderFromZoom)
+    {
+        std::cerr << "Error: --prune-uniform has to be above --render-from-zoom, the zooms up to it are not rendered.\n";
+        return EXIT_FAILURE;
+    }
+
+    if (!bboxArg.empty() && !polygonPath.empty())
+    {
+        std::cerr << "Error: --bbox and --polygon can't be combined.\n";
+        return EXIT_FAILURE;
+    }
+
+    if (!bboxArg.empty())
+    {
+        double bbox[4];
+        try
+        {
+            size_t start = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                size_t end = i < 3 ? bboxArg.find(',', start) : bboxArg.size();
+                if (end == std::string::npos)
+                {
+                    throw std::invalid_argument("Expected four comma separated numbers.");
+                }
+                bbox[i] = std::stod(bboxArg.substr(start, end - start));
+                start = end + 1;
+            }
+            if (bbox[0] < -180 || bbox[0] > 180 || bbox[2] < -180 || bbox[2] > 180 ||
+                bbox[1] < -90 || bbox[3] > 90 || bbox[1] > bbox[3])
+            {
+                throw std::out_of_range("Expected west,south,east,north in degrees.");
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: Invalid bounding box. " << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+        options.area = TileCover::fromBBox(bbox[0], bbox[1], bbox[2], bbox[3], options.maxZoom);
+    }
+
+    if (!polygonPath.empty())
+    {
+        try
+        {
+            options.area = TileCover::fromGeoJSON(polygonPath, options.maxZoom);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: Invalid polygon file. " << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string areaName = bboxArg.empty() ? polygonPath : bboxArg;
+    if (updating)
+    {
+        std::cout << "Comparing " << updateOld << " with " << updateNew << "..." << std::endl;
+        SourceDiff diff;
+        try
+        {
+            diff = diffSourceArchives(updateOld, updateNew);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error: Can't compare the source archives. " << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+
+        std::cout << diff.changed() << " of " << diff.changed() + diff.unchanged << " source tiles changed ("
+                  << diff.added << " added, " << diff.removed << " removed, " << diff.modified << " modified)." << std::endl;
+        if (diff.changed() == 0)
+        {
+            std::cout << "Nothing to update." << std::endl;
+            return EXIT_SUCCESS;
+        }
+        options.area = changedTileCover(diff, options.maxZoom, options.metatile, options.pruneZoom);
+        areaName = "changes from " + updateOld + " to " + updateNew;
+    }
+
+    if (!options.cacheDirectory.empty())
+    {
+        std::error_code error;
+        fs::create_directories(options.cacheDirectory, error);
+        if (error)
+        {
+            std::cerr << "Error: Can't create cache directory '" << options.cacheDirectory << "': " << error.message() << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.styleUrl.find("http://") != 0 && options.styleUrl.find("https://") != 0 && options.styleUrl.find("file://") != 0)
+    {
+        options.styleUrl = "file://" + options.styleUrl;
+    }
+
+    if (serving)
+    {
+        serveOptions.workers = numProcesses;
+        serveOptions.connectionThreads = std::max(16, 4 * numProcesses);
+        serveOptions.deduplicate = deduplicate;
+        if (outputGiven)
+        {
+            serveOptions.writeBackPaths = paths;
+        }
+        return serveTiles(options, serveOptions);
+    }
+
+    // Everything that changes the schedule or the tile contents. A render can
+    // only be resumed with the same values.
+    std::string renderParams = "style=" + options.styleUrl +
+                               ";zoom=" + std::to_string(options.maxZoom) +
+                               ";format=" + imageFormatList(options) +
+                               ";encoder=" + options.encoderProfile.describe(options.maxZoom) +
+                               ";metatile=" + std::to_string(options.metatile) +
+                               ";buffer=" + std::to_string(options.buffer) +
+                               ";chunk=" + std::to_string(options.chunkSize) +
+                               ";prune=" + std::to_string(options.pruneZoom) +
+                               ";renderFrom=" + std::to_string(options.renderFromZoom) +
+                               ";dedup=" + std::to_string(deduplicate) +
+                               ";bbox=" + bboxArg +
+                               ";polygon=" + polygonPath +
+                               ";shard=" + shardArg;
+    for (uint32_t size : options.tileSizes)
+    {
+        renderParams += ";size=" + std::to_string(size);
+    }
+
+    // A chunk is only done once every output has recorded it.
+    std::vector<uint64_t> completedChunks;
+    for (size_t output = 0; output < paths.size(); output++)
+    {
+        if (resuming)
+        {
+            std::vector<uint64_t> completed;
+            if (!loadRenderProgress(paths[output].c_str(), renderParams, completed))
+            {
+                return EXIT_FAILURE;
+            }
+            if (output == 0)
+            {
+                completedChunks = std::move(completed);
+            }
+            else
+            {
+                std::vector<uint64_t> common;
+                std::set_intersection(completedChunks.begin(), completedChunks.end(),
+                                      completed.begin(), completed.end(), std::back_inserter(common));
+                completedChunks = std::move(common);
+            }
+        }
+        else if (!pmtiles && !updating)
+        {
+            createMBTilesDatabase(paths[output].c_str(), outputFormat(options, output), deduplicate, bulkLoad);
+            if (!bulkLoad)
+            {
+                createRenderProgress(paths[output].c_str(), renderParams);
+            }
+        }
+    }
+
+    std::vector<ScheduleLevel> levels = scheduleLevels(options);
+    TileShard shard;
+    if (shardCount > 1)
+    {
+        shard = TileShard(levels, options.area, options.maxZoom, shardIndex, shardCount);
+    }
+
+    std::cout << "===================================" << std::endl;
+    std::cout << "Style URL: " << options.styleUrl << std::endl;
+    std::cout << "Max Zoom: " << options.maxZoom << std::endl;
+    std::cout << "Number of " << (threaded ? "Threads: " : "Processes: ") << numProcesses << std::endl;
+    std::cout << "Image Format: " << imageFormatList(options) << " (" << options.encoderProfile.describe(options.maxZoom) << ")" << std::endl;
+    std::cout << "Metatile: " << options.metatile << "x" << options.metatile << " (buffer " << options.buffer << "px)" << std::endl;
+    std::cout << "Render Order: " << tileOrderString(options.order) << " (source tile cache "
+              << options.sourceCacheMegabytes << " MB)" << std::endl;
+    if (options.renderFromZoom > 0)
+    {
+        std::cout << "Render From Zoom: " << options.renderFromZoom << " (lower zooms downsampled)" << std::endl;
+    }
+    if (options.pruneZoom >= 0)
+    {
+        std::cout << "Prune Uniform Tiles From Zoom: " << options.pruneZoom << std::endl;
+    }
+    if (options.encoderThreads > 0)
+    {
+        std::cout << "Encoder Threads: " << options.encoderThreads << " per process (queue depth " << options.queueDepth << ")" << std::endl;
+    }
+    if (!options.area.isWorld())
+    {
+        uint64_t areaTiles = 0;
+        for (int zoom = 0; zoom <= options.maxZoom; zoom++)
+        {
+            areaTiles += options.area.tileCount(zoom);
+        }
+        std::cout << "Area: " << areaName << " (" << areaTiles << " tiles)" << std::endl;
+    }
+    if (!shard.isWhole())
+    {
+        std::cout << "Shard: " << shardArg << " (cells at zoom " << shard.cellZoom() << ", " << std::fixed << std::setprecision(1)
+                  << 100.0 * shard.share() << "% of the tiles)" << std::defaultfloat << std::endl;
+    }
+    if (!options.cacheDirectory.empty())
+    {
+        std::cout << "Resource Cache: " << options.cacheDirectory << std::endl;
+    }
+    for (size_t output = 0; output < paths.size(); output++)
+    {
+        std::cout << "Output Path: " << paths[output] << " (" << outputTileSize(options, output) << "px "
+                  << imageString(outputFormat(options, output))
+                  << (deduplicate ? ", deduplicated" : "") << (bulkLoad ? ", bulk load" : "") << ")" << std::endl;
+    }
+    if (resuming)
+    {
+        std::cout << "Resuming: " << completedChunks.size() << " chunks already done" << std::endl;
+    }
+    std::cout << "===================================" << std::endl
+              << std::endl;
+
+    std::cout << ">>> Starting Rendering..." << std::endl;
+
+    std::vector<pid_t> pids;
+    std::vector<std::thread> threads;
+    std::vector<pollfd> pipes;
 
     auto startTime = std::chrono::high_resolution_clock::now();
 
+    uint64_t resumedChunks = completedChunks.size();
+    TileScheduler scheduler(levels, numProcesses, std::move(completedChunks), options.order, shard);
+
+    // Tiles the workers will send for the first output. Zooms below the
+    // pyramid zoom are built by the writer at the end. A shard and a resumed
+    // run are estimated from their share of the tiles and chunks.
+    uint64_t expectedTiles = 0;
+    for (int zoom = options.renderFromZoom > 0 ? pyramidZoom(options) : 0; zoom <= options.maxZoom; zoom++)
+    {
+        expectedTiles += options.area.tileCount(zoom);
+    }
+    double ownedChunks = scheduler.chunkCount() * shard.share();
+    if (ownedChunks > 0)
+    {
+        double left = std::max(0.0, ownedChunks - static_cast<double>(resumedChunks)) / ownedChunks;
+        expectedTiles = static_cast<uint64_t>(static_cast<double>(expectedTiles) * shard.share() * left);
+    }
+
+    if (threaded)
+    {
+        registerFileSources(options, true);
+    }
+
     for (int processId = 0; processId < numProcesses; ++processId)
     {
-        std::string dbPath = "/tmp/output_" + std::to_string(processId) + ".mbtiles";
+        int fds[2];
+        if (pipe(fds) != 0)
+        {
+            std::cerr << "Failed to create pipe" << std::endl;
+            return 1;
+        }
+
+        if (threaded)
+        {
+            // The writer sees EOF once the thread closes its write end.
+            int fd = fds[1];
+            threads.emplace_back([processId, fd, &scheduler, &options]
+                                 {
+                                     renderTiles(processId, scheduler, options, fd);
+                                     close(fd);
+                                 });
+            pipes.push_back({fds[0], POLLIN, 0});
+            continue;
+        }
 
         pid_t pid = fork();
         if (pid == 0)
         {
-            createTemporaryTileDatabase(dbPath.c_str());
-            renderTiles(processId, numProcesses, maxZoom, style_url.c_str(), imageFormat, dbPath.c_str());
+            // Only keep our own write end, so the writer sees EOF as soon as
+            // the worker that owns a pipe exits.
+            for (const pollfd &other : pipes)
+            {
+                close(other.fd);
+            }
+            close(fds[0]);
+            // Threads share one source tile cache; forked workers split it.
+            if (options.sourceCacheMegabytes > 0)
+            {
+                options.sourceCacheMegabytes = std::max(1, options.sourceCacheMegabytes / numProcesses);
+            }
+            registerFileSources(options, false);
+            renderTiles(processId, scheduler, options, fds[1]);
+            close(fds[1]);
             exit(0);
         }
         else if (pid > 0)
         {
+            close(fds[1]);
             pids.push_back(pid);
-            dbPaths.push_back(dbPath);
+            pipes.push_back({fds[0], POLLIN, 0});
         }
         else
         {
@@ -313,24 +1069,267 @@ int main(int argc, char *argv[])
         }
     }
 
-    // Wait
+    // This process is the only writer: it drains the worker pipes into the
+    // output while rendering is still running.
+    std::vector<std::unique_ptr<TileSink>> writers;
+    for (size_t output = 0; output < paths.size(); output++)
+    {
+        writers.push_back(openTileSink(paths[output], outputFormat(options, output), deduplicate, bulkLoad));
+    }
+
+    auto writerStages = std::make_unique<StageHistograms>();
+    uint64_t receivedTiles = 0;
+    {
+        TileFrameHeader header;
+        std::string data;
+
+        bool terminal = isatty(STDOUT_FILENO);
+        auto progressInterval = std::chrono::seconds(terminal ? 1 : 30);
+        auto lastProgress = std::chrono::steady_clock::now();
+
+        while (!pipes.empty())
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now - lastProgress >= progressInterval)
+            {
+                lastProgress = now;
+                printProgress(receivedTiles, expectedTiles, scheduler.elapsed() / 1e9, terminal);
+            }
+
+            int ready = poll(pipes.data(), pipes.size(), 1000);
+            if (ready == 0)
+            {
+                continue;
+            }
+            if (ready < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                std::cerr << "Failed to poll worker pipes" << std::endl;
+                return 1;
+            }
+
+            for (size_t i = 0; i < pipes.size();)
+            {
+                if (pipes[i].revents == 0)
+                {
+                    i++;
+                    continue;
+                }
+
+                if (readTileFrame(pipes[i].fd, header, data))
+                {
+                    if (header.zoom == checkpointFrameZoom)
+                    {
+                        // A bulk load has no progress tables to record it
+                        // in, and neither has the finished output an update
+                        // writes into; an interrupted update starts over.
+                        if (!bulkLoad && !updating)
+                        {
+                            for (auto &writer : writers)
+                            {
+                                writer->markChunkDone(checkpointChunkIndex(header));
+                            }
+                        }
+                    }
+                    else
+                    {
+                        StageTimer timer(*writerStages, Stage::Insert, header.zoom);
+                        writers[header.output]->insertTile(header.zoom, header.x, header.tmsY, data.data(), data.size());
+                        if (header.output == 0)
+                        {
+                            receivedTiles++;
+                        }
+                    }
+                    i++;
+                }
+                else
+                {
+                    close(pipes[i].fd);
+                    pipes.erase(pipes.begin() + i);
+                }
+            }
+        }
+
+        printProgress(receivedTiles, expectedTiles, scheduler.elapsed() / 1e9, terminal);
+        if (terminal)
+        {
+            std::cout << std::endl;
+        }
+
+        for (size_t output = 0; output < writers.size(); output++)
+        {
+            // Flushes what a bulk load still holds, so it counts towards the
+            // rate.
+            writers[output]->commit();
+            const TileSink &writer = *writers[output];
+            double seconds = std::max(writer.insertSeconds(), 1e-9);
+            std::cout << "Inserted " << writer.tileCount() << " tiles (" << writer.byteCount() / (1 << 20) << " MB) into "
+                      << paths[output] << " in " << writer.insertSeconds() << " s: "
+                      << static_cast<uint64_t>(writer.tileCount() / seconds) << " tiles/s, "
+                      << static_cast<uint64_t>(writer.byteCount() / seconds / (1 << 20)) << " MB/s" << std::endl;
+        }
+
+        if (deduplicate || pmtiles)
+        {
+            for (size_t output = 0; output < writers.size(); output++)
+            {
+                std::cout << "Stored " << writers[output]->tileCount() << " tiles as " << writers[output]->imageCount()
+                          << " distinct images in " << paths[output] << "." << std::endl;
+            }
+        }
+    }
+
+    bool complete = true;
+    long peakKilobytes = 0;
     for (pid_t pid : pids)
     {
         int status;
-        waitpid(pid, &status, 0);
+        rusage usage{};
+        wait4(pid, &status, 0, &usage);
+        peakKilobytes += usage.ru_maxrss;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            std::cerr << "Warning: worker " << pid << " did not finish cleanly, its tiles may be incomplete" << std::endl;
+            complete = false;
+        }
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    if (threaded)
+    {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        peakKilobytes = usage.ru_maxrss;
+    }
+
+    auto finishStart = std::chrono::steady_clock::now();
+    for (size_t output = 0; output < writers.size(); output++)
+    {
+        if (complete && options.renderFromZoom > 0)
+        {
+            buildPyramidTop(*writers[output], outputTileSize(options, output), outputFormat(options, output), options);
+        }
+
+        // A PMTiles archive is only written out for a complete render; its
+        // temporary tile file goes away with the writer.
+        if (!complete && pmtiles)
+        {
+            continue;
+        }
+
+        // Builds the indexes of a bulk load, or writes out a PMTiles archive.
+        auto outputStart = std::chrono::steady_clock::now();
+        try
+        {
+            writers[output]->finish();
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Failed to write " << paths[output] << ": " << e.what() << std::endl;
+            return 1;
+        }
+        if (bulkLoad || pmtiles)
+        {
+            std::chrono::duration<double> finishTime = std::chrono::steady_clock::now() - outputStart;
+            std::cout << "Finished " << paths[output] << " in " << finishTime.count() << " s" << std::endl;
+        }
+    }
+    writers.clear();
+    std::chrono::duration<double> finishTime = std::chrono::steady_clock::now() - finishStart;
+
+    if (complete)
+    {
+        for (const std::string &path : paths)
+        {
+            if (updating && deduplicate)
+            {
+                std::cout << "Removed " << removeUnusedImages(path.c_str()) << " replaced images from " << path << "." << std::endl;
+            }
+            else if (!pmtiles)
+            {
+                finishRenderProgress(path.c_str());
+            }
+        }
+        if (!shard.isWhole())
+        {
+            std::cout << "Shard " << shardArg << " done. Once every shard is, combine them with: "
+                      << argv[0] << " merge -o <output.mbtiles>" << (deduplicate ? " -d" : "") << " <shard outputs>..." << std::endl;
+        }
+    }
+    else if (pmtiles)
+    {
+        std::cerr << "Error: the render is incomplete, so no PMTiles archive was written. Render again to get one." << std::endl;
+    }
+    else
+    {
+        if (updating)
+        {
+            std::cerr << "Run the update again to render the missing tiles." << std::endl;
+        }
+        else if (bulkLoad)
+        {
+            std::cerr << "A bulk load can't be resumed, render again to get the missing tiles." << std::endl;
+        }
+        else
+        {
+            std::cerr << "Run again with --resume to render the missing chunks." << std::endl;
+        }
     }
 
     auto endTime = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsedTime = endTime - startTime;
     std::cout << ">>> Finished Rendering in " << elapsedTime.count() << " seconds." << std::endl;
+    scheduler.printUtilization(std::cout);
 
-    createMBTilesDatabase(outputPath.c_str(), imageFormat);
-    mergeMBTiles(dbPaths, outputPath.c_str());
+    std::vector<const StageHistograms *> workerStages;
+    uint64_t chunks = 0;
+    for (int id = 0; id < numProcesses; id++)
+    {
+        workerStages.push_back(&scheduler.worker(id).stages);
+        chunks += scheduler.worker(id).chunks.load();
+    }
+    printStageTimes(std::cout, workerStages, *writerStages);
 
-    for (const auto &dbPath : dbPaths)
+    if (threaded)
+    {
+        std::cout << "Peak memory: " << peakKilobytes / 1024 << " MB for " << numProcesses << " threads." << std::endl;
+    }
+    else
     {
-        remove(dbPath.c_str());
+        std::cout << "Peak memory: " << peakKilobytes / 1024 << " MB over " << numProcesses << " workers ("
+                  << peakKilobytes / 1024 / numProcesses << " MB each)." << std::endl;
+    }
+
+    if (!metricsPath.empty())
+    {
+        RunSummary run;
+        run.style = options.styleUrl;
+        run.format = imageFormatList(options);
+        run.maxZoom = options.maxZoom;
+        run.workers = numProcesses;
+        run.threaded = threaded;
+        run.wallSeconds = elapsedTime.count();
+        run.finishSeconds = finishTime.count();
+        run.tiles = receivedTiles;
+        run.chunks = chunks;
+        run.peakKilobytes = peakKilobytes;
+        try
+        {
+            writeRunMetrics(metricsPath, run, workerStages, *writerStages);
+            std::cout << "Metrics written to " << metricsPath << std::endl;
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
     }
 
-    return 0;
+    // Scripts and shard runs have to see a render that lost tiles.
+    return complete ? EXIT_SUCCESS : EXIT_FAILURE;
 }
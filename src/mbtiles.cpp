@@ -1,11 +1,39 @@
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <cstdlib>
+#include <tuple>
+#include <stdexcept>
 #include <sqlite3.h>
 
-#include "image_encoding.hpp"
+#include "mbtiles.hpp"
+#include "tile_hash.hpp"
 
-void createMBTilesDatabase(const char *dbPath, ImageFormat imageFormat)
+static void execSQL(sqlite3 *db, const char *sql, const char *what)
+{
+    int rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK)
+    {
+        std::cerr << "SQL error (" << what << "): " << sqlite3_errmsg(db) << std::endl;
+    }
+}
+
+static void createIndexes(sqlite3 *db, bool deduplicate)
+{
+    if (deduplicate)
+    {
+        execSQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id);", "create images index");
+        execSQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map (zoom_level, tile_column, tile_row);", "create map index");
+    }
+    else
+    {
+        execSQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);", "create tile index");
+    }
+}
+
+void createMBTilesDatabase(const char *dbPath, ImageFormat imageFormat, bool deduplicate, bool bulkLoad)
 {
     sqlite3 *db;
     int rc = sqlite3_open(dbPath, &db);
@@ -16,27 +44,52 @@ void createMBTilesDatabase(const char *dbPath, ImageFormat imageFormat)
         exit(1);
     }
 
-    const char *createTilesTableSQL = "CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB);";
-    rc = sqlite3_exec(db, createTilesTableSQL, nullptr, nullptr, nullptr);
-    if (rc != SQLITE_OK)
+    if (bulkLoad)
     {
-        std::cerr << "SQL error (create tiles table): " << sqlite3_errmsg(db) << std::endl;
+        // Only takes effect before the first table is created. Tiles are
+        // tens of kilobytes, so fewer, larger pages mean fewer overflow
+        // chains.
+        execSQL(db, "PRAGMA page_size = 65536;", "set page size");
     }
 
-    const char *createMetadataTableSQL = "CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);";
-    rc = sqlite3_exec(db, createMetadataTableSQL, nullptr, nullptr, nullptr);
-    if (rc != SQLITE_OK)
+    if (deduplicate)
+    {
+        // The layout written by mbutil and tippecanoe: every distinct image
+        // is stored once, and the tiles view keeps the file readable by any
+        // MBTiles consumer.
+        execSQL(db, "CREATE TABLE IF NOT EXISTS images (tile_data BLOB, tile_id TEXT);", "create images table");
+        execSQL(db, "CREATE TABLE IF NOT EXISTS map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_id TEXT);", "create map table");
+        execSQL(db,
+                "CREATE VIEW IF NOT EXISTS tiles AS "
+                "SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data "
+                "FROM map JOIN images ON images.tile_id = map.tile_id;",
+                "create tiles view");
+    }
+    else
     {
-        std::cerr << "SQL error (create metadata table): " << sqlite3_errmsg(db) << std::endl;
+        execSQL(db, "CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB);", "create tiles table");
     }
 
-    const char *createTileIndexSQL = "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);";
-    rc = sqlite3_exec(db, createTileIndexSQL, nullptr, nullptr, nullptr);
-    if (rc != SQLITE_OK)
+    if (!bulkLoad)
+    {
+        createIndexes(db, deduplicate);
+    }
+    else if (deduplicate)
     {
-        std::cerr << "SQL error (create tile index): " << sqlite3_errmsg(db) << std::endl;
+        // Repeated images are only recognised by this index, so even a bulk
+        // load needs it from the start. It is small next to the map.
+        execSQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id);", "create images index");
     }
 
+    if (bulkLoad)
+    {
+        // A bulk load keeps no progress, but still has to be recognisable
+        // as unfinished until finishRenderProgress().
+        execSQL(db, "CREATE TABLE IF NOT EXISTS bulk_load_unfinished (unused INTEGER);", "create bulk load marker");
+    }
+
+    execSQL(db, "CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);", "create metadata table");
+
     std::string metadataInsertSQL = "INSERT OR REPLACE INTO metadata (name, value) VALUES "
                                     "('name', 'raster'), "
                                     "('type', 'baselayer'), "
@@ -45,130 +98,615 @@ void createMBTilesDatabase(const char *dbPath, ImageFormat imageFormat)
                                     imageString(imageFormat) + "'), "
                                                                "('format', '" +
                                     imageString(imageFormat) + "');";
-    rc = sqlite3_exec(db, metadataInsertSQL.c_str(), nullptr, nullptr, nullptr);
-    if (rc != SQLITE_OK)
-    {
-        std::cerr << "SQL error (insert metadata): " << sqlite3_errmsg(db) << std::endl;
-    }
+    execSQL(db, metadataInsertSQL.c_str(), "insert metadata");
 
     sqlite3_close(db);
 }
 
-void createTemporaryTileDatabase(const char *dbPath)
+static sqlite3 *openDatabase(const char *dbPath, int flags)
 {
     sqlite3 *db;
-    int rc = sqlite3_open(dbPath, &db);
-    if (rc)
+    int rc = sqlite3_open_v2(dbPath, &db, flags, nullptr);
+    if (rc != SQLITE_OK)
     {
         std::cerr << "Can't open database: " << sqlite3_errmsg(db) << std::endl;
         sqlite3_close(db);
         exit(1);
     }
+    return db;
+}
 
-    const char *createTilesTableSQL = "CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB);";
-    rc = sqlite3_exec(db, createTilesTableSQL, nullptr, nullptr, nullptr);
+static sqlite3_stmt *prepareStatement(sqlite3 *db, const char *sql)
+{
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
     if (rc != SQLITE_OK)
     {
-        std::cerr << "SQL error (create tiles table): " << sqlite3_errmsg(db) << std::endl;
+        std::cerr << "Failed to prepare statement on output database: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
+        exit(1);
     }
+    return stmt;
+}
 
-    const char *createTileIndexSQL = "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);";
-    rc = sqlite3_exec(db, createTileIndexSQL, nullptr, nullptr, nullptr);
-    if (rc != SQLITE_OK)
+static void stepStatement(sqlite3 *db, sqlite3_stmt *stmt, int bindResult)
+{
+    if (bindResult != SQLITE_OK)
+    {
+        std::cerr << "Failed to bind parameters: " << sqlite3_errmsg(db) << std::endl;
+    }
+
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        std::cerr << "Failed to write to output database: " << sqlite3_errmsg(db) << std::endl;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+void createRenderProgress(const char *dbPath, const std::string &params)
+{
+    sqlite3 *db = openDatabase(dbPath, SQLITE_OPEN_READWRITE);
+    execSQL(db, "CREATE TABLE IF NOT EXISTS render_progress (chunk INTEGER PRIMARY KEY);", "create progress table");
+    execSQL(db, "CREATE TABLE IF NOT EXISTS render_params (value TEXT);", "create params table");
+
+    sqlite3_stmt *stmt = prepareStatement(db, "INSERT INTO render_params (value) VALUES (?);");
+    stepStatement(db, stmt, sqlite3_bind_text(stmt, 1, params.data(), static_cast<int>(params.size()), SQLITE_STATIC));
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+bool loadRenderProgress(const char *dbPath, const std::string &params, std::vector<uint64_t> &completed)
+{
+    sqlite3 *db = openDatabase(dbPath, SQLITE_OPEN_READONLY);
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, "SELECT value FROM render_params;", -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Error: '" << dbPath << "' has no render progress, it was either completed or not written by tilerender." << std::endl;
+        sqlite3_close(db);
+        return false;
+    }
+
+    bool matches = sqlite3_step(stmt) == SQLITE_ROW &&
+                   params == reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+    sqlite3_finalize(stmt);
+    if (!matches)
     {
-        std::cerr << "SQL error (create tile index): " << sqlite3_errmsg(db) << std::endl;
+        std::cerr << "Error: '" << dbPath << "' was rendered with different options, it can't be resumed with these." << std::endl;
+        sqlite3_close(db);
+        return false;
+    }
+
+    // The primary key keeps the chunks sorted.
+    stmt = prepareStatement(db, "SELECT chunk FROM render_progress ORDER BY chunk;");
+    completed.clear();
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        completed.push_back(static_cast<uint64_t>(sqlite3_column_int64(stmt, 0)));
     }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return true;
+}
+
+void finishRenderProgress(const char *dbPath)
+{
+    sqlite3 *db = openDatabase(dbPath, SQLITE_OPEN_READWRITE);
+    execSQL(db, "DROP TABLE IF EXISTS render_progress;", "drop progress table");
+    execSQL(db, "DROP TABLE IF EXISTS render_params;", "drop params table");
+    execSQL(db, "DROP TABLE IF EXISTS bulk_load_unfinished;", "drop bulk load marker");
+    sqlite3_close(db);
+}
+
+static bool hasTable(const char *dbPath, const char *table)
+{
+    sqlite3 *db = openDatabase(dbPath, SQLITE_OPEN_READONLY);
+    sqlite3_stmt *stmt = prepareStatement(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?;");
+    sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return found;
+}
+
+bool isDeduplicatedMBTiles(const char *dbPath)
+{
+    return hasTable(dbPath, "map");
+}
+
+bool hasRenderProgress(const char *dbPath)
+{
+    return hasTable(dbPath, "render_progress") || hasTable(dbPath, "bulk_load_unfinished");
+}
 
+size_t removeUnusedImages(const char *dbPath)
+{
+    sqlite3 *db = openDatabase(dbPath, SQLITE_OPEN_READWRITE);
+    execSQL(db, "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);", "remove unused images");
+    size_t removed = static_cast<size_t>(sqlite3_changes(db));
     sqlite3_close(db);
+    return removed;
 }
 
-void mergeMBTiles(const std::vector<std::string> &dbPaths, const char *outputDbPath)
+MBTilesWriter::MBTilesWriter(const char *dbPath, bool deduplicate, bool bulkLoad)
+    : deduplicate(deduplicate), bulkLoad(bulkLoad), indexed(!bulkLoad)
 {
-    sqlite3 *outDb;
-    int rc = sqlite3_open(outputDbPath, &outDb);
+    int rc = sqlite3_open(dbPath, &db);
     if (rc)
     {
-        std::cerr << "Can't open output database: " << sqlite3_errmsg(outDb) << std::endl;
-        sqlite3_close(outDb);
+        std::cerr << "Can't open output database: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
         exit(1);
     }
 
-    rc = sqlite3_exec(outDb, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
+    if (bulkLoad)
+    {
+        execSQL(db, "PRAGMA journal_mode = OFF;", "disable journal");
+        execSQL(db, "PRAGMA synchronous = OFF;", "disable sync");
+        execSQL(db, "PRAGMA locking_mode = EXCLUSIVE;", "lock database");
+        execSQL(db, "PRAGMA cache_size = -262144;", "set cache size");
+        batch.reserve(bulkBatchTiles);
+        batchData.reserve(bulkBatchBytes);
+    }
+
+    // Without the indexes of a bulk load there is nothing to replace or
+    // ignore against; the writer never sees a tile twice then.
+    const char *insertVerb = bulkLoad ? "INSERT" : "INSERT OR REPLACE";
+    if (deduplicate)
+    {
+        stmt = prepareStatement(db, (std::string(insertVerb) + " INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?, ?, ?, ?);").c_str());
+        // The unique index on tile_id skips images that are already stored,
+        // also those of the run a resumed render continues.
+        imageStmt = prepareStatement(db, "INSERT OR IGNORE INTO images (tile_data, tile_id) VALUES (?, ?);");
+    }
+    else
+    {
+        stmt = prepareStatement(db, (std::string(insertVerb) + " INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?);").c_str());
+    }
+}
+
+MBTilesWriter::~MBTilesWriter()
+{
+    commit();
+    sqlite3_finalize(stmt);
+    sqlite3_finalize(imageStmt);
+    sqlite3_finalize(progressStmt);
+    sqlite3_finalize(readStmt);
+    sqlite3_close(db);
+}
+
+void MBTilesWriter::beginTransaction()
+{
+    if (pending == 0)
+    {
+        int rc = sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK)
+        {
+            std::cerr << "Failed to begin transaction on output database: " << sqlite3_errmsg(db) << std::endl;
+        }
+    }
+}
+
+void MBTilesWriter::insertTile(int zoom, int x, int tmsY, const void *data, size_t size)
+{
+    auto start = std::chrono::steady_clock::now();
+    bytes += size;
+
+    if (bulkLoad)
+    {
+        // Both buffers keep their capacity from one batch to the next, and
+        // the bytes never outgrow it.
+        if (batchData.size() + size > bulkBatchBytes)
+        {
+            flushBatch();
+        }
+        batch.push_back({zoom, x, tmsY, batchData.size(), size});
+        batchData.append(static_cast<const char *>(data), size);
+        if (batch.size() >= bulkBatchTiles)
+        {
+            flushBatch();
+        }
+    }
+    else
+    {
+        beginTransaction();
+        writeTile(zoom, x, tmsY, data, size);
+        if (++pending >= transactionSize)
+        {
+            commit();
+        }
+    }
+
+    insertTime += std::chrono::steady_clock::now() - start;
+}
+
+// Inserts the batch in key order in a single transaction.
+void MBTilesWriter::flushBatch()
+{
+    if (batch.empty())
+    {
+        return;
+    }
+
+    std::sort(batch.begin(), batch.end(), [](const BatchedTile &a, const BatchedTile &b)
+              { return std::tie(a.zoom, a.x, a.tmsY) < std::tie(b.zoom, b.x, b.tmsY); });
+
+    beginTransaction();
+    pending += batch.size();
+    for (const BatchedTile &tile : batch)
+    {
+        writeTile(tile.zoom, tile.x, tile.tmsY, batchData.data() + tile.offset, tile.size);
+    }
+    batch.clear();
+    batchData.clear();
+
+    int rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
     if (rc != SQLITE_OK)
     {
-        std::cerr << "Failed to begin transaction on output database: " << sqlite3_errmsg(outDb) << std::endl;
+        std::cerr << "Failed to commit transaction on output database: " << sqlite3_errmsg(db) << std::endl;
     }
+    pending = 0;
+}
 
-    for (const auto &dbPath : dbPaths)
+// Runs inside a transaction.
+void MBTilesWriter::writeTile(int zoom, int x, int tmsY, const void *data, size_t size)
+{
+
+    int rc = sqlite3_bind_int(stmt, 1, zoom);
+    rc |= sqlite3_bind_int(stmt, 2, x);
+    rc |= sqlite3_bind_int(stmt, 3, tmsY);
+
+    if (deduplicate)
     {
-        sqlite3 *inDb;
-        rc = sqlite3_open(dbPath.c_str(), &inDb);
-        if (rc)
+        // Bindings are cleared after every step, so neither the tile nor
+        // its id has to be copied into SQLite.
+        tileContentId(data, size, contentId);
+        int imageRc = sqlite3_bind_blob(imageStmt, 1, data, static_cast<int>(size), SQLITE_STATIC);
+        imageRc |= sqlite3_bind_text(imageStmt, 2, contentId.data(), static_cast<int>(contentId.size()), SQLITE_STATIC);
+        stepStatement(db, imageStmt, imageRc);
+        images += static_cast<size_t>(sqlite3_changes(db));
+        rc |= sqlite3_bind_text(stmt, 4, contentId.data(), static_cast<int>(contentId.size()), SQLITE_STATIC);
+    }
+    else
+    {
+        rc |= sqlite3_bind_blob(stmt, 4, data, static_cast<int>(size), SQLITE_STATIC);
+    }
+
+    stepStatement(db, stmt, rc);
+    tiles++;
+}
+
+void MBTilesWriter::markChunkDone(uint64_t chunkIndex)
+{
+    if (untracked)
+    {
+        return;
+    }
+    if (!progressStmt)
+    {
+        // A finished database has no progress left to record.
+        sqlite3_stmt *tableStmt = prepareStatement(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'render_progress';");
+        untracked = sqlite3_step(tableStmt) != SQLITE_ROW;
+        sqlite3_finalize(tableStmt);
+        if (untracked)
         {
-            std::cerr << "Can't open input database " << dbPath << ": " << sqlite3_errmsg(inDb) << std::endl;
-            sqlite3_close(inDb);
-            continue;
+            return;
         }
+        progressStmt = prepareStatement(db, "INSERT OR IGNORE INTO render_progress (chunk) VALUES (?);");
+    }
 
-        sqlite3_stmt *selectStmt;
-        const char *selectSQL = "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles;";
-        rc = sqlite3_prepare_v2(inDb, selectSQL, -1, &selectStmt, nullptr);
-        if (rc != SQLITE_OK)
+    beginTransaction();
+    stepStatement(db, progressStmt, sqlite3_bind_int64(progressStmt, 1, static_cast<sqlite3_int64>(chunkIndex)));
+
+    if (++pending >= transactionSize)
+    {
+        commit();
+    }
+}
+
+bool MBTilesWriter::readTile(int zoom, int x, int tmsY, std::string &data)
+{
+    commit();
+    createIndexes();
+    if (!readStmt)
+    {
+        readStmt = prepareStatement(db, "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?;");
+    }
+
+    sqlite3_bind_int(readStmt, 1, zoom);
+    sqlite3_bind_int(readStmt, 2, x);
+    sqlite3_bind_int(readStmt, 3, tmsY);
+
+    bool found = sqlite3_step(readStmt) == SQLITE_ROW;
+    if (found)
+    {
+        const void *blob = sqlite3_column_blob(readStmt, 0);
+        data.assign(static_cast<const char *>(blob), sqlite3_column_bytes(readStmt, 0));
+    }
+
+    sqlite3_reset(readStmt);
+    return found;
+}
+
+void MBTilesWriter::finish()
+{
+    commit();
+    createIndexes();
+}
+
+// Builds the indexes a bulk load left out.
+void MBTilesWriter::createIndexes()
+{
+    if (indexed)
+    {
+        return;
+    }
+
+    // Sorting the keys for the index needs far more than the default cache.
+    execSQL(db, "PRAGMA cache_size = -1048576;", "set cache size");
+    execSQL(db, "PRAGMA temp_store = MEMORY;", "set temp store");
+    ::createIndexes(db, deduplicate);
+    indexed = true;
+}
+
+void MBTilesWriter::commit()
+{
+    if (bulkLoad)
+    {
+        auto start = std::chrono::steady_clock::now();
+        flushBatch();
+        insertTime += std::chrono::steady_clock::now() - start;
+    }
+
+    if (pending == 0)
+    {
+        return;
+    }
+
+    int rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK)
+    {
+        std::cerr << "Failed to commit transaction on output database: " << sqlite3_errmsg(db) << std::endl;
+    }
+    pending = 0;
+}
+
+MBTilesReader::MBTilesReader(const std::string &dbPath)
+{
+    int rc = sqlite3_open_v2(dbPath.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+    if (rc != SQLITE_OK)
+    {
+        std::string message = sqlite3_errmsg(db);
+        sqlite3_close(db);
+        throw std::runtime_error("can't open " + dbPath + ": " + message);
+    }
+
+    // SQLite caps this at its compile-time maximum.
+    execSQL(db, "PRAGMA mmap_size = 1099511627776;", "enable mmap");
+    execSQL(db, "PRAGMA query_only = ON;", "set query only");
+
+    rc = sqlite3_prepare_v2(db, "SELECT tile_data FROM tiles WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?;", -1, &tileStmt, nullptr);
+    if (rc != SQLITE_OK)
+    {
+        std::string message = sqlite3_errmsg(db);
+        sqlite3_close(db);
+        throw std::runtime_error(dbPath + " is not an MBTiles file: " + message);
+    }
+}
+
+MBTilesReader::~MBTilesReader()
+{
+    sqlite3_finalize(scanStmt);
+    sqlite3_finalize(tileStmt);
+    sqlite3_close(db);
+}
+
+bool MBTilesReader::readTile(int zoom, int x, int tmsY, std::string &data)
+{
+    sqlite3_bind_int(tileStmt, 1, zoom);
+    sqlite3_bind_int(tileStmt, 2, x);
+    sqlite3_bind_int(tileStmt, 3, tmsY);
+
+    bool found = sqlite3_step(tileStmt) == SQLITE_ROW;
+    if (found)
+    {
+        const void *blob = sqlite3_column_blob(tileStmt, 0);
+        data.assign(static_cast<const char *>(blob), sqlite3_column_bytes(tileStmt, 0));
+    }
+
+    sqlite3_reset(tileStmt);
+    return found;
+}
+
+std::map<std::string, std::string> MBTilesReader::metadata()
+{
+    std::map<std::string, std::string> values;
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "SELECT name, value FROM metadata;", -1, &stmt, nullptr) != SQLITE_OK)
+    {
+        return values;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const unsigned char *name = sqlite3_column_text(stmt, 0);
+        const unsigned char *value = sqlite3_column_text(stmt, 1);
+        if (name && value)
         {
-            std::cerr << "Failed to prepare select statement on " << dbPath << ": " << sqlite3_errmsg(inDb) << std::endl;
-            sqlite3_close(inDb);
-            continue;
+            values[reinterpret_cast<const char *>(name)] = reinterpret_cast<const char *>(value);
         }
+    }
+    sqlite3_finalize(stmt);
+    return values;
+}
 
-        const char *insertSQL = "INSERT OR IGNORE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?);";
-        sqlite3_stmt *insertStmt;
-        rc = sqlite3_prepare_v2(outDb, insertSQL, -1, &insertStmt, nullptr);
-        if (rc != SQLITE_OK)
+bool MBTilesReader::nextTile(int &zoom, int &x, int &tmsY, const void *&data, size_t &size)
+{
+    if (scanFinished)
+    {
+        return false;
+    }
+    if (!scanStmt)
+    {
+        const char *sql = "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles ORDER BY zoom_level, tile_column, tile_row;";
+        if (sqlite3_prepare_v2(db, sql, -1, &scanStmt, nullptr) != SQLITE_OK)
         {
-            std::cerr << "Failed to prepare insert statement on output database: " << sqlite3_errmsg(outDb) << std::endl;
-            sqlite3_finalize(selectStmt);
-            sqlite3_close(inDb);
-            continue;
+            throw std::runtime_error(std::string("can't list tiles: ") + sqlite3_errmsg(db));
         }
+    }
 
-        while ((rc = sqlite3_step(selectStmt)) == SQLITE_ROW)
+    int rc = sqlite3_step(scanStmt);
+    if (rc != SQLITE_ROW)
+    {
+        scanFinished = true;
+        if (rc != SQLITE_DONE)
         {
-            int zoom_level = sqlite3_column_int(selectStmt, 0);
-            int tile_column = sqlite3_column_int(selectStmt, 1);
-            int tile_row = sqlite3_column_int(selectStmt, 2);
-            const void *tile_data = sqlite3_column_blob(selectStmt, 3);
-            int tile_data_size = sqlite3_column_bytes(selectStmt, 3);
+            throw std::runtime_error(std::string("can't list tiles: ") + sqlite3_errmsg(db));
+        }
+        return false;
+    }
 
-            sqlite3_bind_int(insertStmt, 1, zoom_level);
-            sqlite3_bind_int(insertStmt, 2, tile_column);
-            sqlite3_bind_int(insertStmt, 3, tile_row);
-            sqlite3_bind_blob(insertStmt, 4, tile_data, tile_data_size, SQLITE_TRANSIENT);
+    zoom = sqlite3_column_int(scanStmt, 0);
+    x = sqlite3_column_int(scanStmt, 1);
+    tmsY = sqlite3_column_int(scanStmt, 2);
+    data = sqlite3_column_blob(scanStmt, 3);
+    size = static_cast<size_t>(sqlite3_column_bytes(scanStmt, 3));
+    return true;
+}
 
-            int insertRc = sqlite3_step(insertStmt);
-            if (insertRc != SQLITE_DONE)
-            {
-                std::cerr << "Failed to insert tile into output database: " << sqlite3_errmsg(outDb) << std::endl;
-            }
+// tile_content_id(tile_data): the id the writer gives a tile's image, so a
+// merge can deduplicate in SQL.
+static void tileContentIdFunction(sqlite3_context *context, int, sqlite3_value **values)
+{
+    const void *data = sqlite3_value_blob(values[0]);
+    std::string id = tileContentId(data, static_cast<size_t>(sqlite3_value_bytes(values[0])));
+    sqlite3_result_text(context, id.data(), static_cast<int>(id.size()), SQLITE_TRANSIENT);
+}
 
-            sqlite3_reset(insertStmt);
-            sqlite3_clear_bindings(insertStmt);
+MergeResult mergeMBTiles(const std::vector<std::string> &inputs, const std::string &output, bool deduplicate)
+{
+    std::string formatName;
+    for (const std::string &input : inputs)
+    {
+        // The reader throws for a missing or unreadable input, before
+        // hasRenderProgress() could end the process over it.
+        MBTilesReader reader(input);
+        if (hasRenderProgress(input.c_str()))
+        {
+            throw std::runtime_error(input + " is unfinished, continue its render with --resume first, or render it again if it was a bulk load");
+        }
+        std::string name = reader.metadata()["format"];
+        if (&input == &inputs.front())
+        {
+            formatName = name;
         }
+        else if (name != formatName)
+        {
+            throw std::runtime_error(input + " has format '" + name + "', " + inputs.front() + " has '" + formatName + "'");
+        }
+    }
 
-        if (rc != SQLITE_DONE)
+    ImageFormat format;
+    bool known = false;
+    for (ImageFormat candidate : {ImageFormat::PNG, ImageFormat::JPEG, ImageFormat::WEBP})
+    {
+        if (imageString(candidate) == formatName)
         {
-            std::cerr << "Error while reading from " << dbPath << ": " << sqlite3_errmsg(inDb) << std::endl;
+            format = candidate;
+            known = true;
         }
+    }
+    if (!known)
+    {
+        throw std::runtime_error(inputs.front() + " has no known tile format");
+    }
 
-        sqlite3_finalize(selectStmt);
-        sqlite3_finalize(insertStmt);
-        sqlite3_close(inDb);
+    createMBTilesDatabase(output.c_str(), format, deduplicate, true);
+
+    sqlite3 *db;
+    if (sqlite3_open(output.c_str(), &db) != SQLITE_OK)
+    {
+        std::string message = sqlite3_errmsg(db);
+        sqlite3_close(db);
+        throw std::runtime_error("can't open " + output + ": " + message);
     }
+    std::unique_ptr<sqlite3, int (*)(sqlite3 *)> closeDb(db, sqlite3_close);
+    auto exec = [&](const std::string &sql)
+    {
+        if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK)
+        {
+            throw std::runtime_error("can't write " + output + ": " + sqlite3_errmsg(db));
+        }
+    };
+    auto count = [&](const std::string &sql)
+    {
+        sqlite3_stmt *stmt = prepareStatement(db, sql.c_str());
+        uint64_t rows = sqlite3_step(stmt) == SQLITE_ROW ? static_cast<uint64_t>(sqlite3_column_int64(stmt, 0)) : 0;
+        sqlite3_finalize(stmt);
+        return rows;
+    };
 
-    rc = sqlite3_exec(outDb, "COMMIT;", nullptr, nullptr, nullptr);
-    if (rc != SQLITE_OK)
+    exec("PRAGMA journal_mode = OFF;");
+    exec("PRAGMA synchronous = OFF;");
+    exec("PRAGMA locking_mode = EXCLUSIVE;");
+    exec("PRAGMA cache_size = -262144;");
+    sqlite3_create_function(db, "tile_content_id", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr, tileContentIdFunction, nullptr, nullptr);
+
+    // The key index holds no tile data, so keeping it up to date while
+    // copying is cheaper than building it from the finished table, which
+    // means reading all of it again. It also keeps the first copy of a key
+    // when inputs do overlap.
+    createIndexes(db, deduplicate);
+
+    // Every input is copied in key order by a single statement.
+    const std::string keys = "zoom_level, tile_column, tile_row";
+    MergeResult result;
+    for (const std::string &input : inputs)
     {
-        std::cerr << "Failed to commit transaction on output database: " << sqlite3_errmsg(outDb) << std::endl;
+        sqlite3_stmt *attach = prepareStatement(db, "ATTACH DATABASE ? AS input;");
+        sqlite3_bind_text(attach, 1, input.c_str(), -1, SQLITE_STATIC);
+        int rc = sqlite3_step(attach);
+        sqlite3_finalize(attach);
+        if (rc != SQLITE_DONE)
+        {
+            throw std::runtime_error("can't open " + input + ": " + sqlite3_errmsg(db));
+        }
+        exec("PRAGMA input.mmap_size = 1099511627776;");
+
+        bool inputDeduplicated = count("SELECT COUNT(*) FROM input.sqlite_master WHERE type = 'table' AND name = 'map';") > 0;
+        uint64_t inputTiles = count(inputDeduplicated ? "SELECT COUNT(*) FROM input.map;" : "SELECT COUNT(*) FROM input.tiles;");
+
+        uint64_t inserted;
+        exec("BEGIN;");
+        if (deduplicate)
+        {
+            exec("INSERT OR IGNORE INTO map (" + keys + ", tile_id) SELECT " + keys + ", tile_content_id(tile_data) FROM input.tiles ORDER BY " + keys + ";");
+            inserted = static_cast<uint64_t>(sqlite3_changes(db));
+            // A deduplicated input has every image once already.
+            exec(inputDeduplicated
+                     ? "INSERT OR IGNORE INTO images (tile_data, tile_id) SELECT tile_data, tile_content_id(tile_data) FROM input.images "
+                       "WHERE tile_id IN (SELECT tile_id FROM input.map);"
+                     : "INSERT OR IGNORE INTO images (tile_data, tile_id) SELECT tile_data, tile_content_id(tile_data) FROM input.tiles;");
+        }
+        else
+        {
+            exec("INSERT OR IGNORE INTO tiles (" + keys + ", tile_data) SELECT " + keys + ", tile_data FROM input.tiles ORDER BY " + keys + ";");
+            inserted = static_cast<uint64_t>(sqlite3_changes(db));
+        }
+        exec("COMMIT;");
+        exec("DETACH DATABASE input;");
+        result.tiles += inserted;
+        result.duplicates += inputTiles - inserted;
     }
 
-    sqlite3_close(outDb);
-}
\ No newline at end of file
+    if (deduplicate && result.duplicates > 0)
+    {
+        // Images of tiles another input already had.
+        exec("DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map);");
+    }
+    exec("DROP TABLE bulk_load_unfinished;");
+    return result;
+}
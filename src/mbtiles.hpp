@@ -1,13 +1,155 @@
 #ifndef MBTILES_HPP
 #define MBTILES_HPP
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
 #include <string>
+#include <vector>
+#include <sqlite3.h>
 #include "image_encoding.hpp"
+#include "tile_sink.hpp"
 
-void mergeMBTiles(const std::vector<std::string> &dbPaths, const char *outputDbPath);
+// With `deduplicate` the tiles are stored in the images/map layout behind a
+// tiles view, so identical tiles share one blob. With `bulkLoad` the file gets
+// large pages and no indexes but the one on image ids; the bulk loading
+// MBTilesWriter adds the others once all tiles are in. A bulk load can't be
+// resumed, so instead of render progress it gets a bulk_load_unfinished
+// table that finishRenderProgress() drops.
+void createMBTilesDatabase(const char *dbPath, ImageFormat imageFormat, bool deduplicate = false, bool bulkLoad = false);
 
-void createMBTilesDatabase(const char *dbPath, ImageFormat imageFormat);
+// Render progress lives next to the tiles: a render_progress table of the
+// scheduler chunks whose tiles are all committed, and a render_params table
+// with the options the chunk numbers are only valid for. A finished render
+// drops both.
+void createRenderProgress(const char *dbPath, const std::string &params);
 
-void createTemporaryTileDatabase(const char *dbPath);
+// Reads the completed chunks (sorted) of an interrupted render. Returns false
+// if the database has no progress to resume from or was rendered with
+// different options.
+bool loadRenderProgress(const char *dbPath, const std::string &params, std::vector<uint64_t> &completed);
+
+void finishRenderProgress(const char *dbPath);
+
+// True if the database uses the images/map layout.
+bool isDeduplicatedMBTiles(const char *dbPath);
+
+// True while a render or bulk load into the database is unfinished.
+bool hasRenderProgress(const char *dbPath);
+
+// Deletes the images no tile points at any more, which replacing tiles of a
+// deduplicated database leaves behind. Returns how many were deleted.
+size_t removeUnusedImages(const char *dbPath);
+
+// Inserts tiles into an MBTiles database created by createMBTilesDatabase(),
+// batching them into transactions. `deduplicate` and `bulkLoad` have to match
+// how the database was created. markChunkDone() does nothing on a database
+// without render progress, such as a finished render being updated.
+// A bulk loading writer trades crash safety for speed: it writes without a
+// journal or fsync and collects tiles into large batches that are inserted in
+// key order, so the index built by finish() or the first readTile() reads the
+// table sequentially. An interrupted bulk load leaves a file that can't be
+// resumed.
+class MBTilesWriter : public TileSink
+{
+public:
+    explicit MBTilesWriter(const char *dbPath, bool deduplicate = false, bool bulkLoad = false);
+    ~MBTilesWriter() override;
+
+    MBTilesWriter(const MBTilesWriter &) = delete;
+    MBTilesWriter &operator=(const MBTilesWriter &) = delete;
+
+    void insertTile(int zoom, int x, int tmsY, const void *data, size_t size) override;
+    void markChunkDone(uint64_t chunkIndex) override;
+    bool readTile(int zoom, int x, int tmsY, std::string &data) override;
+    void commit() override;
+    void finish() override;
+
+    size_t tileCount() const override { return tiles; }
+    size_t imageCount() const override { return images; }
+
+    double insertSeconds() const override { return std::chrono::duration<double>(insertTime).count(); }
+    uint64_t byteCount() const override { return bytes; }
+
+private:
+    static constexpr size_t transactionSize = 1000;
+    static constexpr size_t bulkBatchTiles = 65536;
+    static constexpr size_t bulkBatchBytes = 64 << 20;
+
+    struct BatchedTile
+    {
+        int zoom;
+        int x;
+        int tmsY;
+        size_t offset; // of the tile's bytes in batchData
+        size_t size;
+    };
+
+    void beginTransaction();
+    void writeTile(int zoom, int x, int tmsY, const void *data, size_t size);
+    void flushBatch();
+    void createIndexes();
+
+    sqlite3 *db = nullptr;
+    sqlite3_stmt *stmt = nullptr;
+    sqlite3_stmt *imageStmt = nullptr;
+    sqlite3_stmt *progressStmt = nullptr;
+    sqlite3_stmt *readStmt = nullptr;
+    size_t pending = 0;
+    size_t tiles = 0;
+    size_t images = 0; // distinct images this writer added
+    uint64_t bytes = 0;
+    std::chrono::steady_clock::duration insertTime{};
+
+    bool deduplicate;
+    bool bulkLoad;
+    bool indexed;
+    bool untracked = false; // the database has no render progress, chunks are not recorded
+    std::vector<BatchedTile> batch;
+    std::string batchData; // bytes of all batched tiles, back to back
+    std::string contentId; // id of the tile being written
+};
+
+// Read-only access to an existing MBTiles file, e.g. a vector tile source.
+// SQLite memory-maps the file, so tile reads are served from the page cache
+// without extra copies. Throws std::runtime_error if it can't be opened.
+class MBTilesReader
+{
+public:
+    explicit MBTilesReader(const std::string &dbPath);
+    ~MBTilesReader();
+
+    MBTilesReader(const MBTilesReader &) = delete;
+    MBTilesReader &operator=(const MBTilesReader &) = delete;
+
+    // Stores the tile as it is in the file. Returns false if there is none.
+    bool readTile(int zoom, int x, int tmsY, std::string &data);
+
+    std::map<std::string, std::string> metadata();
+
+    // Steps through every tile ordered by zoom, column and row. The data
+    // stays valid until the next call. Returns false after the last tile.
+    bool nextTile(int &zoom, int &x, int &tmsY, const void *&data, size_t &size);
+
+private:
+    sqlite3 *db = nullptr;
+    sqlite3_stmt *tileStmt = nullptr;
+    sqlite3_stmt *scanStmt = nullptr;
+    bool scanFinished = false;
+};
+
+struct MergeResult
+{
+    uint64_t tiles = 0;
+    uint64_t duplicates = 0; // tiles found in more than one input, taken from the first
+};
+
+// Writes the tiles of several MBTiles files with the same format, e.g. the
+// shards of a render, into a new file. Each input is attached to the output
+// and copied in key order by one INSERT ... SELECT. Throws
+// std::runtime_error if an input can't be read, has another format or is
+// still being rendered, bulk loads that were cut short included.
+MergeResult mergeMBTiles(const std::vector<std::string> &inputs, const std::string &output, bool deduplicate);
 
 #endif // MBTILES_HPP
@@ -0,0 +1,303 @@
+#include "pixel_ops.hpp"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TILERENDER_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// All kernels compute util::unpremultiply()'s (255 * c + a / 2) / a. The SIMD
+// paths evaluate it as (n + 0.5) * (1.0f / a) in single precision: n is below
+// 2^16, so the rounding error stays under 0.5 / a, which is the distance from
+// (n + 0.5) / a to the nearest integer. Truncating therefore yields the exact
+// integer quotient, and masking to 8 bits mirrors the scalar uint8_t cast.
+
+namespace mbgl {
+
+    namespace {
+
+        inline void unpremultiplyPixel(const uint8_t* src, uint8_t* dst) {
+            const uint8_t a = src[3];
+            if (a) {
+                dst[0] = static_cast<uint8_t>((255 * src[0] + (a / 2)) / a);
+                dst[1] = static_cast<uint8_t>((255 * src[1] + (a / 2)) / a);
+                dst[2] = static_cast<uint8_t>((255 * src[2] + (a / 2)) / a);
+            } else {
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+            }
+        }
+
+        void unpremultiplyRGBAScalar(const uint8_t* src, uint8_t* dst, size_t pixels) {
+            for (size_t i = 0; i < pixels; ++i) {
+                unpremultiplyPixel(src + i * 4, dst + i * 4);
+                dst[i * 4 + 3] = src[i * 4 + 3];
+            }
+        }
+
+        void unpremultiplyRGBScalar(const uint8_t* src, uint8_t* dst, size_t pixels) {
+            for (size_t i = 0; i < pixels; ++i) {
+                unpremultiplyPixel(src + i * 4, dst + i * 3);
+            }
+        }
+
+        bool isUniformScalar(const uint8_t* data, size_t pixels, uint32_t first) {
+            for (size_t i = 0; i < pixels; ++i) {
+                uint32_t pixel;
+                std::memcpy(&pixel, data + i * 4, 4);
+                if (pixel != first) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void downsampleRowScalar(const uint8_t* top, const uint8_t* bottom, uint8_t* dst, uint32_t outPixels) {
+            for (uint32_t i = 0; i < outPixels; ++i) {
+                for (int c = 0; c < 4; ++c) {
+                    dst[i * 4 + c] = static_cast<uint8_t>(
+                        (top[i * 8 + c] + top[i * 8 + 4 + c] + bottom[i * 8 + c] + bottom[i * 8 + 4 + c] + 2) >> 2);
+                }
+            }
+        }
+
+#ifdef TILERENDER_X86_SIMD
+
+        // Sums the vertically added pixel pairs (p0, p1) (p2, p3) held as 16-bit
+        // channels in lo = [p0 p1] and hi = [p2 p3] into [p0 + p1, p2 + p3].
+        inline __m128i sumPairs(__m128i lo, __m128i hi) {
+            return _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+        }
+
+        void downsampleRowSSE2(const uint8_t* top, const uint8_t* bottom, uint8_t* dst, uint32_t outPixels) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i two = _mm_set1_epi16(2);
+            uint32_t i = 0;
+            // Eight source pixels of both rows make four output pixels.
+            for (; i + 4 <= outPixels; i += 4) {
+                __m128i t0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + i * 8));
+                __m128i t1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + i * 8 + 16));
+                __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + i * 8));
+                __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + i * 8 + 16));
+
+                __m128i v0 = _mm_add_epi16(_mm_unpacklo_epi8(t0, zero), _mm_unpacklo_epi8(b0, zero));
+                __m128i v1 = _mm_add_epi16(_mm_unpackhi_epi8(t0, zero), _mm_unpackhi_epi8(b0, zero));
+                __m128i v2 = _mm_add_epi16(_mm_unpacklo_epi8(t1, zero), _mm_unpacklo_epi8(b1, zero));
+                __m128i v3 = _mm_add_epi16(_mm_unpackhi_epi8(t1, zero), _mm_unpackhi_epi8(b1, zero));
+
+                __m128i lo = _mm_srli_epi16(_mm_add_epi16(sumPairs(v0, v1), two), 2);
+                __m128i hi = _mm_srli_epi16(_mm_add_epi16(sumPairs(v2, v3), two), 2);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), _mm_packus_epi16(lo, hi));
+            }
+            downsampleRowScalar(top + i * 8, bottom + i * 8, dst + i * 4, outPixels - i);
+        }
+
+        template <int Shift>
+        inline __m128i unpremultiplyChannel4(__m128i px, __m128i half, __m128 rcp) {
+            const __m128i mask = _mm_set1_epi32(0xFF);
+            __m128i c = _mm_and_si128(_mm_srli_epi32(px, Shift), mask);
+            __m128i n = _mm_add_epi32(_mm_sub_epi32(_mm_slli_epi32(c, 8), c), half);
+            __m128 q = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(n), _mm_set1_ps(0.5f)), rcp);
+            return _mm_slli_epi32(_mm_and_si128(_mm_cvttps_epi32(q), mask), Shift);
+        }
+
+        inline __m128i unpremultiply4(__m128i px) {
+            const __m128i a = _mm_srli_epi32(px, 24);
+            const __m128i half = _mm_srli_epi32(a, 1);
+            const __m128 rcp = _mm_div_ps(_mm_set1_ps(1.0f), _mm_cvtepi32_ps(a));
+
+            __m128i out = _mm_or_si128(_mm_or_si128(unpremultiplyChannel4<0>(px, half, rcp),
+                                                    unpremultiplyChannel4<8>(px, half, rcp)),
+                                       _mm_or_si128(unpremultiplyChannel4<16>(px, half, rcp),
+                                                    _mm_slli_epi32(a, 24)));
+
+            // Fully transparent pixels are passed through untouched.
+            __m128i transparent = _mm_cmpeq_epi32(a, _mm_setzero_si128());
+            return _mm_or_si128(_mm_and_si128(transparent, px), _mm_andnot_si128(transparent, out));
+        }
+
+        bool isUniformSSE2(const uint8_t* data, size_t pixels, uint32_t first) {
+            const __m128i expected = _mm_set1_epi32(static_cast<int>(first));
+            size_t i = 0;
+            for (; i + 16 <= pixels; i += 16) {
+                const __m128i* p = reinterpret_cast<const __m128i*>(data + i * 4);
+                __m128i diff = _mm_or_si128(
+                    _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 0), expected), _mm_xor_si128(_mm_loadu_si128(p + 1), expected)),
+                    _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 2), expected), _mm_xor_si128(_mm_loadu_si128(p + 3), expected)));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF) {
+                    return false;
+                }
+            }
+            return isUniformScalar(data + i * 4, pixels - i, first);
+        }
+
+        void unpremultiplyRGBASSE2(const uint8_t* src, uint8_t* dst, size_t pixels) {
+            size_t i = 0;
+            for (; i + 4 <= pixels; i += 4) {
+                __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 4), unpremultiply4(px));
+            }
+            unpremultiplyRGBAScalar(src + i * 4, dst + i * 4, pixels - i);
+        }
+
+        void unpremultiplyRGBSSE2(const uint8_t* src, uint8_t* dst, size_t pixels) {
+            size_t i = 0;
+            alignas(16) uint8_t rgba[16];
+            for (; i + 4 <= pixels; i += 4) {
+                __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4));
+                _mm_store_si128(reinterpret_cast<__m128i*>(rgba), unpremultiply4(px));
+                uint8_t* out = dst + i * 3;
+                for (int p = 0; p < 4; ++p) {
+                    out[p * 3 + 0] = rgba[p * 4 + 0];
+                    out[p * 3 + 1] = rgba[p * 4 + 1];
+                    out[p * 3 + 2] = rgba[p * 4 + 2];
+                }
+            }
+            unpremultiplyRGBScalar(src + i * 4, dst + i * 3, pixels - i);
+        }
+
+        template <int Shift>
+        __attribute__((target("avx2"))) inline __m256i unpremultiplyChannel8(__m256i px, __m256i half, __m256 rcp) {
+            const __m256i mask = _mm256_set1_epi32(0xFF);
+            __m256i c = _mm256_and_si256(_mm256_srli_epi32(px, Shift), mask);
+            __m256i n = _mm256_add_epi32(_mm256_sub_epi32(_mm256_slli_epi32(c, 8), c), half);
+            __m256 q = _mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(n), _mm256_set1_ps(0.5f)), rcp);
+            return _mm256_slli_epi32(_mm256_and_si256(_mm256_cvttps_epi32(q), mask), Shift);
+        }
+
+        __attribute__((target("avx2"))) inline __m256i unpremultiply8(__m256i px) {
+            const __m256i a = _mm256_srli_epi32(px, 24);
+            const __m256i half = _mm256_srli_epi32(a, 1);
+            const __m256 rcp = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_cvtepi32_ps(a));
+
+            __m256i out = _mm256_or_si256(_mm256_or_si256(unpremultiplyChannel8<0>(px, half, rcp),
+                                                          unpremultiplyChannel8<8>(px, half, rcp)),
+                                          _mm256_or_si256(unpremultiplyChannel8<16>(px, half, rcp),
+                                                          _mm256_slli_epi32(a, 24)));
+
+            __m256i transparent = _mm256_cmpeq_epi32(a, _mm256_setzero_si256());
+            return _mm256_blendv_epi8(out, px, transparent);
+        }
+
+        __attribute__((target("avx2"))) bool isUniformAVX2(const uint8_t* data, size_t pixels, uint32_t first) {
+            const __m256i expected = _mm256_set1_epi32(static_cast<int>(first));
+            size_t i = 0;
+            for (; i + 32 <= pixels; i += 32) {
+                const __m256i* p = reinterpret_cast<const __m256i*>(data + i * 4);
+                __m256i diff = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256(p + 0), expected), _mm256_xor_si256(_mm256_loadu_si256(p + 1), expected)),
+                    _mm256_or_si256(_mm256_xor_si256(_mm256_loadu_si256(p + 2), expected), _mm256_xor_si256(_mm256_loadu_si256(p + 3), expected)));
+                if (!_mm256_testz_si256(diff, diff)) {
+                    return false;
+                }
+            }
+            return isUniformScalar(data + i * 4, pixels - i, first);
+        }
+
+        __attribute__((target("avx2"))) void unpremultiplyRGBAAVX2(const uint8_t* src, uint8_t* dst, size_t pixels) {
+            size_t i = 0;
+            for (; i + 8 <= pixels; i += 8) {
+                __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * 4), unpremultiply8(px));
+            }
+            unpremultiplyRGBAScalar(src + i * 4, dst + i * 4, pixels - i);
+        }
+
+        __attribute__((target("avx2"))) void unpremultiplyRGBAVX2(const uint8_t* src, uint8_t* dst, size_t pixels) {
+            // Packs the RGB bytes of four pixels into the low 12 bytes of each lane.
+            const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                                  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+            size_t i = 0;
+            // Each 16-byte store spills 4 bytes past its 12 bytes of output,
+            // so stop while at least 28 bytes of room are left.
+            for (; i + 10 <= pixels; i += 8) {
+                __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4));
+                __m256i rgb = _mm256_shuffle_epi8(unpremultiply8(px), pack);
+                uint8_t* out = dst + i * 3;
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(rgb));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12), _mm256_extracti128_si256(rgb, 1));
+            }
+            unpremultiplyRGBScalar(src + i * 4, dst + i * 3, pixels - i);
+        }
+
+#endif // TILERENDER_X86_SIMD
+
+        using Kernel = void (*)(const uint8_t*, uint8_t*, size_t);
+        using DownsampleKernel = void (*)(const uint8_t*, const uint8_t*, uint8_t*, uint32_t);
+
+        DownsampleKernel selectDownsampleKernel() {
+#ifdef TILERENDER_X86_SIMD
+            return downsampleRowSSE2;
+#else
+            return downsampleRowScalar;
+#endif
+        }
+        using UniformKernel = bool (*)(const uint8_t*, size_t, uint32_t);
+
+        UniformKernel selectUniformKernel() {
+#ifdef TILERENDER_X86_SIMD
+            return __builtin_cpu_supports("avx2") ? isUniformAVX2 : isUniformSSE2;
+#else
+            return isUniformScalar;
+#endif
+        }
+
+        Kernel selectRGBAKernel() {
+#ifdef TILERENDER_X86_SIMD
+            return __builtin_cpu_supports("avx2") ? unpremultiplyRGBAAVX2 : unpremultiplyRGBASSE2;
+#else
+            return unpremultiplyRGBAScalar;
+#endif
+        }
+
+        Kernel selectRGBKernel() {
+#ifdef TILERENDER_X86_SIMD
+            return __builtin_cpu_supports("avx2") ? unpremultiplyRGBAVX2 : unpremultiplyRGBSSE2;
+#else
+            return unpremultiplyRGBScalar;
+#endif
+        }
+
+    } // namespace
+
+    void unpremultiplyRGBA(const uint8_t* src, uint8_t* dst, size_t pixels) {
+        static const Kernel kernel = selectRGBAKernel();
+        kernel(src, dst, pixels);
+    }
+
+    void unpremultiplyRGB(const uint8_t* src, uint8_t* dst, size_t pixels) {
+        static const Kernel kernel = selectRGBKernel();
+        kernel(src, dst, pixels);
+    }
+
+    bool isUniform(const uint8_t* data, size_t pixels, uint32_t& color) {
+        static const UniformKernel kernel = selectUniformKernel();
+        if (pixels == 0) {
+            return false;
+        }
+        std::memcpy(&color, data, 4);
+        return kernel(data, pixels, color);
+    }
+
+    std::vector<UnpremultiplyKernel> unpremultiplyKernels() {
+        std::vector<UnpremultiplyKernel> kernels = {{"scalar", unpremultiplyRGBAScalar, unpremultiplyRGBScalar}};
+#ifdef TILERENDER_X86_SIMD
+        kernels.push_back({"sse2", unpremultiplyRGBASSE2, unpremultiplyRGBSSE2});
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.push_back({"avx2", unpremultiplyRGBAAVX2, unpremultiplyRGBAVX2});
+        }
+#endif
+        return kernels;
+    }
+
+    void downsample2x2(const uint8_t* src, size_t srcStride, uint32_t width, uint32_t height,
+                       uint8_t* dst, size_t dstStride) {
+        static const DownsampleKernel kernel = selectDownsampleKernel();
+        for (uint32_t y = 0; y + 1 < height; y += 2) {
+            kernel(src + y * srcStride, src + (y + 1) * srcStride, dst + (y / 2) * dstStride, width / 2);
+        }
+    }
+
+} // namespace mbgl
@@ -0,0 +1,42 @@
+#ifndef PIXEL_OPS_HPP
+#define PIXEL_OPS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace mbgl {
+
+    // Unpremultiplies `pixels` RGBA pixels from `src` into `dst`. The result is
+    // bit-exact with util::unpremultiply(), without cloning the source image.
+    void unpremultiplyRGBA(const uint8_t* src, uint8_t* dst, size_t pixels);
+
+    // Same as unpremultiplyRGBA(), but drops alpha and writes packed RGB, which
+    // is what libjpeg expects. `dst` must hold pixels * 3 bytes.
+    void unpremultiplyRGB(const uint8_t* src, uint8_t* dst, size_t pixels);
+
+    // Returns true if all `pixels` RGBA pixels are identical and stores that
+    // pixel in `color` (in memory byte order). Stops at the first mismatch.
+    bool isUniform(const uint8_t* data, size_t pixels, uint32_t& color);
+
+    // Box-filters `src` (width x height RGBA, both even) to half its size:
+    // every output channel is the rounded mean of a 2x2 block. Premultiplied
+    // input keeps transparent pixels from bleeding their colour. Rows are
+    // `srcStride` and `dstStride` bytes apart.
+    void downsample2x2(const uint8_t* src, size_t srcStride, uint32_t width, uint32_t height,
+                       uint8_t* dst, size_t dstStride);
+
+    // One implementation of unpremultiplyRGBA() and unpremultiplyRGB().
+    struct UnpremultiplyKernel {
+        const char* name;
+        void (*rgba)(const uint8_t* src, uint8_t* dst, size_t pixels);
+        void (*rgb)(const uint8_t* src, uint8_t* dst, size_t pixels);
+    };
+
+    // Every kernel this CPU can run, scalar first, so tests can check each
+    // of them and not only the one the dispatcher picks.
+    std::vector<UnpremultiplyKernel> unpremultiplyKernels();
+
+} // namespace mbgl
+
+#endif // PIXEL_OPS_HPP
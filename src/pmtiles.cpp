@@ -0,0 +1,770 @@
+#include "pmtiles.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compression.hpp"
+#include "tile_hash.hpp"
+
+namespace
+{
+
+    template <typename T>
+    T readLittleEndian(const uint8_t *data)
+    {
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); i++)
+        {
+            value |= static_cast<T>(static_cast<std::make_unsigned_t<T>>(data[i]) << (8 * i));
+        }
+        return value;
+    }
+
+    template <typename T>
+    void writeLittleEndian(std::string &out, T value)
+    {
+        for (size_t i = 0; i < sizeof(T); i++)
+        {
+            out.push_back(static_cast<char>(static_cast<std::make_unsigned_t<T>>(value) >> (8 * i)));
+        }
+    }
+
+    void writeVarint(std::string &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    uint64_t readVarint(const std::string &data, size_t &position)
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            if (position >= data.size())
+            {
+                throw std::runtime_error("truncated PMTiles directory");
+            }
+            uint8_t byte = static_cast<uint8_t>(data[position++]);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return value;
+            }
+        }
+        throw std::runtime_error("malformed varint in PMTiles directory");
+    }
+
+    // The entry whose range may hold tileId: the last one starting at or
+    // before it.
+    const PMTilesEntry *findEntry(const std::vector<PMTilesEntry> &entries, uint64_t tileId)
+    {
+        auto next = std::upper_bound(entries.begin(), entries.end(), tileId, [](uint64_t id, const PMTilesEntry &entry)
+                                     { return id < entry.tileId; });
+        if (next == entries.begin())
+        {
+            return nullptr;
+        }
+        return &*(next - 1);
+    }
+
+} // namespace
+
+uint64_t pmtilesTileId(int zoom, int x, int y)
+{
+    // Tiles of all lower zoom levels come first.
+    uint64_t id = ((uint64_t(1) << (2 * zoom)) - 1) / 3;
+
+    uint64_t tx = x;
+    uint64_t ty = y;
+    for (int level = zoom - 1; level >= 0; level--)
+    {
+        uint64_t side = uint64_t(1) << level;
+        uint64_t rx = (tx & side) ? 1 : 0;
+        uint64_t ry = (ty & side) ? 1 : 0;
+        id += side * side * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve continues in the right direction.
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                tx = side - 1 - (tx & (side - 1));
+                ty = side - 1 - (ty & (side - 1));
+            }
+            std::swap(tx, ty);
+        }
+    }
+    return id;
+}
+
+void pmtilesTileCoordinates(uint64_t tileId, int &zoom, int &x, int &y)
+{
+    uint64_t first = 0;
+    for (zoom = 0; zoom < 31; zoom++)
+    {
+        uint64_t count = uint64_t(1) << (2 * zoom);
+        if (tileId - first < count)
+        {
+            break;
+        }
+        first += count;
+    }
+
+    // Walks the curve from the smallest quadrants up, undoing the rotations
+    // of pmtilesTileId().
+    uint64_t position = tileId - first;
+    uint64_t tx = 0;
+    uint64_t ty = 0;
+    for (uint64_t side = 1; side < (uint64_t(1) << zoom); side *= 2)
+    {
+        uint64_t rx = 1 & (position / 2);
+        uint64_t ry = 1 & (position ^ rx);
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                tx = side - 1 - tx;
+                ty = side - 1 - ty;
+            }
+            std::swap(tx, ty);
+        }
+        tx += side * rx;
+        ty += side * ry;
+        position /= 4;
+    }
+    x = static_cast<int>(tx);
+    y = static_cast<int>(ty);
+}
+
+PMTilesHeader parsePMTilesHeader(const uint8_t *data)
+{
+    if (std::memcmp(data, "PMTiles", 7) != 0)
+    {
+        throw std::runtime_error("not a PMTiles archive");
+    }
+    if (data[7] != 3)
+    {
+        throw std::runtime_error("unsupported PMTiles version " + std::to_string(data[7]));
+    }
+
+    PMTilesHeader header;
+    header.rootDirectoryOffset = readLittleEndian<uint64_t>(data + 8);
+    header.rootDirectoryLength = readLittleEndian<uint64_t>(data + 16);
+    header.metadataOffset = readLittleEndian<uint64_t>(data + 24);
+    header.metadataLength = readLittleEndian<uint64_t>(data + 32);
+    header.leafDirectoriesOffset = readLittleEndian<uint64_t>(data + 40);
+    header.leafDirectoriesLength = readLittleEndian<uint64_t>(data + 48);
+    header.tileDataOffset = readLittleEndian<uint64_t>(data + 56);
+    header.tileDataLength = readLittleEndian<uint64_t>(data + 64);
+    header.addressedTiles = readLittleEndian<uint64_t>(data + 72);
+    header.tileEntries = readLittleEndian<uint64_t>(data + 80);
+    header.tileContents = readLittleEndian<uint64_t>(data + 88);
+    header.clustered = data[96] == 1;
+    header.internalCompression = static_cast<PMTilesCompression>(data[97]);
+    header.tileCompression = static_cast<PMTilesCompression>(data[98]);
+    header.tileType = static_cast<PMTilesTileType>(data[99]);
+    header.minZoom = data[100];
+    header.maxZoom = data[101];
+    header.minLonE7 = readLittleEndian<int32_t>(data + 102);
+    header.minLatE7 = readLittleEndian<int32_t>(data + 106);
+    header.maxLonE7 = readLittleEndian<int32_t>(data + 110);
+    header.maxLatE7 = readLittleEndian<int32_t>(data + 114);
+    header.centerZoom = data[118];
+    header.centerLonE7 = readLittleEndian<int32_t>(data + 119);
+    header.centerLatE7 = readLittleEndian<int32_t>(data + 123);
+    return header;
+}
+
+std::string serializePMTilesHeader(const PMTilesHeader &header)
+{
+    std::string out("PMTiles\x03", 8);
+    writeLittleEndian(out, header.rootDirectoryOffset);
+    writeLittleEndian(out, header.rootDirectoryLength);
+    writeLittleEndian(out, header.metadataOffset);
+    writeLittleEndian(out, header.metadataLength);
+    writeLittleEndian(out, header.leafDirectoriesOffset);
+    writeLittleEndian(out, header.leafDirectoriesLength);
+    writeLittleEndian(out, header.tileDataOffset);
+    writeLittleEndian(out, header.tileDataLength);
+    writeLittleEndian(out, header.addressedTiles);
+    writeLittleEndian(out, header.tileEntries);
+    writeLittleEndian(out, header.tileContents);
+    out.push_back(header.clustered ? 1 : 0);
+    out.push_back(static_cast<char>(header.internalCompression));
+    out.push_back(static_cast<char>(header.tileCompression));
+    out.push_back(static_cast<char>(header.tileType));
+    out.push_back(static_cast<char>(header.minZoom));
+    out.push_back(static_cast<char>(header.maxZoom));
+    writeLittleEndian(out, header.minLonE7);
+    writeLittleEndian(out, header.minLatE7);
+    writeLittleEndian(out, header.maxLonE7);
+    writeLittleEndian(out, header.maxLatE7);
+    out.push_back(static_cast<char>(header.centerZoom));
+    writeLittleEndian(out, header.centerLonE7);
+    writeLittleEndian(out, header.centerLatE7);
+    return out;
+}
+
+std::vector<PMTilesEntry> parsePMTilesDirectory(const std::string &data)
+{
+    size_t position = 0;
+    uint64_t count = readVarint(data, position);
+    if (count > data.size())
+    {
+        throw std::runtime_error("malformed PMTiles directory");
+    }
+
+    // Columns: tile id deltas, run lengths, lengths, offsets.
+    std::vector<PMTilesEntry> entries(count);
+    uint64_t lastId = 0;
+    for (PMTilesEntry &entry : entries)
+    {
+        lastId += readVarint(data, position);
+        entry.tileId = lastId;
+    }
+    for (PMTilesEntry &entry : entries)
+    {
+        entry.runLength = static_cast<uint32_t>(readVarint(data, position));
+    }
+    for (PMTilesEntry &entry : entries)
+    {
+        entry.length = static_cast<uint32_t>(readVarint(data, position));
+    }
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        // 0 means "directly after the previous entry", anything else is the
+        // offset plus one.
+        uint64_t value = readVarint(data, position);
+        if (value == 0 && i > 0)
+        {
+            entries[i].offset = entries[i - 1].offset + entries[i - 1].length;
+        }
+        else
+        {
+            entries[i].offset = value - 1;
+        }
+    }
+    return entries;
+}
+
+std::string serializePMTilesDirectory(const std::vector<PMTilesEntry> &entries)
+{
+    std::string out;
+    writeVarint(out, entries.size());
+
+    uint64_t lastId = 0;
+    for (const PMTilesEntry &entry : entries)
+    {
+        writeVarint(out, entry.tileId - lastId);
+        lastId = entry.tileId;
+    }
+    for (const PMTilesEntry &entry : entries)
+    {
+        writeVarint(out, entry.runLength);
+    }
+    for (const PMTilesEntry &entry : entries)
+    {
+        writeVarint(out, entry.length);
+    }
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (i > 0 && entries[i].offset == entries[i - 1].offset + entries[i - 1].length)
+        {
+            writeVarint(out, 0);
+        }
+        else
+        {
+            writeVarint(out, entries[i].offset + 1);
+        }
+    }
+    return out;
+}
+
+PMTilesReader::PMTilesReader(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("can't open " + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < pmtilesHeaderSize)
+    {
+        close(fd);
+        throw std::runtime_error(path + " is too small to be a PMTiles archive");
+    }
+
+    mappingSize = static_cast<size_t>(info.st_size);
+    void *memory = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED)
+    {
+        throw std::runtime_error("can't map " + path);
+    }
+    mapping = static_cast<const uint8_t *>(memory);
+
+    // Tiles are requested all over the archive.
+    madvise(memory, mappingSize, MADV_RANDOM);
+
+    try
+    {
+        header_ = parsePMTilesHeader(mapping);
+        if (header_.internalCompression != PMTilesCompression::None && header_.internalCompression != PMTilesCompression::Gzip)
+        {
+            throw std::runtime_error("only uncompressed or gzip compressed PMTiles directories are supported");
+        }
+        rootDirectory = parsePMTilesDirectory(section(header_.rootDirectoryOffset, header_.rootDirectoryLength));
+    }
+    catch (const std::exception &e)
+    {
+        munmap(memory, mappingSize);
+        throw std::runtime_error(path + ": " + e.what());
+    }
+}
+
+PMTilesReader::~PMTilesReader()
+{
+    munmap(const_cast<uint8_t *>(mapping), mappingSize);
+}
+
+std::string PMTilesReader::section(uint64_t offset, uint64_t length) const
+{
+    if (offset > mappingSize || length > mappingSize - offset)
+    {
+        throw std::runtime_error("PMTiles section out of bounds");
+    }
+
+    const char *start = reinterpret_cast<const char *>(mapping + offset);
+    if (header_.internalCompression == PMTilesCompression::Gzip)
+    {
+        return gunzip(start, length);
+    }
+    return std::string(start, length);
+}
+
+const std::vector<PMTilesEntry> &PMTilesReader::leafDirectory(uint64_t offset, uint32_t length)
+{
+    auto cached = leafIndex.find(offset);
+    if (cached != leafIndex.end())
+    {
+        leaves.splice(leaves.begin(), leaves, cached->second);
+        return cached->second->second;
+    }
+
+    leaves.emplace_front(offset, parsePMTilesDirectory(section(header_.leafDirectoriesOffset + offset, length)));
+    leafIndex[offset] = leaves.begin();
+    if (leaves.size() > leafCacheSize)
+    {
+        leafIndex.erase(leaves.back().first);
+        leaves.pop_back();
+    }
+    return leaves.front().second;
+}
+
+bool PMTilesReader::readTile(int zoom, int x, int y, std::string &data)
+{
+    uint64_t tileId = pmtilesTileId(zoom, x, y);
+    const std::vector<PMTilesEntry> *directory = &rootDirectory;
+
+    // The spec limits the depth to the root plus three leaf levels.
+    for (int depth = 0; depth < 4; depth++)
+    {
+        const PMTilesEntry *entry = findEntry(*directory, tileId);
+        if (!entry)
+        {
+            return false;
+        }
+
+        if (entry->runLength == 0)
+        {
+            directory = &leafDirectory(entry->offset, entry->length);
+            continue;
+        }
+
+        if (tileId >= entry->tileId + entry->runLength)
+        {
+            return false;
+        }
+
+        uint64_t offset = header_.tileDataOffset + entry->offset;
+        if (offset > mappingSize || entry->length > mappingSize - offset)
+        {
+            throw std::runtime_error("PMTiles tile out of bounds");
+        }
+        data.assign(reinterpret_cast<const char *>(mapping + offset), entry->length);
+        return true;
+    }
+    return false;
+}
+
+std::string PMTilesReader::metadata() const
+{
+    return section(header_.metadataOffset, header_.metadataLength);
+}
+
+bool PMTilesReader::nextTile(uint64_t &tileId, const uint8_t *&data, size_t &size)
+{
+    if (scanFinished)
+    {
+        return false;
+    }
+    if (scan.empty())
+    {
+        scan.push_back({rootDirectory});
+    }
+
+    while (!scan.empty())
+    {
+        ScanLevel &level = scan.back();
+        if (level.index == level.entries.size())
+        {
+            scan.pop_back();
+            continue;
+        }
+
+        PMTilesEntry entry = level.entries[level.index];
+        if (entry.runLength == 0)
+        {
+            level.index++;
+            if (scan.size() == 4)
+            {
+                throw std::runtime_error("PMTiles directories nested too deep");
+            }
+            // Leaves are read once each, so they bypass the cache of readTile().
+            scan.push_back({parsePMTilesDirectory(section(header_.leafDirectoriesOffset + entry.offset, entry.length))});
+            continue;
+        }
+
+        if (level.run == entry.runLength)
+        {
+            level.index++;
+            level.run = 0;
+            continue;
+        }
+
+        uint64_t offset = header_.tileDataOffset + entry.offset;
+        if (offset > mappingSize || entry.length > mappingSize - offset)
+        {
+            throw std::runtime_error("PMTiles tile out of bounds");
+        }
+        tileId = entry.tileId + level.run++;
+        data = mapping + offset;
+        size = entry.length;
+        return true;
+    }
+
+    scanFinished = true;
+    return false;
+}
+
+namespace
+{
+
+    // Splits the entries into gzip compressed leaf directories of
+    // `leafSize` entries and returns the root directory pointing at them.
+    std::string buildLeaves(const std::vector<PMTilesEntry> &entries, size_t leafSize, std::string &leaves)
+    {
+        std::vector<PMTilesEntry> root;
+        leaves.clear();
+        for (size_t start = 0; start < entries.size(); start += leafSize)
+        {
+            std::vector<PMTilesEntry> leaf(entries.begin() + start, entries.begin() + std::min(entries.size(), start + leafSize));
+            std::string compressed = gzip(serializePMTilesDirectory(leaf));
+            root.push_back({leaf.front().tileId, leaves.size(), static_cast<uint32_t>(compressed.size()), 0});
+            leaves += compressed;
+        }
+        return gzip(serializePMTilesDirectory(root));
+    }
+
+    int32_t toE7(double degrees)
+    {
+        return static_cast<int32_t>(std::lround(degrees * 1e7));
+    }
+
+    double tileLongitude(int x, int zoom)
+    {
+        return x / std::ldexp(1.0, zoom) * 360.0 - 180.0;
+    }
+
+    double tileLatitude(int y, int zoom)
+    {
+        double n = M_PI * (1.0 - 2.0 * y / std::ldexp(1.0, zoom));
+        return std::atan(std::sinh(n)) * 180.0 / M_PI;
+    }
+
+} // namespace
+
+PMTilesWriter::PMTilesWriter(const std::string &path, PMTilesTileType tileType)
+    : path(path), temporaryPath(path + ".tiles.tmp"), tileType(tileType)
+{
+    data = std::fopen(temporaryPath.c_str(), "w+b");
+    if (!data)
+    {
+        throw std::runtime_error("can't create " + temporaryPath);
+    }
+}
+
+PMTilesWriter::~PMTilesWriter()
+{
+    if (data)
+    {
+        std::fclose(data);
+        std::remove(temporaryPath.c_str());
+    }
+}
+
+void PMTilesWriter::insertTile(int zoom, int x, int tmsY, const void *tile, size_t size)
+{
+    auto start = std::chrono::steady_clock::now();
+    int y = (1 << zoom) - 1 - tmsY;
+
+    auto inserted = contents.emplace(tileContentHash(tile, size), dataSize);
+    if (inserted.second)
+    {
+        if (std::fwrite(tile, 1, size, data) != size)
+        {
+            throw std::runtime_error("failed to write " + temporaryPath);
+        }
+        dataSize += size;
+    }
+    tiles.push_back({pmtilesTileId(zoom, x, y), inserted.first->second, static_cast<uint32_t>(size)});
+    bytes += size;
+
+    if (zoom > maxZoom)
+    {
+        maxZoom = zoom;
+        minX = maxX = x;
+        minY = maxY = y;
+    }
+    else if (zoom == maxZoom)
+    {
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+    }
+    minZoom = std::min(minZoom, zoom);
+
+    insertTime += std::chrono::steady_clock::now() - start;
+}
+
+bool PMTilesWriter::readTile(int zoom, int x, int tmsY, std::string &tile)
+{
+    // Reads come after the workers are done, so one sort covers nearly all
+    // of them. Tiles inserted since are searched one by one.
+    if (sortedTiles == 0)
+    {
+        std::stable_sort(tiles.begin(), tiles.end(), [](const StoredTile &a, const StoredTile &b)
+                         { return a.tileId < b.tileId; });
+        sortedTiles = tiles.size();
+    }
+
+    uint64_t tileId = pmtilesTileId(zoom, x, (1 << zoom) - 1 - tmsY);
+    for (size_t i = tiles.size(); i > sortedTiles; i--)
+    {
+        if (tiles[i - 1].tileId == tileId)
+        {
+            tile = readStored(tiles[i - 1].offset, tiles[i - 1].length);
+            return true;
+        }
+    }
+
+    auto end = tiles.begin() + sortedTiles;
+    auto next = std::upper_bound(tiles.begin(), end, tileId, [](uint64_t id, const StoredTile &stored)
+                                 { return id < stored.tileId; });
+    if (next == tiles.begin() || (next - 1)->tileId != tileId)
+    {
+        return false;
+    }
+    tile = readStored((next - 1)->offset, (next - 1)->length);
+    return true;
+}
+
+std::string PMTilesWriter::readStored(uint64_t offset, uint32_t length)
+{
+    commit();
+    std::string tile(length, '\0');
+    if (pread(fileno(data), tile.data(), length, static_cast<off_t>(offset)) != static_cast<ssize_t>(length))
+    {
+        throw std::runtime_error("failed to read " + temporaryPath);
+    }
+    return tile;
+}
+
+void PMTilesWriter::commit()
+{
+    if (std::fflush(data) != 0)
+    {
+        throw std::runtime_error("failed to write " + temporaryPath);
+    }
+}
+
+void PMTilesWriter::finish()
+{
+    auto start = std::chrono::steady_clock::now();
+    commit();
+
+    // Tile id order; of a tile inserted twice the last one wins. Deduplicated
+    // in place, a copy would double the largest allocation.
+    std::stable_sort(tiles.begin(), tiles.end(), [](const StoredTile &a, const StoredTile &b)
+                     { return a.tileId < b.tileId; });
+    size_t unique = 0;
+    for (const StoredTile &tile : tiles)
+    {
+        if (unique > 0 && tiles[unique - 1].tileId == tile.tileId)
+        {
+            tiles[unique - 1] = tile;
+        }
+        else
+        {
+            tiles[unique++] = tile;
+        }
+    }
+    tiles.resize(unique);
+
+    // Lay the contents out in the order they are first used, and merge runs
+    // of consecutive tiles with the same content into one entry.
+    std::unordered_map<uint64_t, uint64_t> archiveOffsets; // temporary file offset to tile data offset
+    std::vector<PMTilesEntry> entries;
+    uint64_t tileDataLength = 0;
+    for (const StoredTile &tile : tiles)
+    {
+        auto placed = archiveOffsets.emplace(tile.offset, tileDataLength);
+        if (placed.second)
+        {
+            tileDataLength += tile.length;
+        }
+        uint64_t offset = placed.first->second;
+
+        if (!entries.empty())
+        {
+            PMTilesEntry &last = entries.back();
+            if (last.offset == offset && last.tileId + last.runLength == tile.tileId)
+            {
+                last.runLength++;
+                continue;
+            }
+        }
+        entries.push_back({tile.tileId, offset, tile.length, 1});
+    }
+
+    std::string leaves;
+    std::string root = gzip(serializePMTilesDirectory(entries));
+    for (size_t leafSize = 4096; root.size() > maxRootSize; leafSize += leafSize / 2)
+    {
+        root = buildLeaves(entries, leafSize, leaves);
+    }
+    std::string metadata = gzip(metadataJSON());
+
+    PMTilesHeader header{};
+    header.rootDirectoryOffset = pmtilesHeaderSize;
+    header.rootDirectoryLength = root.size();
+    header.metadataOffset = header.rootDirectoryOffset + root.size();
+    header.metadataLength = metadata.size();
+    header.leafDirectoriesOffset = header.metadataOffset + metadata.size();
+    header.leafDirectoriesLength = leaves.size();
+    header.tileDataOffset = header.leafDirectoriesOffset + leaves.size();
+    header.tileDataLength = tileDataLength;
+    header.addressedTiles = tiles.size();
+    header.tileEntries = entries.size();
+    header.tileContents = archiveOffsets.size();
+    header.clustered = true;
+    header.internalCompression = PMTilesCompression::Gzip;
+    header.tileCompression = PMTilesCompression::None;
+    header.tileType = tileType;
+    if (maxZoom >= 0)
+    {
+        header.minZoom = static_cast<uint8_t>(minZoom);
+        header.maxZoom = static_cast<uint8_t>(maxZoom);
+        header.minLonE7 = toE7(tileLongitude(minX, maxZoom));
+        header.maxLonE7 = toE7(tileLongitude(maxX + 1, maxZoom));
+        header.minLatE7 = toE7(tileLatitude(maxY + 1, maxZoom));
+        header.maxLatE7 = toE7(tileLatitude(minY, maxZoom));
+    }
+    header.centerZoom = header.minZoom;
+    header.centerLonE7 = static_cast<int32_t>((int64_t(header.minLonE7) + header.maxLonE7) / 2);
+    header.centerLatE7 = static_cast<int32_t>((int64_t(header.minLatE7) + header.maxLatE7) / 2);
+
+    // Written next to the archive and renamed once complete, so a failure
+    // never leaves a finished-looking partial archive behind.
+    std::string partialPath = path + ".partial";
+    FILE *archive = std::fopen(partialPath.c_str(), "wb");
+    if (!archive)
+    {
+        throw std::runtime_error("can't create " + partialPath);
+    }
+    auto write = [&](const std::string &bytes)
+    {
+        if (std::fwrite(bytes.data(), 1, bytes.size(), archive) != bytes.size())
+        {
+            throw std::runtime_error("failed to write " + path);
+        }
+    };
+    try
+    {
+        write(serializePMTilesHeader(header));
+        write(root);
+        write(metadata);
+        write(leaves);
+
+        // Each content goes out the first time a tile in id order uses it,
+        // which is the order its offset was assigned in above.
+        uint64_t written = 0;
+        for (const StoredTile &tile : tiles)
+        {
+            if (archiveOffsets.at(tile.offset) == written)
+            {
+                write(readStored(tile.offset, tile.length));
+                written += tile.length;
+            }
+        }
+    }
+    catch (const std::exception &)
+    {
+        std::fclose(archive);
+        std::remove(partialPath.c_str());
+        throw;
+    }
+
+    if (std::fclose(archive) != 0 || std::rename(partialPath.c_str(), path.c_str()) != 0)
+    {
+        std::remove(partialPath.c_str());
+        throw std::runtime_error("failed to write " + path);
+    }
+    std::fclose(data);
+    data = nullptr;
+    std::remove(temporaryPath.c_str());
+    insertTime += std::chrono::steady_clock::now() - start;
+}
+
+std::string PMTilesWriter::metadataJSON() const
+{
+    std::string format;
+    switch (tileType)
+    {
+    case PMTilesTileType::PNG:
+        format = "png";
+        break;
+    case PMTilesTileType::JPEG:
+        format = "jpg";
+        break;
+    case PMTilesTileType::WEBP:
+        format = "webp";
+        break;
+    default:
+        break;
+    }
+    return "{\"name\":\"raster\",\"type\":\"baselayer\",\"version\":\"1.0\","
+           "\"description\":\"rendered vector tiles to " + format + "\",\"format\":\"" + format + "\"}";
+}
@@ -0,0 +1,214 @@
+#ifndef PMTILES_HPP
+#define PMTILES_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tile_hash.hpp"
+#include "tile_sink.hpp"
+
+// PMTiles v3, https://github.com/protomaps/PMTiles/blob/main/spec/v3/spec.md
+
+enum class PMTilesCompression : uint8_t
+{
+    Unknown = 0,
+    None = 1,
+    Gzip = 2,
+    Brotli = 3,
+    Zstd = 4,
+};
+
+enum class PMTilesTileType : uint8_t
+{
+    Unknown = 0,
+    MVT = 1,
+    PNG = 2,
+    JPEG = 3,
+    WEBP = 4,
+    AVIF = 5,
+};
+
+struct PMTilesHeader
+{
+    uint64_t rootDirectoryOffset;
+    uint64_t rootDirectoryLength;
+    uint64_t metadataOffset;
+    uint64_t metadataLength;
+    uint64_t leafDirectoriesOffset;
+    uint64_t leafDirectoriesLength;
+    uint64_t tileDataOffset;
+    uint64_t tileDataLength;
+    uint64_t addressedTiles;
+    uint64_t tileEntries;
+    uint64_t tileContents;
+    bool clustered;
+    PMTilesCompression internalCompression;
+    PMTilesCompression tileCompression;
+    PMTilesTileType tileType;
+    uint8_t minZoom;
+    uint8_t maxZoom;
+    int32_t minLonE7;
+    int32_t minLatE7;
+    int32_t maxLonE7;
+    int32_t maxLatE7;
+    uint8_t centerZoom;
+    int32_t centerLonE7;
+    int32_t centerLatE7;
+};
+
+constexpr size_t pmtilesHeaderSize = 127;
+
+// A directory entry. A run length of 0 points at a leaf directory instead of
+// tile data.
+struct PMTilesEntry
+{
+    uint64_t tileId;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t runLength;
+};
+
+// Position of a tile on the Hilbert curve of its zoom level, counted across
+// all lower zoom levels.
+uint64_t pmtilesTileId(int zoom, int x, int y);
+
+// The tile at a position on the curve, the inverse of pmtilesTileId().
+void pmtilesTileCoordinates(uint64_t tileId, int &zoom, int &x, int &y);
+
+PMTilesHeader parsePMTilesHeader(const uint8_t *data);
+
+// The pmtilesHeaderSize bytes of the header.
+std::string serializePMTilesHeader(const PMTilesHeader &header);
+
+// Decodes an uncompressed directory.
+std::vector<PMTilesEntry> parsePMTilesDirectory(const std::string &data);
+
+// Encodes a directory, uncompressed. Entries have to be sorted by tile id.
+std::string serializePMTilesDirectory(const std::vector<PMTilesEntry> &entries);
+
+// Read-only access to a memory-mapped PMTiles archive. Throws
+// std::runtime_error if the file can't be mapped or is not PMTiles v3.
+class PMTilesReader
+{
+public:
+    explicit PMTilesReader(const std::string &path);
+    ~PMTilesReader();
+
+    PMTilesReader(const PMTilesReader &) = delete;
+    PMTilesReader &operator=(const PMTilesReader &) = delete;
+
+    const PMTilesHeader &header() const { return header_; }
+
+    // Stores the tile as it is in the archive, still compressed with
+    // header().tileCompression. Returns false if the archive has no such tile.
+    bool readTile(int zoom, int x, int y, std::string &data);
+
+    // The JSON metadata, decompressed.
+    std::string metadata() const;
+
+    // Steps through every tile in tile id order; each tile of a run-length
+    // entry is returned on its own, pointing at the same data. The data is
+    // part of the mapping and stays valid as long as the reader. Returns
+    // false after the last tile.
+    bool nextTile(uint64_t &tileId, const uint8_t *&data, size_t &size);
+
+private:
+    // A directory being stepped through by nextTile().
+    struct ScanLevel
+    {
+        std::vector<PMTilesEntry> entries;
+        size_t index = 0;
+        uint32_t run = 0; // tiles of entries[index] already returned
+    };
+
+    std::string section(uint64_t offset, uint64_t length) const;
+    const std::vector<PMTilesEntry> &leafDirectory(uint64_t offset, uint32_t length);
+
+    static constexpr size_t leafCacheSize = 64;
+
+    const uint8_t *mapping = nullptr;
+    size_t mappingSize = 0;
+    PMTilesHeader header_;
+    std::vector<PMTilesEntry> rootDirectory;
+
+    // Recently used leaf directories, most recent first.
+    std::list<std::pair<uint64_t, std::vector<PMTilesEntry>>> leaves;
+    std::unordered_map<uint64_t, decltype(leaves)::iterator> leafIndex;
+
+    std::vector<ScanLevel> scan; // root first, empty before the first nextTile()
+    bool scanFinished = false;
+};
+
+// Writes a clustered PMTiles v3 archive. Tiles are appended to a temporary
+// file next to the archive as they arrive, identical tiles only once.
+// finish() then writes gzip compressed directories with run-length entries
+// for repeated tiles, followed by the tile data copied over in tile id order,
+// into `<path>.partial`, which is renamed to the path once complete. A writer
+// destroyed without finish() removes its temporary file and leaves no archive.
+// While finishing, the temporary file and the archive each take about the
+// size of the deduplicated tile data. The whole index is held in memory: 24
+// bytes per tile and about 64 per distinct tile while rendering, and up to
+// about twice that while finishing. That is tens of GB for a z14 planet and
+// over 100 GB for z16, which are better written to MBTiles.
+// Throws std::runtime_error on I/O errors.
+class PMTilesWriter : public TileSink
+{
+public:
+    PMTilesWriter(const std::string &path, PMTilesTileType tileType);
+    ~PMTilesWriter() override;
+
+    PMTilesWriter(const PMTilesWriter &) = delete;
+    PMTilesWriter &operator=(const PMTilesWriter &) = delete;
+
+    void insertTile(int zoom, int x, int tmsY, const void *data, size_t size) override;
+    void markChunkDone(uint64_t) override {}
+    bool readTile(int zoom, int x, int tmsY, std::string &data) override;
+    void commit() override;
+    void finish() override;
+
+    size_t tileCount() const override { return tiles.size(); }
+    size_t imageCount() const override { return contents.size(); }
+
+    double insertSeconds() const override { return std::chrono::duration<double>(insertTime).count(); }
+    uint64_t byteCount() const override { return bytes; }
+
+private:
+    // A tile and where its data is in the temporary file.
+    struct StoredTile
+    {
+        uint64_t tileId;
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    std::string readStored(uint64_t offset, uint32_t length);
+    std::string metadataJSON() const;
+
+    // Root directories have to fit into the first 16 KiB with the header.
+    static constexpr size_t maxRootSize = 16384 - pmtilesHeaderSize;
+
+    std::string path;
+    std::string temporaryPath;
+    PMTilesTileType tileType;
+    FILE *data = nullptr;
+    uint64_t dataSize = 0;
+
+    std::vector<StoredTile> tiles;
+    size_t sortedTiles = 0; // tiles[0, sortedTiles) are sorted for readTile()
+    std::unordered_map<TileHash, uint64_t, TileHashHasher> contents; // content hash to its offset in the temporary file
+
+    int minZoom = 255;
+    int maxZoom = -1;
+    int minX = 0, minY = 0, maxX = 0, maxY = 0; // extent at maxZoom, XYZ rows
+
+    uint64_t bytes = 0;
+    std::chrono::steady_clock::duration insertTime{};
+};
+
+#endif // PMTILES_HPP
@@ -0,0 +1,123 @@
+#include "pyramid.hpp"
+
+#include <iostream>
+#include <optional>
+
+#include "pixel_ops.hpp"
+
+using namespace mbgl;
+
+PremultipliedImage downsampleChildren(const std::array<const PremultipliedImage *, 4> &children, uint32_t side)
+{
+    PremultipliedImage image({side, side});
+    const uint32_t half = side / 2;
+
+    for (int i = 0; i < 4; i++)
+    {
+        const PremultipliedImage *child = children[i];
+        if (!child || !child->valid() || child->size != image.size)
+        {
+            continue;
+        }
+
+        uint8_t *quadrant = image.data.get() + (i / 2) * half * image.stride() + (i % 2) * half * 4;
+        downsample2x2(child->data.get(), child->stride(), child->size.width, child->size.height,
+                      quadrant, image.stride());
+    }
+    return image;
+}
+
+PremultipliedImage downsampleImage(const PremultipliedImage &image, uint32_t side)
+{
+    PremultipliedImage result = image.clone();
+    while (result.size.width > side)
+    {
+        PremultipliedImage half({result.size.width / 2, result.size.height / 2});
+        downsample2x2(result.data.get(), result.stride(), result.size.width, result.size.height,
+                      half.data.get(), half.stride());
+        result = std::move(half);
+    }
+    return result;
+}
+
+namespace
+{
+
+    class PyramidTopBuilder
+    {
+    public:
+        PyramidTopBuilder(TileSink &output, uint32_t side, ImageFormat format, const RenderOptions &options)
+            : options(options),
+              side(side),
+              rootZoom(pyramidZoom(options)),
+              output(output),
+              encoder(format)
+        {
+        }
+
+        // Returns the tile, building and storing it first if it lies below the
+        // zoom the workers stopped at.
+        std::optional<PremultipliedImage> build(int zoom, int x, int y)
+        {
+            if (!options.area.contains(zoom, x, y))
+            {
+                return std::nullopt;
+            }
+
+            if (zoom == rootZoom)
+            {
+                std::string data;
+                if (!output.readTile(zoom, x, (1 << zoom) - 1 - y, data))
+                {
+                    std::cerr << "Warning: tile " << zoom << "/" << x << "/" << y << " is missing, its parents will be transparent there" << std::endl;
+                    return std::nullopt;
+                }
+                return decodeImage(data);
+            }
+
+            std::array<std::optional<PremultipliedImage>, 4> children;
+            std::array<const PremultipliedImage *, 4> pointers{};
+            for (int i = 0; i < 4; i++)
+            {
+                children[i] = build(zoom + 1, 2 * x + i % 2, 2 * y + i / 2);
+                pointers[i] = children[i] ? &*children[i] : nullptr;
+            }
+
+            PremultipliedImage image = downsampleChildren(pointers, side);
+            std::string_view encoded = encoder.encode(image, options.encoderProfile.at(zoom));
+            output.insertTile(zoom, x, (1 << zoom) - 1 - y, encoded.data(), encoded.size());
+            built++;
+            return image;
+        }
+
+        size_t tileCount() const { return built; }
+
+    private:
+        const RenderOptions &options;
+        uint32_t side;
+        int rootZoom;
+        TileSink &output;
+        TileEncoder encoder;
+        size_t built = 0;
+    };
+
+} // namespace
+
+void buildPyramidTop(TileSink &output, uint32_t side, ImageFormat format, const RenderOptions &options)
+{
+    if (pyramidZoom(options) == 0)
+    {
+        return;
+    }
+
+    try
+    {
+        PyramidTopBuilder builder(output, side, format, options);
+        builder.build(0, 0, 0);
+        std::cout << "Built " << builder.tileCount() << " tiles below zoom " << pyramidZoom(options) << " from stored tiles." << std::endl;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Failed to build the lowest zoom levels: " << e.what() << std::endl;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef PYRAMID_HPP
+#define PYRAMID_HPP
+
+#include <array>
+#include <string>
+#include <mbgl/util/image.hpp>
+
+#include "renderer.hpp"
+#include "tile_sink.hpp"
+
+// Builds a side x side tile from its four side x side children, ordered
+// north-west, north-east, south-west, south-east. Children that are not
+// valid() are transparent.
+mbgl::PremultipliedImage downsampleChildren(const std::array<const mbgl::PremultipliedImage *, 4> &children, uint32_t side);
+
+// Halves `image` until it is side x side. `side` must be the image side
+// divided by a power of two.
+mbgl::PremultipliedImage downsampleImage(const mbgl::PremultipliedImage &image, uint32_t side);
+
+// Builds every zoom below pyramidZoom(options) from the pyramidZoom tiles the
+// workers already stored in the output of the given tile size and format.
+// Runs in the writer once all workers are done, so it only decodes a few
+// hundred tiles.
+void buildPyramidTop(TileSink &output, uint32_t side, ImageFormat format, const RenderOptions &options);
+
+#endif // PYRAMID_HPP
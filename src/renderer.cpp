@@ -0,0 +1,622 @@
+#include "renderer.hpp"
+
+#include <mbgl/map/map.hpp>
+#include <mbgl/map/map_options.hpp>
+#include <mbgl/util/image.hpp>
+#include <mbgl/util/run_loop.hpp>
+#include <mbgl/gfx/headless_frontend.hpp>
+#include <mbgl/style/style.hpp>
+#include <mbgl/style/layer.hpp>
+#include <mbgl/storage/file_source_manager.hpp>
+#include <mbgl/storage/online_file_source.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <optional>
+#include <unordered_map>
+
+#include "archive_file_source.hpp"
+#include "coordinates.hpp"
+#include "encoder_pool.hpp"
+#include "pixel_ops.hpp"
+#include "pyramid.hpp"
+#include "resource_cache.hpp"
+#include "tile_stream.hpp"
+
+using namespace mbgl;
+
+// Zoom of the single frame a metatile of the given zoom covers.
+static int blockZoom(const RenderOptions &options, int zoom)
+{
+    int span = std::min(options.metatile, 1 << zoom);
+    return zoom - __builtin_ctz(span);
+}
+
+int pyramidZoom(const RenderOptions &options)
+{
+    // Each zoom below this is a single decode-and-downsample pass in the
+    // writer, so keep the number of tiles it has to read small.
+    constexpr int maxWriterZoom = 5;
+    return std::min(maxWriterZoom, blockZoom(options, options.renderFromZoom));
+}
+
+double renderPixelRatio(const RenderOptions &options)
+{
+    return static_cast<double>(options.tileSizes.front()) / tileSize;
+}
+
+size_t outputCount(const RenderOptions &options)
+{
+    return options.tileSizes.size() * options.imageFormats.size();
+}
+
+uint32_t outputTileSize(const RenderOptions &options, size_t output)
+{
+    return options.tileSizes[output / options.imageFormats.size()];
+}
+
+ImageFormat outputFormat(const RenderOptions &options, size_t output)
+{
+    return options.imageFormats[output % options.imageFormats.size()];
+}
+
+std::vector<ScheduleLevel> scheduleLevels(const RenderOptions &options)
+{
+    bool pruning = options.pruneZoom >= 0 && options.pruneZoom < options.maxZoom;
+    int lastZoom = pruning ? options.pruneZoom : options.maxZoom;
+    bool pyramid = options.renderFromZoom > 0;
+
+    std::vector<ScheduleLevel> levels;
+    for (int zoom = pyramid ? pyramidZoom(options) : 0; zoom <= lastZoom; zoom++)
+    {
+        if (pyramid && zoom > pyramidZoom(options) && zoom <= options.renderFromZoom)
+        {
+            continue;
+        }
+
+        int span = std::min(options.metatile, 1 << zoom);
+        int chunkSide = std::min(pruning && zoom == lastZoom ? span : std::max(options.chunkSize, span), 1 << zoom);
+        if (pyramid && zoom == pyramidZoom(options))
+        {
+            chunkSide = 1;
+        }
+
+        TileRange bounds = options.area.bounds(zoom);
+        TileRange area{0, 0, 0, 0};
+        if (!bounds.empty())
+        {
+            area.x0 = bounds.x0 / chunkSide * chunkSide;
+            area.y0 = bounds.y0 / chunkSide * chunkSide;
+            area.x1 = (bounds.x1 + chunkSide - 1) / chunkSide * chunkSide;
+            area.y1 = (bounds.y1 + chunkSide - 1) / chunkSide * chunkSide;
+        }
+        levels.push_back({zoom, chunkSide, area});
+    }
+    return levels;
+}
+
+// mbgl asks its Mbtiles and Pmtiles file sources before the network one.
+// Local mbtiles:// and pmtiles://file:// archives are read in-process by
+// ArchiveFileSource registered as both; remote PMTiles go on to mbgl's own
+// PMTiles source. Everything else goes to the network, through the shared
+// cache if one is configured. All three chains keep their recently used
+// source tiles in the same memory cache and count their tile requests.
+void registerFileSources(const RenderOptions &options, bool threaded)
+{
+    // Taken once, so registering again wraps mbgl's source and not our own.
+    static FileSourceManager::FileSourceFactory builtinPMTiles =
+        FileSourceManager::get()->unRegisterFileSourceFactory(FileSourceType::Pmtiles);
+    // Counts requests of Maps that are not a worker's.
+    static WorkerStats unowned;
+    auto statsOf = [](const ResourceOptions &resourceOptions) -> WorkerStats &
+    {
+        void *context = resourceOptions.platformContext();
+        return context ? *static_cast<WorkerStats *>(context) : unowned;
+    };
+
+    // mbgl builds a chain of file sources for every distinct ResourceOptions.
+    // Each TileRenderer passes its WorkerStats as the platform context, so
+    // every render thread has its own chain counting into its own stats and
+    // reading the archives through its own readers, while the in-memory
+    // stores are shared by all chains of the process.
+    std::string cacheDirectory = options.cacheDirectory;
+    size_t sourceCacheBytes = static_cast<size_t>(options.sourceCacheMegabytes) << 20;
+    auto sharedResources = threaded ? std::make_shared<SharedResourceFileSource::Responses>() : nullptr;
+    auto sourceTiles = sourceCacheBytes > 0 ? std::make_shared<SourceTileFileSource::Cache>(sourceCacheBytes) : nullptr;
+    FileSourceManager::get()->registerFileSourceFactory(
+        FileSourceType::Network,
+        [cacheDirectory, sharedResources, sourceTiles, statsOf](const ResourceOptions &resourceOptions, const ClientOptions &clientOptions)
+        {
+            WorkerStats &stats = statsOf(resourceOptions);
+
+            std::unique_ptr<FileSource> source = std::make_unique<OnlineFileSource>(resourceOptions, clientOptions);
+            if (!cacheDirectory.empty())
+            {
+                source = std::make_unique<CachingFileSource>(std::move(source), cacheDirectory, stats);
+            }
+            if (sharedResources)
+            {
+                source = std::make_unique<SharedResourceFileSource>(std::move(source), sharedResources);
+            }
+            return std::make_unique<SourceTileFileSource>(std::move(source), sourceTiles, stats);
+        });
+    FileSourceManager::get()->registerFileSourceFactory(
+        FileSourceType::Mbtiles,
+        [sourceTiles, statsOf](const ResourceOptions &resourceOptions, const ClientOptions &)
+        {
+            return std::make_unique<SourceTileFileSource>(std::make_unique<ArchiveFileSource>(), sourceTiles, statsOf(resourceOptions));
+        });
+    FileSourceManager::get()->registerFileSourceFactory(
+        FileSourceType::Pmtiles,
+        [sourceTiles, statsOf](const ResourceOptions &resourceOptions, const ClientOptions &clientOptions)
+        {
+            auto archives = std::make_unique<ArchiveFileSource>(builtinPMTiles ? builtinPMTiles(resourceOptions, clientOptions) : nullptr);
+            return std::make_unique<SourceTileFileSource>(std::move(archives), sourceTiles, statsOf(resourceOptions));
+        });
+}
+
+namespace
+{
+
+    // Colour of every tile in a rendered block, row by row. Empty for tiles
+    // that are not a single uniform colour.
+    using BlockColors = std::vector<std::optional<uint32_t>>;
+
+    // Colours of a rendered block, for checking its children against.
+    struct ParentBlock
+    {
+        const BlockColors *colors = nullptr;
+        int x0 = 0;
+        int y0 = 0;
+        int span = 0;
+    };
+
+} // namespace
+
+// Renders and encodes the tiles of one worker and hands them to a sink.
+class TileRenderer
+{
+public:
+    TileRenderer(const RenderOptions &options, WorkerStats &stats, EncoderPool::Sink sink)
+        : options(options),
+          stats(stats),
+          pixelRatio(renderPixelRatio(options)),
+          frontend(frameSize(1), static_cast<float>(pixelRatio)),
+          map(frontend,
+              MapObserver::nullObserver(),
+              MapOptions()
+                  .withMapMode(MapMode::Tile)
+                  .withConstrainMode(ConstrainMode::None)
+                  .withSize(frontend.getSize())
+                  .withPixelRatio(static_cast<float>(pixelRatio)),
+              ResourceOptions()
+                  .withPlatformContext(&stats)
+                  .withCachePath("")
+                  .withMaximumCacheSize(0)
+                  .withAssetPath("")
+                  .withApiKey("")),
+          encoders(options.encoderThreads, options.queueDepth, options.imageFormats, options.encoderProfile, stats.stages,
+                   std::move(sink)),
+          uniformTiles(outputCount(options))
+    {
+        map.getStyle().loadURL(options.styleUrl);
+    }
+
+    void renderChunk(const TileChunk &chunk)
+    {
+        if (options.renderFromZoom > 0 && chunk.zoom == pyramidZoom(options))
+        {
+            for (int y = chunk.y0; y < chunk.y1; y++)
+            {
+                for (int x = chunk.x0; x < chunk.x1; x++)
+                {
+                    buildPyramid(chunk.zoom, x, y);
+                }
+            }
+            return;
+        }
+
+        int span = std::min(options.metatile, 1 << chunk.zoom);
+        bool subtree = chunk.zoom == options.pruneZoom && chunk.zoom < options.maxZoom;
+
+        // Chunk and metatile sides are powers of two, and so is their ratio.
+        uint32_t blocks = static_cast<uint32_t>((chunk.x1 - chunk.x0) / span);
+        for (uint64_t d = 0; d < uint64_t(blocks) * blocks; d++)
+        {
+            uint32_t bx, by;
+            orderPosition(options.order, blocks, d, bx, by);
+            int x0 = chunk.x0 + static_cast<int>(bx) * span;
+            int y0 = chunk.y0 + static_cast<int>(by) * span;
+            if (!options.area.intersects(chunk.zoom, {x0, y0, x0 + span, y0 + span}))
+            {
+                continue;
+            }
+
+            if (subtree)
+            {
+                renderSubtree(chunk.zoom, x0, y0, span);
+            }
+            else
+            {
+                renderBlock(chunk.zoom, x0, y0, span);
+            }
+        }
+    }
+
+    // Calls `reached` once every tile rendered so far has reached the
+    // sink.
+    void checkpoint(std::function<void()> reached)
+    {
+        encoders.checkpoint(std::move(reached));
+    }
+
+    // Renders the metatile holding the tile and waits until all of its
+    // tiles have reached the sink.
+    void renderBlockAt(int zoom, int x, int y)
+    {
+        int span = std::min(options.metatile, 1 << zoom);
+        renderBlock(zoom, x / span * span, y / span * span, span);
+
+        std::promise<void> done;
+        encoders.checkpoint([&done]
+                            { done.set_value(); });
+        done.get_future().wait();
+    }
+
+    void finish()
+    {
+        encoders.finish();
+    }
+
+private:
+    Size frameSize(int span) const
+    {
+        uint32_t side = span * tileSize + 2 * options.buffer;
+        return {side, side};
+    }
+
+    // Renders the span x span block whose north-west tile is (x0, y0) in a
+    // single frame and emits every tile of it that lies in the area. With
+    // `images`, a copy of every emitted tile is kept there, row by row.
+    BlockColors renderBlock(int zoom, int x0, int y0, int span, std::vector<PremultipliedImage> *images = nullptr)
+    {
+        if (span != currentSpan)
+        {
+            currentSpan = span;
+            frontend.setSize(frameSize(span));
+            map.setSize(frontend.getSize());
+        }
+
+        LatLng center = calculateNormalizedCenterCoords(x0, y0, zoom, span);
+
+        {
+            StageTimer timer(stats.stages, Stage::JumpTo, zoom);
+            map.jumpTo(CameraOptions()
+                           .withCenter(center)
+                           .withZoom(zoom));
+        }
+
+        PremultipliedImage frame;
+        {
+            StageTimer timer(stats.stages, Stage::Render, zoom);
+            frame = frontend.render(map).image;
+        }
+
+        const uint32_t tilePixels = renderedTileSide();
+        const uint32_t bufferPixels = static_cast<uint32_t>(options.buffer * pixelRatio);
+
+        BlockColors colors(span * span);
+        for (int dy = 0; dy < span; dy++)
+        {
+            for (int dx = 0; dx < span; dx++)
+            {
+                if (!options.area.contains(zoom, x0 + dx, y0 + dy))
+                {
+                    continue;
+                }
+
+                PremultipliedImage image;
+                if (span == 1 && bufferPixels == 0)
+                {
+                    image = std::move(frame);
+                }
+                else
+                {
+                    image = encoders.takeImage({tilePixels, tilePixels});
+                    PremultipliedImage::copy(frame, image,
+                                             {bufferPixels + dx * tilePixels, bufferPixels + dy * tilePixels},
+                                             {0, 0}, image.size);
+                }
+
+                if (images)
+                {
+                    (*images)[dy * span + dx] = image.clone();
+                }
+                colors[dy * span + dx] = emitTile(zoom, x0 + dx, y0 + dy, std::move(image));
+            }
+        }
+        return colors;
+    }
+
+    // Hands the tile to the encoders once per tile size, halving it for each
+    // smaller size, or reuses the encoding of an earlier tile when the
+    // whole tile is a single colour. Returns that colour.
+    std::optional<uint32_t> emitTile(int zoom, int x, int y, PremultipliedImage &&image)
+    {
+        int tmsY = (1 << zoom) - 1 - y;
+        stats.tiles++;
+
+        uint32_t color;
+        if (!isUniform(image.data.get(), image.size.area(), color))
+        {
+            for (size_t size = 0; size < options.tileSizes.size(); size++)
+            {
+                PremultipliedImage next;
+                if (size + 1 < options.tileSizes.size())
+                {
+                    next = downsampleImage(image, options.tileSizes[size + 1]);
+                }
+                encoders.submit({static_cast<int>(size), zoom, x, tmsY, std::move(image)});
+                image = std::move(next);
+            }
+            return std::nullopt;
+        }
+
+        for (size_t output = 0; output < uniformTiles.size(); output++)
+        {
+            encoders.submitEncoded(output, zoom, x, tmsY, uniformTile(output, zoom, color));
+        }
+        stats.uniformTiles++;
+        return color;
+    }
+
+    // Encoding of a tile of the output that is entirely `color`. Halving a
+    // uniform tile keeps its colour, so every output shares the key. Kept
+    // per zoom, since the encoder settings can differ between zooms.
+    const std::string &uniformTile(size_t output, int zoom, uint32_t color)
+    {
+        uint64_t key = static_cast<uint64_t>(zoom) << 32 | color;
+        auto cached = uniformTiles[output].find(key);
+        if (cached == uniformTiles[output].end())
+        {
+            uint32_t side = outputTileSize(options, output);
+            PremultipliedImage image({side, side});
+            for (uint32_t i = 0; i < image.size.area(); i++)
+            {
+                std::memcpy(image.data.get() + i * 4, &color, 4);
+            }
+            cached = uniformTiles[output].emplace(key, encodeImage(image, outputFormat(options, output), options.encoderProfile.at(zoom))).first;
+        }
+        return cached->second;
+    }
+
+    // Renders the renderFromZoom tiles below (zoom, x, y) and builds every
+    // tile from there up to (zoom, x, y) by downsampling, children first.
+    // Only one set of siblings per zoom is held at a time. Returns the
+    // tile, or an invalid image if it lies outside the area.
+    PremultipliedImage buildPyramid(int zoom, int x, int y)
+    {
+        if (!options.area.contains(zoom, x, y))
+        {
+            return {};
+        }
+
+        int leafZoom = blockZoom(options, options.renderFromZoom);
+        if (zoom == leafZoom)
+        {
+            int span = std::min(options.metatile, 1 << options.renderFromZoom);
+            std::vector<PremultipliedImage> images(span * span);
+            renderBlock(options.renderFromZoom, x * span, y * span, span, &images);
+
+            // Reduce the block to its single root tile, level by level.
+            for (int side = span / 2, z = options.renderFromZoom - 1; side >= 1; side /= 2, z--)
+            {
+                std::vector<PremultipliedImage> parents(side * side);
+                for (int py = 0; py < side; py++)
+                {
+                    for (int px = 0; px < side; px++)
+                    {
+                        int tx = x * side + px;
+                        int ty = y * side + py;
+                        if (!options.area.contains(z, tx, ty))
+                        {
+                            continue;
+                        }
+
+                        std::array<const PremultipliedImage *, 4> children;
+                        for (int i = 0; i < 4; i++)
+                        {
+                            children[i] = &images[(2 * py + i / 2) * 2 * side + 2 * px + i % 2];
+                        }
+                        parents[py * side + px] = downsampleChildren(children, renderedTileSide());
+                        emitTile(z, tx, ty, parents[py * side + px].clone());
+                    }
+                }
+                images = std::move(parents);
+            }
+            return std::move(images[0]);
+        }
+
+        std::array<PremultipliedImage, 4> children;
+        std::array<const PremultipliedImage *, 4> pointers;
+        for (int i = 0; i < 4; i++)
+        {
+            children[i] = buildPyramid(zoom + 1, 2 * x + i % 2, 2 * y + i / 2);
+            pointers[i] = &children[i];
+        }
+
+        PremultipliedImage image = downsampleChildren(pointers, renderedTileSide());
+        emitTile(zoom, x, y, image.clone());
+        return image;
+    }
+
+    // Renders the block and then its children. A uniform tile is only copied
+    // down if its parent was uniform in the same colour too: two zooms
+    // agreeing rules out colours that change with the zoom and data that
+    // only shows up one zoom further down, so no subtree is skipped on the
+    // strength of a single rendered tile.
+    void renderSubtree(int zoom, int x0, int y0, int span, ParentBlock parent = {})
+    {
+        BlockColors colors = renderBlock(zoom, x0, y0, span);
+        if (zoom == options.maxZoom)
+        {
+            return;
+        }
+
+        bool prunable = parent.colors && zoom >= options.pruneZoom && zoom >= styleMaxMinZoom();
+        auto confirmedColor = [&](int x, int y) -> std::optional<uint32_t>
+        {
+            const std::optional<uint32_t> &color = colors[(y - y0) * span + (x - x0)];
+            const std::optional<uint32_t> &parentColor = (*parent.colors)[(y / 2 - parent.y0) * parent.span + (x / 2 - parent.x0)];
+            return color == parentColor ? color : std::nullopt;
+        };
+
+        int childZoom = zoom + 1;
+        int childSpan = std::min(options.metatile, 1 << childZoom);
+
+        for (int cy0 = 2 * y0; cy0 < 2 * (y0 + span); cy0 += childSpan)
+        {
+            for (int cx0 = 2 * x0; cx0 < 2 * (x0 + span); cx0 += childSpan)
+            {
+                bool covered = prunable;
+                for (int cy = cy0; covered && cy < cy0 + childSpan; cy += 2)
+                {
+                    for (int cx = cx0; covered && cx < cx0 + childSpan; cx += 2)
+                    {
+                        covered = confirmedColor(cx / 2, cy / 2).has_value();
+                    }
+                }
+
+                if (!options.area.intersects(childZoom, {cx0, cy0, cx0 + childSpan, cy0 + childSpan}))
+                {
+                    continue;
+                }
+
+                if (!covered)
+                {
+                    renderSubtree(childZoom, cx0, cy0, childSpan, {&colors, x0, y0, span});
+                    continue;
+                }
+
+                for (int cy = cy0; cy < cy0 + childSpan; cy++)
+                {
+                    for (int cx = cx0; cx < cx0 + childSpan; cx++)
+                    {
+                        uint32_t color = *colors[(cy / 2 - y0) * span + (cx / 2 - x0)];
+                        copyUniformSubtree(childZoom, cx, cy, color);
+                    }
+                }
+            }
+        }
+    }
+
+    // Writes the uniform `color` tile for (zoom, x, y) and every tile below
+    // it in the area, to every output.
+    void copyUniformSubtree(int zoom, int x, int y, uint32_t color)
+    {
+        for (int depth = 0; zoom + depth <= options.maxZoom; depth++)
+        {
+            int z = zoom + depth;
+            int side = 1 << depth;
+            for (int ty = y * side; ty < (y + 1) * side; ty++)
+            {
+                for (int tx = x * side; tx < (x + 1) * side; tx++)
+                {
+                    if (!options.area.contains(z, tx, ty))
+                    {
+                        continue;
+                    }
+                    for (size_t output = 0; output < uniformTiles.size(); output++)
+                    {
+                        encoders.submitEncoded(output, z, tx, (1 << z) - 1 - ty, uniformTile(output, z, color));
+                    }
+                    stats.tiles++;
+                    stats.prunedTiles++;
+                }
+            }
+        }
+    }
+
+    // Highest minzoom of any style layer. Below it, deeper zooms can still
+    // bring in layers that a uniform parent tile did not show.
+    float styleMaxMinZoom()
+    {
+        if (!layerMinZoom)
+        {
+            float minZoom = 0;
+            for (const style::Layer *layer : map.getStyle().getLayers())
+            {
+                minZoom = std::max(minZoom, layer->getMinZoom());
+            }
+            layerMinZoom = minZoom;
+        }
+        return *layerMinZoom;
+    }
+
+    uint32_t renderedTileSide() const
+    {
+        return static_cast<uint32_t>(tileSize * pixelRatio);
+    }
+
+    const RenderOptions &options;
+    WorkerStats &stats;
+    double pixelRatio;
+
+    HeadlessFrontend frontend;
+    Map map;
+    EncoderPool encoders;
+
+    int currentSpan = 1; // zoom 0 is a single tile
+    std::vector<std::unordered_map<uint64_t, std::string>> uniformTiles; // per output, by zoom << 32 | colour
+    std::optional<float> layerMinZoom;
+};
+
+void renderTiles(int workerId, TileScheduler &scheduler, const RenderOptions &options, int outputFd)
+{
+    util::RunLoop loop;
+
+    WorkerStats &stats = scheduler.worker(workerId);
+
+    TileRenderer renderer(options, stats, [outputFd](int output, int zoom, int x, int tmsY, std::string_view data)
+                          { writeTileFrame(outputFd, output, zoom, x, tmsY, data); });
+    TileChunk chunk;
+
+    while (scheduler.next(chunk))
+    {
+        auto chunkStart = std::chrono::steady_clock::now();
+
+        renderer.renderChunk(chunk);
+
+        // Tells the writer once every tile of the chunk has been sent, so it
+        // can record the chunk as done in the same transaction as its tiles.
+        uint64_t index = chunk.index;
+        renderer.checkpoint([outputFd, index]
+                            { writeCheckpointFrame(outputFd, index); });
+
+        auto busy = std::chrono::steady_clock::now() - chunkStart;
+        stats.busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count();
+        stats.chunks++;
+    }
+
+    renderer.finish();
+    stats.finishedNanoseconds = scheduler.elapsed();
+}
+
+BlockRenderer::BlockRenderer(const RenderOptions &options, WorkerStats &stats)
+    : renderer(std::make_unique<TileRenderer>(options, stats, [this](int output, int zoom, int x, int tmsY, std::string_view data)
+                                              { (*current)(output, zoom, x, tmsY, data); }))
+{
+}
+
+BlockRenderer::~BlockRenderer()
+{
+    renderer->finish();
+}
+
+void BlockRenderer::render(int zoom, int x, int y, const TileCallback &onTile)
+{
+    current = &onTile;
+    renderer->renderBlockAt(zoom, x, y);
+    current = nullptr;
+}
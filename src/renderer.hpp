@@ -0,0 +1,103 @@
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "image_encoding.hpp"
+#include "tile_cover.hpp"
+#include "tile_order.hpp"
+#include "tile_scheduler.hpp"
+
+struct RenderOptions
+{
+    std::string styleUrl;
+    int maxZoom = 5;
+    std::vector<ImageFormat> imageFormats{ImageFormat::WEBP}; // every frame is encoded once per format
+    EncoderProfile encoderProfile; // encoder settings of every zoom, balanced by default
+    int metatile = 1;       // tiles per side rendered in one frame
+    int buffer = 0;         // extra pixels rendered around each frame and cut away
+    int chunkSize = 8;      // tiles per side handed to a worker at once
+    int encoderThreads = 0; // 0 encodes on the render thread
+    int queueDepth = 8;     // rendered tiles waiting for an encoder thread
+    int pruneZoom = -1;     // skip rendering below uniform tiles from this zoom on, -1 disables
+    int renderFromZoom = 0; // lower zooms are downsampled from rendered tiles, 0 renders every zoom
+    TileCover area;         // tiles to render, the whole world by default
+    std::string cacheDirectory; // shared on-disk cache for network resources, empty disables
+    std::vector<uint32_t> tileSizes{512}; // pixel side of every output, largest first
+    TileOrder order = TileOrder::Hilbert; // order of the chunks in a level and the blocks in a chunk
+    int sourceCacheMegabytes = 256;       // in-memory cache of vector source tiles of this process, 0 disables
+};
+
+// Side of a tile in style pixels. Outputs of other pixel sizes render at a
+// matching pixel ratio.
+constexpr uint32_t tileSize = 512;
+
+// Every frame is rendered for the largest of options.tileSizes. The smaller
+// outputs are halved from it, so each size has to be the largest divided by
+// a power of two.
+double renderPixelRatio(const RenderOptions &options);
+
+// Every tile size is written once per image format. Outputs are numbered by
+// size first, largest first, then by format in the order given, so output
+// sizeIndex * imageFormats.size() + formatIndex holds that pair.
+size_t outputCount(const RenderOptions &options);
+uint32_t outputTileSize(const RenderOptions &options, size_t output);
+ImageFormat outputFormat(const RenderOptions &options, size_t output);
+
+// With renderFromZoom set, workers claim single tiles at this zoom, render
+// the renderFromZoom tiles below them and downsample their way back up. The
+// zooms below it are built by buildPyramidTop() in the writer.
+int pyramidZoom(const RenderOptions &options);
+
+// The levels the scheduler hands out for these options. With pruning enabled
+// the chunks at pruneZoom are single blocks whose whole subtree down to
+// maxZoom is rendered parent-first by the worker that claims them. Levels
+// only span the chunks that reach into options.area.
+std::vector<ScheduleLevel> scheduleLevels(const RenderOptions &options);
+
+// Replaces the network file source of this process. Has to run before the
+// first Map is created: once in every forked worker, or once for all render
+// threads with `threaded`, which also shares styles, sprites and glyphs between
+// their Maps in memory. Vector source tiles are kept in memory up to
+// options.sourceCacheMegabytes. Cache hits, source tile requests and source
+// cache hits are counted in the WorkerStats of the renderer that asked.
+void registerFileSources(const RenderOptions &options, bool threaded);
+
+// Renders the chunks claimed from the scheduler and streams the encoded tiles
+// to outputFd until the scheduler runs dry.
+void renderTiles(int workerId, TileScheduler &scheduler, const RenderOptions &options, int outputFd);
+
+class TileRenderer;
+
+// Keeps a Map with its style loaded and renders single metatiles on request,
+// for the tile server. It has to be created, used and destroyed on one
+// thread, and that thread needs an mbgl::util::RunLoop.
+class BlockRenderer
+{
+public:
+    // Receives every encoded tile of a block, once per output. `data` is
+    // only valid during the call.
+    using TileCallback = std::function<void(int output, int zoom, int x, int tmsY, std::string_view data)>;
+
+    BlockRenderer(const RenderOptions &options, WorkerStats &stats);
+    ~BlockRenderer();
+
+    BlockRenderer(const BlockRenderer &) = delete;
+    BlockRenderer &operator=(const BlockRenderer &) = delete;
+
+    // Renders the metatile holding the tile and returns once every tile of
+    // it in options.area has been passed to `onTile`.
+    void render(int zoom, int x, int y, const TileCallback &onTile);
+
+private:
+    const TileCallback *current = nullptr;
+    std::unique_ptr<TileRenderer> renderer;
+};
+
+#endif // RENDERER_HPP
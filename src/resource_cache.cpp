@@ -0,0 +1,399 @@
+#include "resource_cache.hpp"
+
+#include <mbgl/storage/resource.hpp>
+#include <mbgl/storage/response.hpp>
+#include <mbgl/util/async_request.hpp>
+#include <mbgl/util/chrono.hpp>
+#include <mbgl/util/run_loop.hpp>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
+
+#include "tile_hash.hpp"
+
+namespace mbgl {
+
+    // Every entry starts with one of these, followed by a line with the
+    // expiry, modification time and must-revalidate flag, a line with the
+    // etag and the response body. Entries of earlier versions start with
+    // 'D' or 'N' followed straight by the body; they never expire.
+    constexpr char dataEntry = 'B';
+    constexpr char noContentEntry = 'E';
+    constexpr char legacyDataEntry = 'D';
+    constexpr char legacyNoContentEntry = 'N';
+
+    namespace {
+
+        std::string timestampField(const std::optional<Timestamp>& time) {
+            return time ? std::to_string(time->time_since_epoch().count()) : "-";
+        }
+
+        std::optional<Timestamp> parseTimestamp(const std::string& field) {
+            if (field == "-") {
+                return std::nullopt;
+            }
+            return Timestamp(std::chrono::seconds(std::stoll(field)));
+        }
+
+        // Responses without an expiry are kept for good, as before.
+        bool isFresh(const Response& response) {
+            return !response.expires || *response.expires > util::now();
+        }
+
+    } // namespace
+
+    CachingFileSource::CachingFileSource(std::unique_ptr<FileSource> upstream_, std::string directory_, WorkerStats& stats_)
+        : upstream(std::move(upstream_)),
+          directory(std::move(directory_)),
+          stats(stats_) {
+    }
+
+    CachingFileSource::~CachingFileSource() = default;
+
+    std::unique_ptr<AsyncRequest> CachingFileSource::request(const Resource& resource, Callback callback) {
+        std::string path = entryPath(resource.url);
+
+        std::optional<Response> cached = load(path);
+        if (cached && isFresh(*cached)) {
+            stats.cacheHits++;
+            // Answer from the run loop like any other file source, never from
+            // inside request().
+            return util::RunLoop::Get()->invokeCancellable(
+                [callback, response = std::move(*cached)] { callback(response); });
+        }
+
+        // An expired entry is revalidated: the server answers 304 if the
+        // stored body is still current, which then gets the new expiry.
+        stats.cacheMisses++;
+        Resource upstreamResource = resource;
+        if (cached) {
+            upstreamResource.priorEtag = cached->etag;
+            upstreamResource.priorModified = cached->modified;
+            upstreamResource.priorExpires = cached->expires;
+            upstreamResource.priorData = cached->data;
+        }
+        return upstream->request(upstreamResource, [callback, path, cached](Response response) {
+            if (cached && response.notModified) {
+                Response refreshed = *cached;
+                refreshed.expires = response.expires;
+                refreshed.mustRevalidate = response.mustRevalidate;
+                if (response.etag) {
+                    refreshed.etag = response.etag;
+                }
+                store(path, refreshed);
+                callback(refreshed);
+                return;
+            }
+            if (cached && response.error && !cached->mustRevalidate) {
+                // Better a stale copy than none, unless the server forbids it.
+                callback(*cached);
+                return;
+            }
+            store(path, response);
+            callback(response);
+        });
+    }
+
+    bool CachingFileSource::canRequest(const Resource& resource) const {
+        return upstream->canRequest(resource);
+    }
+
+    void CachingFileSource::pause() {
+        upstream->pause();
+    }
+
+    void CachingFileSource::resume() {
+        upstream->resume();
+    }
+
+    void CachingFileSource::setProperty(const std::string& key, const mapbox::base::Value& value) {
+        upstream->setProperty(key, value);
+    }
+
+    mapbox::base::Value CachingFileSource::getProperty(const std::string& key) const {
+        return upstream->getProperty(key);
+    }
+
+    void CachingFileSource::setResourceOptions(ResourceOptions options) {
+        upstream->setResourceOptions(std::move(options));
+    }
+
+    ResourceOptions CachingFileSource::getResourceOptions() {
+        return upstream->getResourceOptions();
+    }
+
+    void CachingFileSource::setClientOptions(ClientOptions options) {
+        upstream->setClientOptions(std::move(options));
+    }
+
+    ClientOptions CachingFileSource::getClientOptions() {
+        return upstream->getClientOptions();
+    }
+
+    std::string CachingFileSource::entryPath(const std::string& url) const {
+        std::string id = tileContentId(url.data(), url.size());
+        return directory + "/" + id.substr(0, 2) + "/" + id.substr(2);
+    }
+
+    std::optional<Response> CachingFileSource::load(const std::string& path) const {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return std::nullopt;
+        }
+
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        std::string entry = buffer.str();
+        if (entry.empty()) {
+            return std::nullopt;
+        }
+
+        Response response;
+        size_t bodyStart = 1;
+        char kind = entry[0];
+        if (kind == dataEntry || kind == noContentEntry) {
+            size_t headerEnd = entry.find('\n', 1);
+            size_t etagEnd = headerEnd == std::string::npos ? headerEnd : entry.find('\n', headerEnd + 1);
+            if (etagEnd == std::string::npos) {
+                return std::nullopt;
+            }
+            std::istringstream header(entry.substr(1, headerEnd - 1));
+            std::string expires, modified;
+            int mustRevalidate = 0;
+            if (!(header >> expires >> modified >> mustRevalidate)) {
+                return std::nullopt;
+            }
+            try {
+                response.expires = parseTimestamp(expires);
+                response.modified = parseTimestamp(modified);
+            } catch (const std::exception&) {
+                return std::nullopt;
+            }
+            response.mustRevalidate = mustRevalidate != 0;
+            if (etagEnd > headerEnd + 1) {
+                response.etag = entry.substr(headerEnd + 1, etagEnd - headerEnd - 1);
+            }
+            bodyStart = etagEnd + 1;
+        }
+
+        if (kind == noContentEntry || kind == legacyNoContentEntry) {
+            response.noContent = true;
+        } else if (kind == dataEntry || kind == legacyDataEntry) {
+            response.data = std::make_shared<const std::string>(entry.substr(bodyStart));
+        } else {
+            return std::nullopt;
+        }
+        return response;
+    }
+
+    void CachingFileSource::store(const std::string& path, const Response& response) {
+        if (response.error || response.notModified || (!response.data && !response.noContent)) {
+            return;
+        }
+
+        std::error_code error;
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+        // Render threads of one process can store the same entry at once.
+        size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+        std::string temporaryPath = path + "." + std::to_string(getpid()) + "-" + std::to_string(thread) + ".tmp";
+        {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                return;
+            }
+            file.put(response.noContent ? noContentEntry : dataEntry);
+            file << timestampField(response.expires) << ' ' << timestampField(response.modified) << ' '
+                 << (response.mustRevalidate ? 1 : 0) << '\n' << response.etag.value_or("") << '\n';
+            if (!response.noContent) {
+                file.write(response.data->data(), static_cast<std::streamsize>(response.data->size()));
+            }
+            if (!file) {
+                file.close();
+                std::remove(temporaryPath.c_str());
+                return;
+            }
+        }
+        std::rename(temporaryPath.c_str(), path.c_str());
+    }
+
+    SharedResourceFileSource::SharedResourceFileSource(std::unique_ptr<FileSource> upstream_,
+                                                       std::shared_ptr<Responses> responses_)
+        : upstream(std::move(upstream_)),
+          responses(std::move(responses_)) {
+    }
+
+    SharedResourceFileSource::~SharedResourceFileSource() = default;
+
+    std::unique_ptr<AsyncRequest> SharedResourceFileSource::request(const Resource& resource, Callback callback) {
+        if (resource.kind == Resource::Kind::Tile) {
+            return upstream->request(resource, std::move(callback));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(responses->mutex);
+            auto cached = responses->byUrl.find(resource.url);
+            if (cached != responses->byUrl.end()) {
+                return util::RunLoop::Get()->invokeCancellable(
+                    [callback, response = cached->second] { callback(response); });
+            }
+        }
+
+        // Threads asking for the same resource before the first answer
+        // arrives all fetch it; only the first answer is kept.
+        std::string url = resource.url;
+        return upstream->request(resource, [responses = responses, callback, url](Response response) {
+            if (!response.error && !response.notModified) {
+                std::lock_guard<std::mutex> lock(responses->mutex);
+                responses->byUrl.emplace(url, response);
+            }
+            callback(response);
+        });
+    }
+
+    bool SharedResourceFileSource::canRequest(const Resource& resource) const {
+        return upstream->canRequest(resource);
+    }
+
+    void SharedResourceFileSource::pause() {
+        upstream->pause();
+    }
+
+    void SharedResourceFileSource::resume() {
+        upstream->resume();
+    }
+
+    void SharedResourceFileSource::setProperty(const std::string& key, const mapbox::base::Value& value) {
+        upstream->setProperty(key, value);
+    }
+
+    mapbox::base::Value SharedResourceFileSource::getProperty(const std::string& key) const {
+        return upstream->getProperty(key);
+    }
+
+    void SharedResourceFileSource::setResourceOptions(ResourceOptions options) {
+        upstream->setResourceOptions(std::move(options));
+    }
+
+    ResourceOptions SharedResourceFileSource::getResourceOptions() {
+        return upstream->getResourceOptions();
+    }
+
+    void SharedResourceFileSource::setClientOptions(ClientOptions options) {
+        upstream->setClientOptions(std::move(options));
+    }
+
+    ClientOptions SharedResourceFileSource::getClientOptions() {
+        return upstream->getClientOptions();
+    }
+
+    SourceTileFileSource::Cache::Cache(size_t maxBytes_)
+        : maxBytes(maxBytes_) {
+    }
+
+    std::optional<Response> SourceTileFileSource::Cache::find(const std::string& url) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto cached = index.find(url);
+        if (cached == index.end()) {
+            return std::nullopt;
+        }
+        entries.splice(entries.begin(), entries, cached->second);
+        return cached->second->second;
+    }
+
+    void SourceTileFileSource::Cache::insert(const std::string& url, const Response& response) {
+        size_t size = url.size() + (response.data ? response.data->size() : 0);
+        if (size > maxBytes) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.count(url)) {
+            return;
+        }
+
+        entries.emplace_front(url, response);
+        index.emplace(url, entries.begin());
+        bytes += size;
+
+        while (bytes > maxBytes) {
+            const Entry& oldest = entries.back();
+            bytes -= oldest.first.size() + (oldest.second.data ? oldest.second.data->size() : 0);
+            index.erase(oldest.first);
+            entries.pop_back();
+        }
+    }
+
+    SourceTileFileSource::SourceTileFileSource(std::unique_ptr<FileSource> upstream_, std::shared_ptr<Cache> cache_,
+                                               WorkerStats& stats_)
+        : upstream(std::move(upstream_)),
+          cache(std::move(cache_)),
+          stats(stats_) {
+    }
+
+    SourceTileFileSource::~SourceTileFileSource() = default;
+
+    std::unique_ptr<AsyncRequest> SourceTileFileSource::request(const Resource& resource, Callback callback) {
+        if (resource.kind != Resource::Kind::Tile) {
+            return upstream->request(resource, std::move(callback));
+        }
+
+        stats.sourceRequests++;
+        if (!cache) {
+            return upstream->request(resource, std::move(callback));
+        }
+        if (std::optional<Response> cached = cache->find(resource.url)) {
+            stats.sourceCacheHits++;
+            return util::RunLoop::Get()->invokeCancellable(
+                [callback, response = std::move(*cached)] { callback(response); });
+        }
+
+        std::string url = resource.url;
+        return upstream->request(resource, [cache = cache, callback, url](Response response) {
+            if (!response.error && !response.notModified && (response.data || response.noContent)) {
+                cache->insert(url, response);
+            }
+            callback(response);
+        });
+    }
+
+    bool SourceTileFileSource::canRequest(const Resource& resource) const {
+        return upstream->canRequest(resource);
+    }
+
+    void SourceTileFileSource::pause() {
+        upstream->pause();
+    }
+
+    void SourceTileFileSource::resume() {
+        upstream->resume();
+    }
+
+    void SourceTileFileSource::setProperty(const std::string& key, const mapbox::base::Value& value) {
+        upstream->setProperty(key, value);
+    }
+
+    mapbox::base::Value SourceTileFileSource::getProperty(const std::string& key) const {
+        return upstream->getProperty(key);
+    }
+
+    void SourceTileFileSource::setResourceOptions(ResourceOptions options) {
+        upstream->setResourceOptions(std::move(options));
+    }
+
+    ResourceOptions SourceTileFileSource::getResourceOptions() {
+        return upstream->getResourceOptions();
+    }
+
+    void SourceTileFileSource::setClientOptions(ClientOptions options) {
+        upstream->setClientOptions(std::move(options));
+    }
+
+    ClientOptions SourceTileFileSource::getClientOptions() {
+        return upstream->getClientOptions();
+    }
+
+} // namespace mbgl
@@ -0,0 +1,145 @@
+#ifndef RESOURCE_CACHE_HPP
+#define RESOURCE_CACHE_HPP
+
+#include <mbgl/storage/file_source.hpp>
+#include <mbgl/storage/resource_options.hpp>
+#include <mbgl/storage/response.hpp>
+#include <mbgl/util/client_options.hpp>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include "tile_scheduler.hpp"
+
+namespace mbgl
+{
+
+    // File source that keeps every successful response of `upstream` in a
+    // directory shared by all workers and later runs: styles, TileJSON,
+    // sprites, glyphs and source tiles are then fetched once instead of once
+    // per worker.
+    // Entries are written to a temporary file and renamed into place, so
+    // concurrent workers never see a partial entry. Nothing is evicted.
+    // Entries keep the expiry, modification time, etag and must-revalidate
+    // flag of their response. An expired entry is revalidated upstream and
+    // kept if the server answers 304; if the server cannot be reached it is
+    // still served, unless the response demanded revalidation.
+    class CachingFileSource : public FileSource {
+    public:
+        CachingFileSource(std::unique_ptr<FileSource> upstream, std::string directory, WorkerStats& stats);
+        ~CachingFileSource() override;
+
+        std::unique_ptr<AsyncRequest> request(const Resource& resource, Callback callback) override;
+        bool canRequest(const Resource& resource) const override;
+
+        void pause() override;
+        void resume() override;
+
+        void setProperty(const std::string& key, const mapbox::base::Value& value) override;
+        mapbox::base::Value getProperty(const std::string& key) const override;
+
+        void setResourceOptions(ResourceOptions options) override;
+        ResourceOptions getResourceOptions() override;
+        void setClientOptions(ClientOptions options) override;
+        ClientOptions getClientOptions() override;
+
+    private:
+        std::string entryPath(const std::string& url) const;
+        std::optional<Response> load(const std::string& path) const;
+        static void store(const std::string& path, const Response& response);
+
+        std::unique_ptr<FileSource> upstream;
+        std::string directory;
+        WorkerStats& stats;
+    };
+
+    // File source for render threads that share one process. Each render
+    // thread has its own chain of file sources, and the instances of all of
+    // them keep the responses for styles, TileJSON, sprites and glyphs in one
+    // shared `Responses`, so each of them is fetched and held once and all
+    // Maps parse the same buffers. Tiles are passed straight through.
+    class SharedResourceFileSource : public FileSource {
+    public:
+        struct Responses {
+            std::mutex mutex;
+            std::unordered_map<std::string, Response> byUrl;
+        };
+
+        SharedResourceFileSource(std::unique_ptr<FileSource> upstream, std::shared_ptr<Responses> responses);
+        ~SharedResourceFileSource() override;
+
+        std::unique_ptr<AsyncRequest> request(const Resource& resource, Callback callback) override;
+        bool canRequest(const Resource& resource) const override;
+
+        void pause() override;
+        void resume() override;
+
+        void setProperty(const std::string& key, const mapbox::base::Value& value) override;
+        mapbox::base::Value getProperty(const std::string& key) const override;
+
+        void setResourceOptions(ResourceOptions options) override;
+        ResourceOptions getResourceOptions() override;
+        void setClientOptions(ClientOptions options) override;
+        ClientOptions getClientOptions() override;
+
+    private:
+        std::unique_ptr<FileSource> upstream;
+        std::shared_ptr<Responses> responses;
+    };
+
+    // File source that keeps the most recently used source tiles of
+    // `upstream` in memory, up to `maxBytes` of tile data. Neighbouring frames
+    // need mostly the same source tiles, so with a locality-aware render order
+    // most tile requests are answered from here instead of going back to the
+    // archive, the disk cache or the network. The chains of all render
+    // threads of a process can share one `Cache`. Every tile request and
+    // every answer from memory is counted in `stats`; without a `Cache` tiles
+    // are only counted, so render orders can be compared with `-M 0` too.
+    class SourceTileFileSource : public FileSource {
+    public:
+        class Cache {
+        public:
+            explicit Cache(size_t maxBytes);
+
+            std::optional<Response> find(const std::string& url);
+            void insert(const std::string& url, const Response& response);
+
+        private:
+            using Entry = std::pair<std::string, Response>;
+
+            size_t maxBytes;
+            std::mutex mutex;
+            std::list<Entry> entries; // most recently used first
+            std::unordered_map<std::string, std::list<Entry>::iterator> index;
+            size_t bytes = 0;
+        };
+
+        SourceTileFileSource(std::unique_ptr<FileSource> upstream, std::shared_ptr<Cache> cache, WorkerStats& stats);
+        ~SourceTileFileSource() override;
+
+        std::unique_ptr<AsyncRequest> request(const Resource& resource, Callback callback) override;
+        bool canRequest(const Resource& resource) const override;
+
+        void pause() override;
+        void resume() override;
+
+        void setProperty(const std::string& key, const mapbox::base::Value& value) override;
+        mapbox::base::Value getProperty(const std::string& key) const override;
+
+        void setResourceOptions(ResourceOptions options) override;
+        ResourceOptions getResourceOptions() override;
+        void setClientOptions(ClientOptions options) override;
+        ClientOptions getClientOptions() override;
+
+    private:
+        std::unique_ptr<FileSource> upstream;
+        std::shared_ptr<Cache> cache;
+        WorkerStats& stats;
+    };
+
+} // namespace mbgl
+
+#endif // RESOURCE_CACHE_HPP
@@ -0,0 +1,410 @@
+#include "run_metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+static uint64_t steadyNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+std::string stageName(Stage stage)
+{
+    switch (stage)
+    {
+    case Stage::JumpTo:
+        return "jumpto";
+    case Stage::Render:
+        return "render";
+    case Stage::Unpremultiply:
+        return "unpremultiply";
+    case Stage::Encode:
+        return "encode";
+    case Stage::Insert:
+        return "insert";
+    }
+    return "unknown";
+}
+
+void StageHistogram::record(uint64_t duration)
+{
+    uint64_t microseconds = duration / 1000;
+    int bucket = microseconds < 2 ? 0 : 63 - __builtin_clzll(microseconds);
+    buckets[std::min(bucket, histogramBuckets - 1)].fetch_add(1, std::memory_order_relaxed);
+    nanoseconds.fetch_add(duration, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void StageHistograms::record(Stage stage, int zoom, uint64_t nanoseconds)
+{
+    stages[std::clamp(zoom, 0, metricsZoomCount - 1)][static_cast<int>(stage)].record(nanoseconds);
+}
+
+StageTimer::StageTimer(StageHistograms &histograms, Stage stage, int zoom)
+    : histograms(histograms), stage(stage), zoom(zoom), start(steadyNanoseconds())
+{
+}
+
+StageTimer::~StageTimer()
+{
+    histograms.record(stage, zoom, steadyNanoseconds() - start);
+}
+
+void HistogramTotal::add(const StageHistogram &histogram)
+{
+    count += histogram.count.load(std::memory_order_relaxed);
+    nanoseconds += histogram.nanoseconds.load(std::memory_order_relaxed);
+    for (int i = 0; i < histogramBuckets; i++)
+    {
+        buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+    }
+}
+
+void HistogramTotal::add(const HistogramTotal &total)
+{
+    count += total.count;
+    nanoseconds += total.nanoseconds;
+    for (int i = 0; i < histogramBuckets; i++)
+    {
+        buckets[i] += total.buckets[i];
+    }
+}
+
+double HistogramTotal::quantile(double quantile) const
+{
+    uint64_t bucketTotal = 0;
+    for (uint64_t bucket : buckets)
+    {
+        bucketTotal += bucket;
+    }
+    if (bucketTotal == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(std::ceil(quantile * bucketTotal));
+    uint64_t seen = 0;
+    int bucket = 0;
+    for (; bucket < histogramBuckets - 1; bucket++)
+    {
+        seen += buckets[bucket];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+    double low = bucket == 0 ? 1 : std::ldexp(1.0, bucket);
+    return std::sqrt(low * std::ldexp(1.0, bucket + 1)) / 1e6;
+}
+
+namespace
+{
+
+    using StageTotals = std::array<HistogramTotal, stageCount>;
+
+    // Upper bound of a bucket in seconds, +Inf for the last one.
+    std::string bucketBound(int bucket)
+    {
+        if (bucket == histogramBuckets - 1)
+        {
+            return "+Inf";
+        }
+        std::ostringstream bound;
+        bound << std::ldexp(1.0, bucket + 1) / 1e6;
+        return bound.str();
+    }
+
+    std::string jsonString(const std::string &text)
+    {
+        std::string quoted = "\"";
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                quoted += '\\';
+                quoted += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                quoted += escaped;
+            }
+            else
+            {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+
+    // Prometheus label values only know \\, \" and \n; anything else,
+    // including other control characters, is taken as is.
+    std::string labelValue(const std::string &text)
+    {
+        std::string quoted = "\"";
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                quoted += '\\';
+                quoted += c;
+            }
+            else if (c == '\n')
+            {
+                quoted += "\\n";
+            }
+            else
+            {
+                quoted += c;
+            }
+        }
+        return quoted + "\"";
+    }
+
+    StageTotals zoomTotals(const std::vector<const StageHistograms *> &workers, const StageHistograms &writer, int zoom)
+    {
+        StageTotals totals;
+        for (int stage = 0; stage < stageCount; stage++)
+        {
+            for (const StageHistograms *worker : workers)
+            {
+                totals[stage].add(worker->stages[zoom][stage]);
+            }
+            totals[stage].add(writer.stages[zoom][stage]);
+        }
+        return totals;
+    }
+
+    StageTotals allZooms(const std::vector<const StageHistograms *> &sources)
+    {
+        StageTotals totals;
+        for (const StageHistograms *source : sources)
+        {
+            for (int zoom = 0; zoom < metricsZoomCount; zoom++)
+            {
+                for (int stage = 0; stage < stageCount; stage++)
+                {
+                    totals[stage].add(source->stages[zoom][stage]);
+                }
+            }
+        }
+        return totals;
+    }
+
+    void writeJSONStages(std::ostream &out, const StageTotals &totals, bool withBuckets)
+    {
+        out << "{";
+        bool first = true;
+        for (int stage = 0; stage < stageCount; stage++)
+        {
+            const HistogramTotal &total = totals[stage];
+            if (total.count == 0)
+            {
+                continue;
+            }
+            out << (first ? "" : ",") << jsonString(stageName(static_cast<Stage>(stage))) << ":{"
+                << "\"count\":" << total.count
+                << ",\"seconds\":" << total.nanoseconds / 1e9
+                << ",\"mean_ms\":" << total.nanoseconds / 1e6 / total.count
+                << ",\"p50_ms\":" << total.quantile(0.5) * 1e3
+                << ",\"p90_ms\":" << total.quantile(0.9) * 1e3
+                << ",\"p99_ms\":" << total.quantile(0.99) * 1e3;
+            if (withBuckets)
+            {
+                out << ",\"buckets\":[";
+                for (int i = 0; i < histogramBuckets; i++)
+                {
+                    out << (i ? "," : "") << total.buckets[i];
+                }
+                out << "]";
+            }
+            out << "}";
+            first = false;
+        }
+        out << "}";
+    }
+
+    void writeJSON(std::ostream &out, const RunSummary &run,
+                   const std::vector<const StageHistograms *> &workers, const StageHistograms &writer)
+    {
+        std::vector<const StageHistograms *> all = workers;
+        all.push_back(&writer);
+
+        out << "{\n"
+            << "  \"style\": " << jsonString(run.style) << ",\n"
+            << "  \"format\": " << jsonString(run.format) << ",\n"
+            << "  \"max_zoom\": " << run.maxZoom << ",\n"
+            << "  \"workers\": " << run.workers << ",\n"
+            << "  \"threaded\": " << (run.threaded ? "true" : "false") << ",\n"
+            << "  \"wall_seconds\": " << run.wallSeconds << ",\n"
+            << "  \"finish_seconds\": " << run.finishSeconds << ",\n"
+            << "  \"tiles\": " << run.tiles << ",\n"
+            << "  \"tiles_per_second\": " << (run.wallSeconds > 0 ? run.tiles / run.wallSeconds : 0.0) << ",\n"
+            << "  \"chunks\": " << run.chunks << ",\n"
+            << "  \"peak_memory_mb\": " << run.peakKilobytes / 1024 << ",\n";
+
+        // Upper bounds of the histogram buckets in seconds; the last one is open.
+        out << "  \"bucket_bounds\": [";
+        for (int i = 0; i < histogramBuckets - 1; i++)
+        {
+            out << (i ? "," : "") << bucketBound(i);
+        }
+        out << "],\n";
+
+        out << "  \"stages\": ";
+        writeJSONStages(out, allZooms(all), true);
+        out << ",\n  \"zooms\": [";
+        bool first = true;
+        for (int zoom = 0; zoom < metricsZoomCount; zoom++)
+        {
+            StageTotals totals = zoomTotals(workers, writer, zoom);
+            bool empty = true;
+            for (const HistogramTotal &total : totals)
+            {
+                empty = empty && total.count == 0;
+            }
+            if (empty)
+            {
+                continue;
+            }
+            out << (first ? "\n" : ",\n") << "    {\"zoom\": " << zoom << ", \"stages\": ";
+            writeJSONStages(out, totals, true);
+            out << "}";
+            first = false;
+        }
+        out << "\n  ],\n  \"worker_stages\": [";
+        for (size_t id = 0; id < workers.size(); id++)
+        {
+            out << (id ? ",\n" : "\n") << "    {\"worker\": " << id << ", \"stages\": ";
+            writeJSONStages(out, allZooms({workers[id]}), false);
+            out << "}";
+        }
+        out << "\n  ],\n  \"writer_stages\": ";
+        writeJSONStages(out, allZooms({&writer}), false);
+        out << "\n}\n";
+    }
+
+    void writePrometheus(std::ostream &out, const RunSummary &run,
+                         const std::vector<const StageHistograms *> &workers, const StageHistograms &writer)
+    {
+        std::string labels = "style=" + labelValue(run.style) + ",format=" + labelValue(run.format);
+
+        auto gauge = [&](const std::string &name, const std::string &help, double value)
+        {
+            out << "# HELP tilerender_" << name << " " << help << "\n"
+                << "# TYPE tilerender_" << name << " gauge\n"
+                << "tilerender_" << name << "{" << labels << "} " << value << "\n";
+        };
+        gauge("wall_seconds", "Wall time of the run.", run.wallSeconds);
+        gauge("finish_seconds", "Time the writer spent finishing the outputs.", run.finishSeconds);
+        gauge("tiles", "Tiles written to the first output.", static_cast<double>(run.tiles));
+        gauge("tiles_per_second", "Tiles written per second of wall time.", run.wallSeconds > 0 ? run.tiles / run.wallSeconds : 0.0);
+        gauge("chunks", "Chunks rendered.", static_cast<double>(run.chunks));
+        gauge("workers", "Render workers.", run.workers);
+        gauge("peak_memory_bytes", "Peak resident memory of the workers.", run.peakKilobytes * 1024.0);
+
+        out << "# HELP tilerender_stage_seconds Time per tile or frame spent in each stage.\n"
+            << "# TYPE tilerender_stage_seconds histogram\n";
+        for (int zoom = 0; zoom < metricsZoomCount; zoom++)
+        {
+            StageTotals totals = zoomTotals(workers, writer, zoom);
+            for (int stage = 0; stage < stageCount; stage++)
+            {
+                const HistogramTotal &total = totals[stage];
+                if (total.count == 0)
+                {
+                    continue;
+                }
+                std::string series = "stage=\"" + stageName(static_cast<Stage>(stage)) + "\",zoom=\"" + std::to_string(zoom) + "\"";
+                uint64_t cumulative = 0;
+                for (int i = 0; i < histogramBuckets; i++)
+                {
+                    cumulative += total.buckets[i];
+                    out << "tilerender_stage_seconds_bucket{" << series << ",le=\"" << bucketBound(i) << "\"} " << cumulative << "\n";
+                }
+                out << "tilerender_stage_seconds_sum{" << series << "} " << total.nanoseconds / 1e9 << "\n"
+                    << "tilerender_stage_seconds_count{" << series << "} " << total.count << "\n";
+            }
+        }
+
+        out << "# HELP tilerender_worker_stage_seconds Time each worker spent in each stage.\n"
+            << "# TYPE tilerender_worker_stage_seconds summary\n";
+        for (size_t id = 0; id < workers.size(); id++)
+        {
+            StageTotals totals = allZooms({workers[id]});
+            for (int stage = 0; stage < stageCount; stage++)
+            {
+                const HistogramTotal &total = totals[stage];
+                if (total.count == 0)
+                {
+                    continue;
+                }
+                std::string series = "worker=\"" + std::to_string(id) + "\",stage=\"" + stageName(static_cast<Stage>(stage)) + "\"";
+                for (double quantile : {0.5, 0.9, 0.99})
+                {
+                    out << "tilerender_worker_stage_seconds{" << series << ",quantile=\"" << quantile << "\"} "
+                        << total.quantile(quantile) << "\n";
+                }
+                out << "tilerender_worker_stage_seconds_sum{" << series << "} " << total.nanoseconds / 1e9 << "\n"
+                    << "tilerender_worker_stage_seconds_count{" << series << "} " << total.count << "\n";
+            }
+        }
+    }
+
+} // namespace
+
+void printStageTimes(std::ostream &out, const std::vector<const StageHistograms *> &workers, const StageHistograms &writer)
+{
+    std::vector<const StageHistograms *> all = workers;
+    all.push_back(&writer);
+    StageTotals totals = allZooms(all);
+
+    out << "Stage times (all workers and the writer):" << std::endl;
+    for (int stage = 0; stage < stageCount; stage++)
+    {
+        const HistogramTotal &total = totals[stage];
+        if (total.count == 0)
+        {
+            continue;
+        }
+        out << "  " << std::left << std::setw(14) << stageName(static_cast<Stage>(stage)) << std::right
+            << std::fixed << std::setprecision(1) << std::setw(9) << total.nanoseconds / 1e9 << "s over "
+            << std::setw(9) << total.count << ", mean " << std::setprecision(2) << total.nanoseconds / 1e6 / total.count
+            << " ms, p50 " << total.quantile(0.5) * 1e3 << " ms, p99 " << total.quantile(0.99) * 1e3 << " ms"
+            << std::defaultfloat << std::endl;
+    }
+}
+
+void writeRunMetrics(const std::string &path, const RunSummary &run,
+                     const std::vector<const StageHistograms *> &workers, const StageHistograms &writer)
+{
+    std::ofstream file(path, std::ios::trunc);
+    if (!file)
+    {
+        throw std::runtime_error("Failed to open metrics file " + path);
+    }
+
+    bool prometheus = path.size() >= 5 && path.compare(path.size() - 5, 5, ".prom") == 0;
+    if (prometheus)
+    {
+        writePrometheus(file, run, workers, writer);
+    }
+    else
+    {
+        writeJSON(file, run, workers, writer);
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("Failed to write metrics file " + path);
+    }
+}
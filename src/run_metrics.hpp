@@ -0,0 +1,107 @@
+#ifndef RUN_METRICS_HPP
+#define RUN_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// The steps a tile goes through, from positioning the camera to the row in the
+// output. The first four run in the workers, Insert runs in the writer.
+enum class Stage
+{
+    JumpTo,
+    Render,
+    Unpremultiply,
+    Encode,
+    Insert,
+};
+
+constexpr int stageCount = 5;
+constexpr int metricsZoomCount = 23; // zooms 0 to 22
+
+// Bucket i holds durations from 2^i up to 2^(i+1) microseconds, bucket 0
+// everything below 2 microseconds and the last one everything above.
+constexpr int histogramBuckets = 32;
+
+std::string stageName(Stage stage);
+
+// Durations of one stage. All members are atomics, so a histogram can live in
+// shared memory and be recorded into from several threads; zero-filled memory
+// is an empty histogram.
+struct StageHistogram
+{
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> nanoseconds;
+    std::atomic<uint64_t> buckets[histogramBuckets];
+
+    void record(uint64_t duration);
+};
+
+// Every stage at every zoom, for one worker or for the writer.
+struct StageHistograms
+{
+    StageHistogram stages[metricsZoomCount][stageCount];
+
+    void record(Stage stage, int zoom, uint64_t nanoseconds);
+};
+
+// Records the time from its construction to its destruction.
+class StageTimer
+{
+public:
+    StageTimer(StageHistograms &histograms, Stage stage, int zoom);
+    ~StageTimer();
+
+    StageTimer(const StageTimer &) = delete;
+    StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+    StageHistograms &histograms;
+    Stage stage;
+    int zoom;
+    uint64_t start;
+};
+
+// A plain copy of one or more histograms added together.
+struct HistogramTotal
+{
+    uint64_t count = 0;
+    uint64_t nanoseconds = 0;
+    std::array<uint64_t, histogramBuckets> buckets{};
+
+    void add(const StageHistogram &histogram);
+    void add(const HistogramTotal &total);
+
+    // Estimated duration below which a `quantile` of the samples fall, in
+    // seconds, at the geometric middle of its bucket.
+    double quantile(double quantile) const;
+};
+
+// What a run reports besides the stage histograms.
+struct RunSummary
+{
+    std::string style;
+    std::string format;
+    int maxZoom = 0;
+    int workers = 0;
+    bool threaded = false;
+    double wallSeconds = 0;
+    double finishSeconds = 0; // writer: pyramid top, index build, archive assembly
+    uint64_t tiles = 0;       // tiles written to the first output
+    uint64_t chunks = 0;
+    long peakKilobytes = 0;
+};
+
+// Time spent in every stage over all workers and the writer.
+void printStageTimes(std::ostream &out, const std::vector<const StageHistograms *> &workers, const StageHistograms &writer);
+
+// Writes the summary and the histograms per stage, per zoom and per worker.
+// A path ending in .prom gets the Prometheus text format, anything else JSON.
+// Throws std::runtime_error if the file can't be written.
+void writeRunMetrics(const std::string &path, const RunSummary &run,
+                     const std::vector<const StageHistograms *> &workers, const StageHistograms &writer);
+
+#endif // RUN_METRICS_HPP
@@ -0,0 +1,279 @@
+#include "source_diff.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+#include "mbtiles.hpp"
+#include "pmtiles.hpp"
+
+namespace
+{
+
+    // One archive stepped through in the order of `key`.
+    class TileScan
+    {
+    public:
+        virtual ~TileScan() = default;
+
+        // Returns false after the last tile.
+        virtual bool next() = 0;
+
+        // Declared zoom range, or false if the archive has none.
+        virtual bool zoomRange(int &minZoom, int &maxZoom) = 0;
+
+        uint64_t key = 0;
+        int zoom = 0;
+        int x = 0;
+        int y = 0; // XYZ
+        const void *data = nullptr;
+        size_t size = 0;
+    };
+
+    class MBTilesScan : public TileScan
+    {
+    public:
+        explicit MBTilesScan(const std::string &path) : reader(path) {}
+
+        bool next() override
+        {
+            int tmsY;
+            if (!reader.nextTile(zoom, x, tmsY, data, size))
+            {
+                return false;
+            }
+            y = (1 << zoom) - 1 - tmsY;
+            // The order of the query: zoom, column, row.
+            key = (uint64_t(zoom) << 58) | (uint64_t(x) << 29) | uint64_t(tmsY);
+            return true;
+        }
+
+        bool zoomRange(int &minZoom, int &maxZoom) override
+        {
+            std::map<std::string, std::string> metadata = reader.metadata();
+            if (!metadata.count("minzoom") || !metadata.count("maxzoom"))
+            {
+                return false;
+            }
+            minZoom = std::stoi(metadata["minzoom"]);
+            maxZoom = std::stoi(metadata["maxzoom"]);
+            return true;
+        }
+
+    private:
+        MBTilesReader reader;
+    };
+
+    class PMTilesScan : public TileScan
+    {
+    public:
+        explicit PMTilesScan(const std::string &path) : reader(path) {}
+
+        bool next() override
+        {
+            const uint8_t *bytes;
+            if (!reader.nextTile(key, bytes, size))
+            {
+                return false;
+            }
+            data = bytes;
+            pmtilesTileCoordinates(key, zoom, x, y);
+            return true;
+        }
+
+        bool zoomRange(int &minZoom, int &maxZoom) override
+        {
+            minZoom = reader.header().minZoom;
+            maxZoom = reader.header().maxZoom;
+            return true;
+        }
+
+    private:
+        PMTilesReader reader;
+    };
+
+    std::unique_ptr<TileScan> openScan(const std::string &path)
+    {
+        if (std::filesystem::path(path).extension() == ".pmtiles")
+        {
+            return std::make_unique<PMTilesScan>(path);
+        }
+        return std::make_unique<MBTilesScan>(path);
+    }
+
+    // Sorts the spans by row and merges the overlapping and touching ones.
+    void mergeRowSpans(std::vector<TileRowSpan> &spans)
+    {
+        std::sort(spans.begin(), spans.end(), [](const TileRowSpan &a, const TileRowSpan &b)
+                  { return a.y != b.y ? a.y < b.y : a.x0 < b.x0; });
+
+        size_t merged = 0;
+        for (size_t i = 0; i < spans.size(); i++)
+        {
+            if (merged > 0 && spans[merged - 1].y == spans[i].y && spans[i].x0 <= spans[merged - 1].x1 + 1)
+            {
+                spans[merged - 1].x1 = std::max(spans[merged - 1].x1, spans[i].x1);
+            }
+            else
+            {
+                spans[merged++] = spans[i];
+            }
+        }
+        spans.resize(merged);
+    }
+
+    // Grows [first, last] to whole blocks of `block` tiles.
+    void alignToBlocks(int &first, int &last, int block)
+    {
+        first = first / block * block;
+        last = (last / block + 1) * block - 1;
+    }
+
+} // namespace
+
+SourceDiff diffSourceArchives(const std::string &oldPath, const std::string &newPath)
+{
+    if ((std::filesystem::path(oldPath).extension() == ".pmtiles") != (std::filesystem::path(newPath).extension() == ".pmtiles"))
+    {
+        throw std::runtime_error("both archives have to be MBTiles or both PMTiles");
+    }
+
+    std::unique_ptr<TileScan> before = openScan(oldPath);
+    std::unique_ptr<TileScan> after = openScan(newPath);
+
+    SourceDiff diff;
+    int seenMinZoom = 255;
+    int seenMaxZoom = -1;
+    auto record = [&](const TileScan &tile)
+    {
+        if (static_cast<int>(diff.tiles.size()) <= tile.zoom)
+        {
+            diff.tiles.resize(tile.zoom + 1);
+        }
+        diff.tiles[tile.zoom].emplace_back(tile.x, tile.y);
+    };
+
+    // Both archives are in the same order, so one pass over each finds every
+    // difference without holding either index in memory.
+    bool hasBefore = before->next();
+    bool hasAfter = after->next();
+    while (hasBefore || hasAfter)
+    {
+        const TileScan &current = hasBefore && (!hasAfter || before->key <= after->key) ? *before : *after;
+        seenMinZoom = std::min(seenMinZoom, current.zoom);
+        seenMaxZoom = std::max(seenMaxZoom, current.zoom);
+
+        if (hasBefore && (!hasAfter || before->key < after->key))
+        {
+            diff.removed++;
+            record(*before);
+            hasBefore = before->next();
+        }
+        else if (!hasBefore || after->key < before->key)
+        {
+            diff.added++;
+            record(*after);
+            hasAfter = after->next();
+        }
+        else
+        {
+            if (before->size != after->size || std::memcmp(before->data, after->data, after->size) != 0)
+            {
+                diff.modified++;
+                record(*after);
+            }
+            else
+            {
+                diff.unchanged++;
+            }
+            hasBefore = before->next();
+            hasAfter = after->next();
+        }
+    }
+
+    int oldMinZoom = seenMinZoom, oldMaxZoom = seenMaxZoom;
+    int newMinZoom = seenMinZoom, newMaxZoom = seenMaxZoom;
+    bool oldDeclared = before->zoomRange(oldMinZoom, oldMaxZoom);
+    bool newDeclared = after->zoomRange(newMinZoom, newMaxZoom);
+    if (oldDeclared && newDeclared && (oldMinZoom != newMinZoom || oldMaxZoom != newMaxZoom))
+    {
+        throw std::runtime_error("the zoom range changed from " + std::to_string(oldMinZoom) + "-" + std::to_string(oldMaxZoom) +
+                                 " to " + std::to_string(newMinZoom) + "-" + std::to_string(newMaxZoom) + ", every tile has to be rendered again");
+    }
+    if (newMaxZoom < 0)
+    {
+        throw std::runtime_error("both archives are empty");
+    }
+
+    diff.minZoom = newMinZoom;
+    diff.maxZoom = newMaxZoom;
+    diff.tiles.resize(std::max<size_t>(diff.tiles.size(), newMaxZoom + 1));
+    return diff;
+}
+
+TileCover changedTileCover(const SourceDiff &diff, int maxZoom, int metatile, int pruneZoom, int margin)
+{
+    // The changed source tiles of every zoom as row spans.
+    std::vector<std::vector<TileRowSpan>> sourceSpans(diff.tiles.size());
+    for (size_t zoom = 0; zoom < diff.tiles.size(); zoom++)
+    {
+        for (const auto &[x, y] : diff.tiles[zoom])
+        {
+            sourceSpans[zoom].push_back({y, x, x});
+        }
+        mergeRowSpans(sourceSpans[zoom]);
+    }
+
+    std::vector<std::vector<TileRowSpan>> zooms(maxZoom + 1);
+    for (int zoom = std::max(0, diff.minZoom); zoom <= maxZoom; zoom++)
+    {
+        int sourceZoom = std::min(zoom, diff.maxZoom);
+        if (sourceZoom >= static_cast<int>(sourceSpans.size()))
+        {
+            continue;
+        }
+
+        int shift = zoom - sourceZoom;
+        int lastTile = (1 << zoom) - 1;
+        int block = std::min(metatile, lastTile + 1);
+        for (const TileRowSpan &span : sourceSpans[sourceZoom])
+        {
+            int x0 = std::max(0, (span.x0 << shift) - margin);
+            int x1 = std::min(lastTile, ((span.x1 + 1) << shift) - 1 + margin);
+            int y0 = std::max(0, (span.y << shift) - margin);
+            int y1 = std::min(lastTile, ((span.y + 1) << shift) - 1 + margin);
+            alignToBlocks(x0, x1, block);
+            alignToBlocks(y0, y1, block);
+            for (int y = y0; y <= y1; y++)
+            {
+                zooms[zoom].push_back({y, x0, x1});
+            }
+        }
+        mergeRowSpans(zooms[zoom]);
+    }
+
+    if (pruneZoom >= 0)
+    {
+        for (int zoom = maxZoom; zoom > pruneZoom; zoom--)
+        {
+            int block = std::min(metatile, 1 << (zoom - 1));
+            for (const TileRowSpan &span : zooms[zoom])
+            {
+                int x0 = span.x0 / 2, x1 = span.x1 / 2;
+                int y0 = span.y / 2, y1 = span.y / 2;
+                alignToBlocks(x0, x1, block);
+                alignToBlocks(y0, y1, block);
+                for (int y = y0; y <= y1; y++)
+                {
+                    zooms[zoom - 1].push_back({y, x0, x1});
+                }
+            }
+            mergeRowSpans(zooms[zoom - 1]);
+        }
+    }
+
+    return TileCover::fromRowSpans(std::move(zooms));
+}
@@ -0,0 +1,40 @@
+#ifndef SOURCE_DIFF_HPP
+#define SOURCE_DIFF_HPP
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tile_cover.hpp"
+
+// The tiles that differ between two versions of a vector tile archive.
+struct SourceDiff
+{
+    int minZoom = 0; // zoom range of the source, as declared by the new archive
+    int maxZoom = 0;
+    std::vector<std::vector<std::pair<int, int>>> tiles; // x and XYZ y of the changed tiles, per zoom up to maxZoom
+
+    uint64_t unchanged = 0;
+    uint64_t added = 0;
+    uint64_t removed = 0;
+    uint64_t modified = 0;
+
+    uint64_t changed() const { return added + removed + modified; }
+};
+
+// Steps through two MBTiles or two PMTiles archives side by side in their
+// storage order and compares the stored bytes of every tile. Throws
+// std::runtime_error if they can't be read, are of different types or cover
+// different zoom ranges.
+SourceDiff diffSourceArchives(const std::string &oldPath, const std::string &newPath);
+
+// The raster tiles up to maxZoom that show a changed source tile: a raster
+// zoom shows the source tiles of the same zoom, and those of the source max
+// zoom overzoomed below it. Each is grown by `margin` tiles for labels
+// crossing tile edges and then to whole metatiles. With pruneZoom >= 0 the
+// ancestors of every tile down to pruneZoom are added as well, because
+// subtrees are only entered through their covered parents.
+TileCover changedTileCover(const SourceDiff &diff, int maxZoom, int metatile, int pruneZoom, int margin = 1);
+
+#endif // SOURCE_DIFF_HPP
@@ -0,0 +1,404 @@
+#include "tile_cover.hpp"
+
+#include <mapbox/geojson.hpp>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+
+    struct Edge
+    {
+        double x0, y0, x1, y1; // y0 <= y1
+    };
+
+    struct Interval
+    {
+        double x0, x1;
+    };
+
+    // Appends the x extent of the part of the edge inside [top, bottom].
+    void clipEdge(const Edge &edge, double top, double bottom, std::vector<Interval> &out)
+    {
+        if (edge.y1 < top || edge.y0 > bottom)
+        {
+            return;
+        }
+
+        auto xAt = [&](double y)
+        {
+            if (edge.y1 == edge.y0)
+            {
+                return edge.x0;
+            }
+            return edge.x0 + (edge.x1 - edge.x0) * (y - edge.y0) / (edge.y1 - edge.y0);
+        };
+
+        double a = edge.y0 < top ? xAt(top) : edge.x0;
+        double b = edge.y1 > bottom ? xAt(bottom) : edge.x1;
+        out.push_back({std::min(a, b), std::max(a, b)});
+    }
+
+    // Appends the spans of the horizontal line y that lie inside the rings.
+    void scanline(const std::vector<const Edge *> &edges, double y, std::vector<double> &crossings, std::vector<Interval> &out)
+    {
+        crossings.clear();
+        for (const Edge *edge : edges)
+        {
+            // Half-open in y, so a vertex shared by two edges is counted once.
+            if (edge->y0 <= y && y < edge->y1)
+            {
+                crossings.push_back(edge->x0 + (edge->x1 - edge->x0) * (y - edge->y0) / (edge->y1 - edge->y0));
+            }
+        }
+        std::sort(crossings.begin(), crossings.end());
+        for (size_t i = 0; i + 1 < crossings.size(); i += 2)
+        {
+            out.push_back({crossings[i], crossings[i + 1]});
+        }
+    }
+
+} // namespace
+
+WorldPoint projectLonLat(double lon, double lat)
+{
+    constexpr double maxLatitude = 85.051128779806604;
+    lat = std::clamp(lat, -maxLatitude, maxLatitude);
+    double sinLat = std::sin(lat * M_PI / 180.0);
+    return {
+        (lon + 180.0) / 360.0,
+        0.5 - std::log((1.0 + sinLat) / (1.0 - sinLat)) / (4.0 * M_PI)};
+}
+
+TileCover TileCover::fromRings(const std::vector<WorldRing> &rings, int maxZoom)
+{
+    TileCover cover;
+
+    for (int zoom = 0; zoom <= maxZoom; zoom++)
+    {
+        const double scale = static_cast<double>(1 << zoom);
+        const int lastTile = (1 << zoom) - 1;
+
+        std::vector<Edge> edges;
+        double minY = scale, maxY = 0;
+        for (const WorldRing &ring : rings)
+        {
+            for (size_t i = 0; i < ring.size(); i++)
+            {
+                WorldPoint a = ring[i];
+                WorldPoint b = ring[(i + 1) % ring.size()];
+                Edge edge{a.x * scale, a.y * scale, b.x * scale, b.y * scale};
+                if (edge.y0 > edge.y1)
+                {
+                    std::swap(edge.x0, edge.x1);
+                    std::swap(edge.y0, edge.y1);
+                }
+                minY = std::min(minY, edge.y0);
+                maxY = std::max(maxY, edge.y1);
+                edges.push_back(edge);
+            }
+        }
+
+        ZoomCover &level = cover.zooms.emplace_back();
+        if (edges.empty())
+        {
+            continue;
+        }
+
+        std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b)
+                  { return a.y0 < b.y0; });
+
+        int firstRow = std::clamp(static_cast<int>(std::floor(minY)), 0, lastTile);
+        int lastRow = std::clamp(static_cast<int>(std::ceil(maxY)) - 1, firstRow, lastTile);
+
+        level.bounds = {lastTile + 1, firstRow, 0, lastRow + 1};
+        level.rowOffsets.push_back(0);
+
+        // Sweep the rows top to bottom, keeping only the edges that reach the
+        // current row band in the active list.
+        std::vector<const Edge *> active;
+        std::vector<Interval> intervals;
+        std::vector<double> crossings;
+        size_t nextEdge = 0;
+
+        for (int row = firstRow; row <= lastRow; row++)
+        {
+            double top = row;
+            double bottom = row + 1;
+
+            while (nextEdge < edges.size() && edges[nextEdge].y0 <= bottom)
+            {
+                active.push_back(&edges[nextEdge++]);
+            }
+            active.erase(std::remove_if(active.begin(), active.end(), [&](const Edge *edge)
+                                        { return edge->y1 < top; }),
+                         active.end());
+
+            // The area inside the band projects onto the edges clipped to it
+            // plus the inside spans of its top and bottom lines.
+            intervals.clear();
+            for (const Edge *edge : active)
+            {
+                clipEdge(*edge, top, bottom, intervals);
+            }
+            scanline(active, top, crossings, intervals);
+            scanline(active, bottom, crossings, intervals);
+
+            std::sort(intervals.begin(), intervals.end(), [](const Interval &a, const Interval &b)
+                      { return a.x0 < b.x0; });
+
+            for (const Interval &interval : intervals)
+            {
+                int x0 = std::clamp(static_cast<int>(std::floor(interval.x0)), 0, lastTile);
+                int x1 = std::clamp(static_cast<int>(std::ceil(interval.x1)) - 1, x0, lastTile);
+
+                size_t rowStart = level.rowOffsets.back();
+                if (level.spans.size() > rowStart && x0 <= level.spans.back().x1 + 1)
+                {
+                    level.spans.back().x1 = std::max(level.spans.back().x1, x1);
+                }
+                else
+                {
+                    level.spans.push_back({x0, x1});
+                }
+            }
+
+            for (size_t i = level.rowOffsets.back(); i < level.spans.size(); i++)
+            {
+                level.tiles += level.spans[i].x1 - level.spans[i].x0 + 1;
+                level.bounds.x0 = std::min(level.bounds.x0, level.spans[i].x0);
+                level.bounds.x1 = std::max(level.bounds.x1, level.spans[i].x1 + 1);
+            }
+            level.rowOffsets.push_back(static_cast<uint32_t>(level.spans.size()));
+        }
+    }
+
+    return cover;
+}
+
+TileCover TileCover::fromBBox(double minLon, double minLat, double maxLon, double maxLat, int maxZoom)
+{
+    auto box = [](double west, double south, double east, double north)
+    {
+        WorldPoint nw = projectLonLat(west, north);
+        WorldPoint se = projectLonLat(east, south);
+        return WorldRing{{nw.x, nw.y}, {se.x, nw.y}, {se.x, se.y}, {nw.x, se.y}};
+    };
+
+    std::vector<WorldRing> rings;
+    if (minLon <= maxLon)
+    {
+        rings.push_back(box(minLon, minLat, maxLon, maxLat));
+    }
+    else
+    {
+        rings.push_back(box(minLon, minLat, 180.0, maxLat));
+        rings.push_back(box(-180.0, minLat, maxLon, maxLat));
+    }
+    return fromRings(rings, maxZoom);
+}
+
+TileCover TileCover::fromGeoJSON(const std::string &path, int maxZoom)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("can't open " + path);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+
+    std::vector<WorldRing> rings;
+    auto addPolygon = [&](const mapbox::geometry::polygon<double> &polygon)
+    {
+        for (const auto &ring : polygon)
+        {
+            WorldRing &out = rings.emplace_back();
+            for (const auto &point : ring)
+            {
+                out.push_back(projectLonLat(point.x, point.y));
+            }
+        }
+    };
+
+    std::function<void(const mapbox::geometry::geometry<double> &)> addGeometry = [&](const mapbox::geometry::geometry<double> &geometry)
+    {
+        if (geometry.is<mapbox::geometry::polygon<double>>())
+        {
+            addPolygon(geometry.get<mapbox::geometry::polygon<double>>());
+        }
+        else if (geometry.is<mapbox::geometry::multi_polygon<double>>())
+        {
+            for (const auto &polygon : geometry.get<mapbox::geometry::multi_polygon<double>>())
+            {
+                addPolygon(polygon);
+            }
+        }
+        else if (geometry.is<mapbox::geometry::geometry_collection<double>>())
+        {
+            for (const auto &child : geometry.get<mapbox::geometry::geometry_collection<double>>())
+            {
+                addGeometry(child);
+            }
+        }
+    };
+
+    mapbox::geojson::geojson geojson = mapbox::geojson::parse(buffer.str());
+    if (geojson.is<mapbox::geojson::geometry>())
+    {
+        addGeometry(geojson.get<mapbox::geojson::geometry>());
+    }
+    else if (geojson.is<mapbox::geojson::feature>())
+    {
+        addGeometry(geojson.get<mapbox::geojson::feature>().geometry);
+    }
+    else
+    {
+        for (const auto &feature : geojson.get<mapbox::geojson::feature_collection>())
+        {
+            addGeometry(feature.geometry);
+        }
+    }
+
+    if (rings.empty())
+    {
+        throw std::runtime_error(path + " contains no Polygon or MultiPolygon geometry");
+    }
+    return fromRings(rings, maxZoom);
+}
+
+TileCover TileCover::fromRowSpans(std::vector<std::vector<TileRowSpan>> zooms)
+{
+    TileCover cover;
+
+    for (std::vector<TileRowSpan> &rowSpans : zooms)
+    {
+        ZoomCover &level = cover.zooms.emplace_back();
+        if (rowSpans.empty())
+        {
+            continue;
+        }
+
+        std::sort(rowSpans.begin(), rowSpans.end(), [](const TileRowSpan &a, const TileRowSpan &b)
+                  { return a.y != b.y ? a.y < b.y : a.x0 < b.x0; });
+
+        int firstRow = rowSpans.front().y;
+        int lastRow = rowSpans.back().y;
+        level.bounds = {rowSpans.front().x0, firstRow, 0, lastRow + 1};
+        level.rowOffsets.assign(lastRow - firstRow + 2, 0);
+
+        // Overlapping and touching spans of a row are merged; rows without
+        // spans get an empty range.
+        int row = firstRow;
+        for (const TileRowSpan &span : rowSpans)
+        {
+            for (; row < span.y; row++)
+            {
+                level.rowOffsets[row - firstRow + 1] = static_cast<uint32_t>(level.spans.size());
+            }
+
+            size_t rowStart = level.rowOffsets[row - firstRow];
+            if (level.spans.size() > rowStart && span.x0 <= level.spans.back().x1 + 1)
+            {
+                level.spans.back().x1 = std::max(level.spans.back().x1, span.x1);
+            }
+            else
+            {
+                level.spans.push_back({span.x0, span.x1});
+            }
+        }
+        level.rowOffsets[lastRow - firstRow + 1] = static_cast<uint32_t>(level.spans.size());
+
+        for (const Span &span : level.spans)
+        {
+            level.tiles += span.x1 - span.x0 + 1;
+            level.bounds.x0 = std::min(level.bounds.x0, span.x0);
+            level.bounds.x1 = std::max(level.bounds.x1, span.x1 + 1);
+        }
+    }
+
+    return cover;
+}
+
+bool TileCover::contains(int zoom, int x, int y) const
+{
+    return intersects(zoom, {x, y, x + 1, y + 1});
+}
+
+bool TileCover::intersects(int zoom, const TileRange &range) const
+{
+    if (isWorld())
+    {
+        return true;
+    }
+
+    const ZoomCover &level = zooms[zoom];
+    int y0 = std::max(range.y0, level.bounds.y0);
+    int y1 = std::min(range.y1, level.bounds.y1);
+
+    for (int y = y0; y < y1; y++)
+    {
+        auto first = level.spans.begin() + level.rowOffsets[y - level.bounds.y0];
+        auto last = level.spans.begin() + level.rowOffsets[y - level.bounds.y0 + 1];
+
+        // First span that does not end left of the range.
+        auto span = std::lower_bound(first, last, range.x0, [](const Span &span, int x)
+                                     { return span.x1 < x; });
+        if (span != last && span->x0 < range.x1)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+TileRange TileCover::bounds(int zoom) const
+{
+    if (isWorld())
+    {
+        return {0, 0, 1 << zoom, 1 << zoom};
+    }
+    return zooms[zoom].bounds;
+}
+
+uint64_t TileCover::tileCount(int zoom) const
+{
+    if (isWorld())
+    {
+        return uint64_t(1) << (2 * zoom);
+    }
+    return zooms[zoom].tiles;
+}
+
+uint64_t TileCover::tileCount(int zoom, const TileRange &range) const
+{
+    if (isWorld())
+    {
+        int side = 1 << zoom;
+        uint64_t columns = std::max(0, std::min(range.x1, side) - std::max(range.x0, 0));
+        uint64_t rows = std::max(0, std::min(range.y1, side) - std::max(range.y0, 0));
+        return columns * rows;
+    }
+
+    const ZoomCover &level = zooms[zoom];
+    int y0 = std::max(range.y0, level.bounds.y0);
+    int y1 = std::min(range.y1, level.bounds.y1);
+
+    uint64_t tiles = 0;
+    for (int y = y0; y < y1; y++)
+    {
+        auto first = level.spans.begin() + level.rowOffsets[y - level.bounds.y0];
+        auto last = level.spans.begin() + level.rowOffsets[y - level.bounds.y0 + 1];
+        auto span = std::lower_bound(first, last, range.x0, [](const Span &span, int x)
+                                     { return span.x1 < x; });
+        for (; span != last && span->x0 < range.x1; span++)
+        {
+            tiles += std::min(span->x1 + 1, range.x1) - std::max(span->x0, range.x0);
+        }
+    }
+    return tiles;
+}
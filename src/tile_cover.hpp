@@ -0,0 +1,95 @@
+#ifndef TILE_COVER_HPP
+#define TILE_COVER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A half-open rectangle of tiles [x0, x1) x [y0, y1).
+struct TileRange
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+
+    bool empty() const { return x0 >= x1 || y0 >= y1; }
+};
+
+// A point in normalized Web Mercator coordinates: x and y run from 0 to 1,
+// west to east and north to south.
+struct WorldPoint
+{
+    double x;
+    double y;
+};
+
+// Rings are closed implicitly. All rings of all polygons are filled with the
+// even-odd rule, so holes and multipolygons need no special treatment.
+using WorldRing = std::vector<WorldPoint>;
+
+// The tiles x0 to x1 (inclusive) of row y.
+struct TileRowSpan
+{
+    int y;
+    int x0;
+    int x1;
+};
+
+// The exact set of tiles touched by an area, per zoom level, stored as sorted
+// column spans for every row the area reaches. Memory grows with the number
+// of rows and edge crossings, not with the number of tiles.
+class TileCover
+{
+public:
+    // Covers the whole world.
+    TileCover() = default;
+
+    static TileCover fromRings(const std::vector<WorldRing> &rings, int maxZoom);
+
+    // minLon > maxLon describes a box across the antimeridian.
+    static TileCover fromBBox(double minLon, double minLat, double maxLon, double maxLat, int maxZoom);
+
+    // Reads the Polygon and MultiPolygon geometries of a GeoJSON file.
+    static TileCover fromGeoJSON(const std::string &path, int maxZoom);
+
+    // One list of spans per zoom level, in any order and possibly
+    // overlapping.
+    static TileCover fromRowSpans(std::vector<std::vector<TileRowSpan>> zooms);
+
+    bool isWorld() const { return zooms.empty(); }
+
+    bool contains(int zoom, int x, int y) const;
+
+    // True if any tile of the range is covered.
+    bool intersects(int zoom, const TileRange &range) const;
+
+    // Smallest range holding every covered tile of the zoom level.
+    TileRange bounds(int zoom) const;
+
+    uint64_t tileCount(int zoom) const;
+
+    // Covered tiles of the zoom level inside the range.
+    uint64_t tileCount(int zoom, const TileRange &range) const;
+
+private:
+    struct Span
+    {
+        int x0; // inclusive
+        int x1; // inclusive
+    };
+
+    struct ZoomCover
+    {
+        TileRange bounds{0, 0, 0, 0};
+        std::vector<uint32_t> rowOffsets; // spans of row bounds.y0 + i are [rowOffsets[i], rowOffsets[i + 1])
+        std::vector<Span> spans;
+        uint64_t tiles = 0;
+    };
+
+    std::vector<ZoomCover> zooms;
+};
+
+WorldPoint projectLonLat(double lon, double lat);
+
+#endif // TILE_COVER_HPP
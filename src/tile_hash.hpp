@@ -0,0 +1,34 @@
+#ifndef TILE_HASH_HPP
+#define TILE_HASH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// XXH64 of `size` bytes.
+uint64_t xxhash64(const void *data, size_t size, uint64_t seed = 0);
+
+// 128 bits from two differently seeded XXH64 passes over a tile, the
+// content id in binary. Hashable, for sets of tiles kept in memory.
+struct TileHash
+{
+    uint64_t high;
+    uint64_t low;
+
+    bool operator==(const TileHash &other) const = default;
+};
+
+struct TileHashHasher
+{
+    size_t operator()(const TileHash &hash) const { return static_cast<size_t>(hash.high ^ hash.low); }
+};
+
+TileHash tileContentHash(const void *data, size_t size);
+
+// Content id for a tile: its TileHash as 32 lowercase hex characters.
+std::string tileContentId(const void *data, size_t size);
+
+// Same, written into `id`, which keeps its buffer from one call to the next.
+void tileContentId(const void *data, size_t size, std::string &id);
+
+#endif // TILE_HASH_HPP
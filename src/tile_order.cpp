@@ -0,0 +1,78 @@
+#include "tile_order.hpp"
+
+#include <stdexcept>
+#include <utility>
+
+TileOrder parseTileOrder(const std::string &name)
+{
+    if (name == "row")
+    {
+        return TileOrder::Row;
+    }
+    if (name == "zorder")
+    {
+        return TileOrder::ZOrder;
+    }
+    if (name == "hilbert")
+    {
+        return TileOrder::Hilbert;
+    }
+    throw std::invalid_argument("Unknown order '" + name + "'. Choose 'row', 'zorder' or 'hilbert'.");
+}
+
+std::string tileOrderString(TileOrder order)
+{
+    switch (order)
+    {
+    case TileOrder::Row:
+        return "row";
+    case TileOrder::ZOrder:
+        return "zorder";
+    case TileOrder::Hilbert:
+        return "hilbert";
+    }
+    return "unknown";
+}
+
+void orderPosition(TileOrder order, uint32_t side, uint64_t d, uint32_t &x, uint32_t &y)
+{
+    x = 0;
+    y = 0;
+
+    if (order == TileOrder::Row)
+    {
+        x = static_cast<uint32_t>(d % side);
+        y = static_cast<uint32_t>(d / side);
+        return;
+    }
+
+    if (order == TileOrder::ZOrder)
+    {
+        // Even bits are x, odd bits are y.
+        for (int bit = 0; bit < 32; bit++)
+        {
+            x |= static_cast<uint32_t>((d >> (2 * bit)) & 1) << bit;
+            y |= static_cast<uint32_t>((d >> (2 * bit + 1)) & 1) << bit;
+        }
+        return;
+    }
+
+    // The classic d2xy walk from the smallest quadrant up.
+    for (uint64_t s = 1; s < side; s *= 2)
+    {
+        uint32_t rx = static_cast<uint32_t>(1 & (d / 2));
+        uint32_t ry = static_cast<uint32_t>(1 & (d ^ rx));
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = static_cast<uint32_t>(s - 1 - x);
+                y = static_cast<uint32_t>(s - 1 - y);
+            }
+            std::swap(x, y);
+        }
+        x += static_cast<uint32_t>(s * rx);
+        y += static_cast<uint32_t>(s * ry);
+        d /= 4;
+    }
+}
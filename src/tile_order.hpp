@@ -0,0 +1,26 @@
+#ifndef TILE_ORDER_HPP
+#define TILE_ORDER_HPP
+
+#include <cstdint>
+#include <string>
+
+// Order in which the chunks of a zoom level, and the blocks inside a chunk,
+// are rendered. Along a space-filling curve consecutive renders are nearly
+// always neighbours, so they need the same vector source tiles.
+enum class TileOrder
+{
+    Row,     // row by row, left to right
+    ZOrder,  // Morton order, quadrant by quadrant
+    Hilbert, // Hilbert curve, which never jumps between distant quadrants
+};
+
+// Accepts "row", "zorder" and "hilbert". Throws std::invalid_argument.
+TileOrder parseTileOrder(const std::string &name);
+
+std::string tileOrderString(TileOrder order);
+
+// Position of the d-th cell in `order` on a side x side grid. `side` has to
+// be a power of two except for TileOrder::Row.
+void orderPosition(TileOrder order, uint32_t side, uint64_t d, uint32_t &x, uint32_t &y);
+
+#endif // TILE_ORDER_HPP
@@ -0,0 +1,193 @@
+#include "tile_scheduler.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sys/mman.h>
+
+static uint64_t steadyNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+TileScheduler::TileScheduler(const std::vector<ScheduleLevel> &levels, int numWorkers, std::vector<uint64_t> completed,
+                             TileOrder order, TileShard shard)
+    : levels(levels), completed(std::move(completed)), order(order), shard(std::move(shard)), numWorkers(numWorkers)
+{
+    levelOffsets.push_back(0);
+    cursorOffsets.push_back(0);
+    for (const ScheduleLevel &level : levels)
+    {
+        uint64_t columns = (level.area.x1 - level.area.x0) / level.chunkSide;
+        uint64_t rows = (level.area.y1 - level.area.y0) / level.chunkSide;
+        levelOffsets.push_back(levelOffsets.back() + columns * rows);
+
+        // The curves walk power of two squares, as large as the short side of
+        // the level, laid out along its long side. Positions outside the level
+        // are skipped in next().
+        uint64_t side = 1;
+        while (side < std::min(columns, rows))
+        {
+            side *= 2;
+        }
+        uint64_t squares = (std::max(columns, rows) + side - 1) / side;
+        curveSides.push_back(static_cast<uint32_t>(side));
+        cursorOffsets.push_back(cursorOffsets.back() + (order == TileOrder::Row ? columns * rows : squares * side * side));
+    }
+
+    stateSize = sizeof(SharedState) + sizeof(WorkerStats) * numWorkers;
+    void *memory = mmap(nullptr, stateSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        std::cerr << "Failed to allocate shared scheduler state" << std::endl;
+        exit(1);
+    }
+
+    // The mapping is zero-filled, which is a valid initial state for the atomics.
+    state = static_cast<SharedState *>(memory);
+    state->startNanoseconds = steadyNanoseconds();
+}
+
+TileScheduler::~TileScheduler()
+{
+    munmap(state, stateSize);
+}
+
+bool TileScheduler::next(TileChunk &chunk)
+{
+    while (true)
+    {
+        uint64_t position = state->cursor.fetch_add(1, std::memory_order_relaxed);
+        if (position >= cursorOffsets.back())
+        {
+            return false;
+        }
+
+        size_t level = std::upper_bound(cursorOffsets.begin(), cursorOffsets.end(), position) - cursorOffsets.begin() - 1;
+        const TileRange &area = levels[level].area;
+        int side = levels[level].chunkSide;
+        uint64_t columns = (area.x1 - area.x0) / side;
+        uint64_t rows = (area.y1 - area.y0) / side;
+
+        uint64_t local = position - cursorOffsets[level];
+        uint64_t cx = local % columns;
+        uint64_t cy = local / columns;
+        if (order != TileOrder::Row)
+        {
+            uint64_t side = curveSides[level];
+            uint64_t square = local / (side * side);
+            uint32_t sx, sy;
+            orderPosition(order, curveSides[level], local % (side * side), sx, sy);
+            cx = sx + (columns >= rows ? square * side : 0);
+            cy = sy + (columns >= rows ? 0 : square * side);
+            if (cx >= columns || cy >= rows)
+            {
+                continue;
+            }
+        }
+
+        uint64_t index = levelOffsets[level] + cy * columns + cx;
+        if (std::binary_search(completed.begin(), completed.end(), index))
+        {
+            continue;
+        }
+
+        int x0 = area.x0 + static_cast<int>(cx) * side;
+        int y0 = area.y0 + static_cast<int>(cy) * side;
+        if (!shard.owns(levels[level].zoom, x0, y0))
+        {
+            continue;
+        }
+
+        chunk.index = index;
+        chunk.zoom = levels[level].zoom;
+        chunk.x0 = x0;
+        chunk.y0 = y0;
+        chunk.x1 = chunk.x0 + side;
+        chunk.y1 = chunk.y0 + side;
+        return true;
+    }
+}
+
+WorkerStats *TileScheduler::workers() const
+{
+    // The worker counters follow the shared header in the same mapping.
+    return reinterpret_cast<WorkerStats *>(state + 1);
+}
+
+WorkerStats &TileScheduler::worker(int workerId)
+{
+    return workers()[workerId];
+}
+
+uint64_t TileScheduler::elapsed() const
+{
+    return steadyNanoseconds() - state->startNanoseconds;
+}
+
+void TileScheduler::printUtilization(std::ostream &out) const
+{
+    double wall = elapsed() / 1e9;
+
+    uint64_t uniformTiles = 0;
+    uint64_t prunedTiles = 0;
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t tiles = 0;
+    uint64_t sourceRequests = 0;
+    uint64_t sourceCacheHits = 0;
+
+    out << "Worker utilization (" << levelOffsets.back() - completed.size() << " chunks";
+    if (!completed.empty())
+    {
+        out << ", " << completed.size() << " done by an earlier run";
+    }
+    out << "):" << std::endl;
+    for (int id = 0; id < numWorkers; id++)
+    {
+        const WorkerStats &stats = workers()[id];
+        uniformTiles += stats.uniformTiles.load();
+        prunedTiles += stats.prunedTiles.load();
+        cacheHits += stats.cacheHits.load();
+        cacheMisses += stats.cacheMisses.load();
+        tiles += stats.tiles.load();
+        sourceRequests += stats.sourceRequests.load();
+        sourceCacheHits += stats.sourceCacheHits.load();
+        double busy = stats.busyNanoseconds.load() / 1e9;
+        double finished = stats.finishedNanoseconds.load() / 1e9;
+
+        out << "  worker " << std::setw(3) << id
+            << ": " << std::setw(9) << stats.tiles.load() << " tiles, "
+            << std::setw(7) << stats.chunks.load() << " chunks, busy "
+            << std::fixed << std::setprecision(1) << busy << "s, done after "
+            << finished << "s, utilization "
+            << (wall > 0 ? 100.0 * busy / wall : 0.0) << "%" << std::endl;
+    }
+    out << std::defaultfloat;
+
+    if (uniformTiles > 0 || prunedTiles > 0)
+    {
+        out << "Uniform tiles: " << uniformTiles << " (encoded once per colour), "
+            << prunedTiles << " tiles below them copied without rendering" << std::endl;
+    }
+
+    if (cacheHits > 0 || cacheMisses > 0)
+    {
+        out << "Resource cache: " << cacheHits << " hits, " << cacheMisses << " misses ("
+            << std::fixed << std::setprecision(1) << 100.0 * cacheHits / (cacheHits + cacheMisses) << "% hit rate)"
+            << std::defaultfloat << std::endl;
+    }
+
+    if (sourceRequests > 0)
+    {
+        out << "Source tiles: " << sourceRequests << " requests, "
+            << std::fixed << std::setprecision(2) << (tiles > 0 ? static_cast<double>(sourceRequests) / tiles : 0.0)
+            << " per rendered tile, " << sourceCacheHits << " ("
+            << std::setprecision(1) << 100.0 * sourceCacheHits / sourceRequests << "%) served from memory"
+            << std::defaultfloat << std::endl;
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef TILE_SCHEDULER_HPP
+#define TILE_SCHEDULER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "run_metrics.hpp"
+#include "tile_cover.hpp"
+#include "tile_order.hpp"
+#include "tile_shard.hpp"
+
+// A rectangle of tiles [x0, x1) x [y0, y1) at a single zoom level.
+struct TileChunk
+{
+    uint64_t index; // position in the schedule, stable across runs with the same levels
+    int zoom;
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+// One zoom level of the schedule: the area, aligned to chunkSide, cut into
+// square chunks of chunkSide tiles.
+struct ScheduleLevel
+{
+    int zoom;
+    int chunkSide;
+    TileRange area;
+};
+
+// Per-worker counters, written only by the owning worker.
+struct WorkerStats
+{
+    std::atomic<uint64_t> tiles;
+    std::atomic<uint64_t> chunks;
+    std::atomic<uint64_t> uniformTiles;
+    std::atomic<uint64_t> prunedTiles;
+    std::atomic<uint64_t> cacheHits;
+    std::atomic<uint64_t> cacheMisses;
+    std::atomic<uint64_t> sourceRequests;  // vector source tiles asked for by the renderer
+    std::atomic<uint64_t> sourceCacheHits; // of those, answered from the in-memory cache
+    std::atomic<uint64_t> busyNanoseconds;
+    std::atomic<uint64_t> finishedNanoseconds;
+    StageHistograms stages; // render and encode times of every zoom
+};
+
+// Hands out square chunks of tiles to the workers on demand, level by level,
+// in `order` within every level. The cursor and the worker counters live in an
+// anonymous shared mapping, so the scheduler has to be created before the
+// workers are forked.
+class TileScheduler
+{
+public:
+    // Chunks listed in `completed` (sorted) are never handed out, which is how
+    // a resumed run skips the work of an earlier one.
+    // Chunk indices are row by row whatever the order, so they stay valid for
+    // a resumed run with a different order.
+    // Chunks of other shards are skipped the same way.
+    TileScheduler(const std::vector<ScheduleLevel> &levels, int numWorkers, std::vector<uint64_t> completed = {},
+                  TileOrder order = TileOrder::Row, TileShard shard = {});
+    ~TileScheduler();
+
+    TileScheduler(const TileScheduler &) = delete;
+    TileScheduler &operator=(const TileScheduler &) = delete;
+
+    // Claims the next chunk. Returns false once all chunks are handed out.
+    bool next(TileChunk &chunk);
+
+    uint64_t chunkCount() const { return levelOffsets.back(); }
+
+    WorkerStats &worker(int workerId);
+
+    // Nanoseconds since the scheduler was created.
+    uint64_t elapsed() const;
+
+    void printUtilization(std::ostream &out) const;
+
+private:
+    struct SharedState
+    {
+        std::atomic<uint64_t> cursor;
+        uint64_t startNanoseconds;
+    };
+
+    WorkerStats *workers() const;
+
+    std::vector<ScheduleLevel> levels;
+    std::vector<uint64_t> levelOffsets;  // first chunk index of every level, plus the total
+    std::vector<uint32_t> curveSides;    // side of the squares the order walks on every level
+    std::vector<uint64_t> cursorOffsets; // first cursor position of every level, plus the total
+    std::vector<uint64_t> completed;
+    TileOrder order;
+    TileShard shard;
+    int numWorkers;
+    SharedState *state;
+    size_t stateSize;
+};
+
+#endif // TILE_SCHEDULER_HPP
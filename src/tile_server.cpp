@@ -0,0 +1,802 @@
+#include "tile_server.hpp"
+
+#include <mbgl/util/run_loop.hpp>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "connection_pool.hpp"
+#include "mbtiles.hpp"
+#include "run_metrics.hpp"
+#include "tile_scheduler.hpp"
+
+namespace
+{
+
+    std::atomic<bool> stopRequested{false};
+
+    void requestStop(int)
+    {
+        stopRequested = true;
+    }
+
+    // A tile of one output, XYZ. Blocks use output -1 and their north-west
+    // tile.
+    struct TileKey
+    {
+        int output;
+        int zoom;
+        int x;
+        int y;
+
+        bool operator==(const TileKey &other) const = default;
+    };
+
+    struct TileKeyHash
+    {
+        size_t operator()(const TileKey &key) const
+        {
+            uint64_t position = (uint64_t(key.zoom) << 58) ^ (uint64_t(key.x) << 29) ^ uint64_t(key.y);
+            return std::hash<uint64_t>()(position * 31 + static_cast<uint64_t>(key.output + 1));
+        }
+    };
+
+    using EncodedTile = std::shared_ptr<const std::string>;
+
+    // Encoded tiles, least recently used evicted first once they take more
+    // than maxBytes.
+    class EncodedTileCache
+    {
+    public:
+        explicit EncodedTileCache(size_t maxBytes) : maxBytes(maxBytes) {}
+
+        EncodedTile get(const TileKey &key)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = index.find(key);
+            if (found == index.end())
+            {
+                return nullptr;
+            }
+            entries.splice(entries.begin(), entries, found->second);
+            return found->second->second;
+        }
+
+        void put(const TileKey &key, EncodedTile tile)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = index.find(key);
+            if (found != index.end())
+            {
+                usedBytes -= found->second->second->size();
+                entries.erase(found->second);
+                index.erase(found);
+            }
+
+            usedBytes += tile->size();
+            entries.emplace_front(key, std::move(tile));
+            index[key] = entries.begin();
+            while (usedBytes > maxBytes && !entries.empty())
+            {
+                usedBytes -= entries.back().second->size();
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+        }
+
+        size_t tiles()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return entries.size();
+        }
+
+        size_t bytes()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return usedBytes;
+        }
+
+    private:
+        std::mutex mutex;
+        std::list<std::pair<TileKey, EncodedTile>> entries; // most recently used first
+        std::unordered_map<TileKey, decltype(entries)::iterator, TileKeyHash> index;
+        size_t usedBytes = 0;
+        size_t maxBytes;
+    };
+
+    // The render of one metatile. Every request for a tile of it waits for
+    // the same flight.
+    struct Flight
+    {
+        TileKey block;
+        std::mutex mutex;
+        std::condition_variable landed;
+        bool finished = false;
+        bool failed = false;
+        std::unordered_map<TileKey, EncodedTile, TileKeyHash> tiles; // complete once finished
+    };
+
+    struct WriteBackTile
+    {
+        int output;
+        int zoom;
+        int x;
+        int tmsY;
+        EncodedTile data;
+    };
+
+    // How a request was answered.
+    enum class Outcome
+    {
+        Hit,    // from the cache
+        Miss,   // started a render
+        Shared, // waited for a render started by another request
+        Other,  // stats, errors, tiles outside the area
+    };
+
+    // Zero-filled on creation, like the worker stats.
+    struct ServerStats
+    {
+        std::atomic<uint64_t> requests;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> shared;
+        std::atomic<uint64_t> notFound;
+        std::atomic<uint64_t> errors;
+        std::atomic<uint64_t> renders;
+        StageHistogram latency;
+        StageHistogram hitLatency;
+        StageHistogram missLatency;
+        StageHistogram sharedLatency;
+        StageHistogram renderTime;
+    };
+
+    std::string contentType(ImageFormat format)
+    {
+        switch (format)
+        {
+        case ImageFormat::PNG:
+            return "image/png";
+        case ImageFormat::JPEG:
+            return "image/jpeg";
+        default:
+            return "image/webp";
+        }
+    }
+
+    bool parseInt(const std::string &text, int &value)
+    {
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+        return error == std::errc() && end == text.data() + text.size();
+    }
+
+    std::string lowercase(std::string text)
+    {
+        std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c)
+                       { return static_cast<char>(std::tolower(c)); });
+        return text;
+    }
+
+    class TileServer
+    {
+    public:
+        TileServer(const RenderOptions &options, const ServeOptions &serve)
+            : options(options),
+              serve(serve),
+              cache(serve.cacheBytes),
+              stats(std::make_unique<ServerStats>())
+        {
+            for (int id = 0; id < serve.workers; id++)
+            {
+                workerStats.push_back(std::make_unique<WorkerStats>());
+            }
+        }
+
+        int run()
+        {
+            int listenFd = openListener();
+            if (listenFd < 0)
+            {
+                return 1;
+            }
+
+            for (size_t output = 0; output < serve.writeBackPaths.size(); output++)
+            {
+                const std::string &path = serve.writeBackPaths[output];
+                bool deduplicate = serve.deduplicate;
+                if (std::filesystem::exists(path))
+                {
+                    deduplicate = isDeduplicatedMBTiles(path.c_str());
+                }
+                else
+                {
+                    createMBTilesDatabase(path.c_str(), outputFormat(options, output), deduplicate);
+                }
+                writers.push_back(std::make_unique<MBTilesWriter>(path.c_str(), deduplicate));
+            }
+            std::thread writeBackThread;
+            if (!writers.empty())
+            {
+                writeBackThread = std::thread([this]
+                                              { writeBackLoop(); });
+            }
+
+            // One copy of the style resources and source tiles for all
+            // renderers, as with --threads.
+            registerFileSources(options, true);
+
+            std::cout << "Warming up " << serve.workers << " renderers..." << std::endl;
+            std::vector<std::thread> renderThreads;
+            for (int id = 0; id < serve.workers; id++)
+            {
+                renderThreads.emplace_back([this, id]
+                                           { renderLoop(id); });
+            }
+
+            std::string warmupError;
+            {
+                std::unique_lock<std::mutex> lock(warmupMutex);
+                warmupDone.wait(lock, [this]
+                                { return warmedUp == serve.workers; });
+                warmupError = firstWarmupError;
+            }
+
+            if (warmupError.empty())
+            {
+                std::string ext;
+                for (ImageFormat format : options.imageFormats)
+                {
+                    ext += (ext.empty() ? "" : ",") + imageString(format);
+                }
+                if (options.imageFormats.size() > 1)
+                {
+                    ext = "{" + ext + "}";
+                }
+                std::cout << "Serving http://" << serve.address << ":" << serve.port << "/{z}/{x}/{y}." << ext
+                          << (options.tileSizes.size() > 1 ? " and /{size}/{z}/{x}/{y}." + ext : "")
+                          << " up to zoom " << options.maxZoom << ", stats at /stats (tile cache "
+                          << (serve.cacheBytes >> 20) << " MB)" << std::endl;
+                ConnectionPool connections(serve.connectionThreads, idleSeconds, [this](int fd, const std::string &head)
+                                           { return handleRequest(fd, head); });
+                connections.serve(listenFd, stopRequested);
+                std::cout << "Shutting down..." << std::endl;
+            }
+            else
+            {
+                std::cerr << "Error: Can't render with this style: " << warmupError << std::endl;
+            }
+            close(listenFd);
+
+            // The connections are closed by now, so no new renders are asked
+            // for. The renderers go first and then the write-back of what
+            // they rendered.
+            {
+                std::lock_guard<std::mutex> lock(flightMutex);
+                renderStopping = true;
+            }
+            jobReady.notify_all();
+            for (std::thread &thread : renderThreads)
+            {
+                thread.join();
+            }
+
+            if (writeBackThread.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(writeBackMutex);
+                    writeBackStopping = true;
+                }
+                writeBackReady.notify_all();
+                writeBackThread.join();
+                for (size_t output = 0; output < writers.size(); output++)
+                {
+                    writers[output]->finish();
+                    std::cout << "Stored " << writers[output]->tileCount() << " rendered tiles in " << serve.writeBackPaths[output] << "." << std::endl;
+                }
+                writers.clear();
+            }
+
+            printSummary(std::cout);
+            return warmupError.empty() ? 0 : 1;
+        }
+
+    private:
+        struct Job
+        {
+            std::shared_ptr<Flight> flight;
+        };
+
+        int openListener()
+        {
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(static_cast<uint16_t>(serve.port));
+            if (inet_pton(AF_INET, serve.address.c_str(), &address.sin_addr) != 1)
+            {
+                std::cerr << "Error: Invalid listen address '" << serve.address << "'." << std::endl;
+                return -1;
+            }
+
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            int reuse = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 128) != 0)
+            {
+                std::cerr << "Error: Can't listen on " << serve.address << ":" << serve.port << ": " << std::strerror(errno) << std::endl;
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                return -1;
+            }
+            return fd;
+        }
+
+        // Answers one request. Returns false if the connection has to be
+        // closed afterwards.
+        bool handleRequest(int fd, const std::string &head)
+        {
+            auto start = std::chrono::steady_clock::now();
+            stats->requests++;
+
+            std::istringstream lines(head);
+            std::string requestLine;
+            std::getline(lines, requestLine);
+            std::istringstream parts(requestLine);
+            std::string method, target, version;
+            parts >> method >> target >> version;
+
+            bool keepAlive = version == "HTTP/1.1";
+            std::string line;
+            while (std::getline(lines, line))
+            {
+                line = lowercase(line);
+                if (line.rfind("connection:", 0) == 0)
+                {
+                    keepAlive = line.find("close") == std::string::npos && (keepAlive || line.find("keep-alive") != std::string::npos);
+                }
+            }
+
+            Outcome outcome = Outcome::Other;
+            std::string reply;
+            if (method != "GET" && method != "HEAD")
+            {
+                reply = response(405, "text/plain", "Only GET and HEAD are supported\n", keepAlive);
+            }
+            else
+            {
+                target = target.substr(0, target.find('?'));
+                if (target == "/stats")
+                {
+                    reply = response(200, "application/json", statsJSON(), keepAlive);
+                }
+                else
+                {
+                    reply = tileResponse(target, keepAlive, outcome);
+                }
+            }
+            if (method == "HEAD")
+            {
+                reply.resize(reply.find("\r\n\r\n") + 4);
+            }
+
+            bool sent = sendAll(fd, reply);
+
+            uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            stats->latency.record(nanoseconds);
+            switch (outcome)
+            {
+            case Outcome::Hit:
+                stats->hitLatency.record(nanoseconds);
+                break;
+            case Outcome::Miss:
+                stats->missLatency.record(nanoseconds);
+                break;
+            case Outcome::Shared:
+                stats->sharedLatency.record(nanoseconds);
+                break;
+            case Outcome::Other:
+                break;
+            }
+            return sent && keepAlive;
+        }
+
+        std::string tileResponse(const std::string &target, bool keepAlive, Outcome &outcome)
+        {
+            std::vector<std::string> segments;
+            std::stringstream path(target);
+            std::string segment;
+            while (std::getline(path, segment, '/'))
+            {
+                if (!segment.empty())
+                {
+                    segments.push_back(segment);
+                }
+            }
+
+            // The last segment is {y}.{ext}; an optional leading one the size.
+            // The extension picks the format.
+            size_t sizeIndex = 0;
+            size_t formatIndex = 0;
+            int zoom, x, y;
+            size_t dot = segments.empty() ? std::string::npos : segments.back().rfind('.');
+            bool valid = (segments.size() == 3 || segments.size() == 4) && dot != std::string::npos;
+            if (valid && segments.size() == 4)
+            {
+                int size;
+                auto found = options.tileSizes.end();
+                if (parseInt(segments[0], size))
+                {
+                    found = std::find(options.tileSizes.begin(), options.tileSizes.end(), static_cast<uint32_t>(size));
+                }
+                valid = found != options.tileSizes.end();
+                sizeIndex = found - options.tileSizes.begin();
+                segments.erase(segments.begin());
+            }
+            if (valid)
+            {
+                std::string ext = segments[2].substr(dot + 1);
+                auto found = std::find_if(options.imageFormats.begin(), options.imageFormats.end(), [&](ImageFormat candidate)
+                                          { return ext == imageString(candidate) || (ext == "jpeg" && candidate == ImageFormat::JPEG); });
+                valid = parseInt(segments[0], zoom) && parseInt(segments[1], x) && parseInt(segments[2].substr(0, dot), y) &&
+                        found != options.imageFormats.end() &&
+                        zoom >= 0 && zoom <= options.maxZoom && x >= 0 && y >= 0 && x < (1 << zoom) && y < (1 << zoom);
+                formatIndex = found - options.imageFormats.begin();
+            }
+            if (!valid)
+            {
+                stats->notFound++;
+                return response(404, "text/plain", "Not found\n", keepAlive);
+            }
+
+            EncodedTile tile;
+            try
+            {
+                int output = static_cast<int>(sizeIndex * options.imageFormats.size() + formatIndex);
+                tile = fetchTile({output, zoom, x, y}, outcome);
+            }
+            catch (const std::exception &e)
+            {
+                stats->errors++;
+                return response(500, "text/plain", std::string(e.what()) + "\n", keepAlive);
+            }
+            if (!tile)
+            {
+                stats->notFound++;
+                return response(404, "text/plain", "Outside the rendered area\n", keepAlive);
+            }
+
+            const char *source = outcome == Outcome::Hit ? "hit" : outcome == Outcome::Miss ? "miss"
+                                                                                              : "shared";
+            return response(200, contentType(options.imageFormats[formatIndex]), *tile, keepAlive, source);
+        }
+
+        // The tile from the cache, or from the render of its metatile. Returns
+        // nothing for tiles outside the area.
+        EncodedTile fetchTile(const TileKey &key, Outcome &outcome)
+        {
+            if (!options.area.contains(key.zoom, key.x, key.y))
+            {
+                return nullptr;
+            }
+
+            if (EncodedTile cached = cache.get(key))
+            {
+                outcome = Outcome::Hit;
+                stats->hits++;
+                return cached;
+            }
+
+            int span = std::min(options.metatile, 1 << key.zoom);
+            TileKey block{-1, key.zoom, key.x / span * span, key.y / span * span};
+
+            std::shared_ptr<Flight> flight;
+            {
+                std::lock_guard<std::mutex> lock(flightMutex);
+                auto found = flights.find(block);
+                if (found != flights.end())
+                {
+                    flight = found->second;
+                    outcome = Outcome::Shared;
+                    stats->shared++;
+                }
+                else
+                {
+                    // A render may have landed since the first look; its tiles
+                    // reach the cache before its flight is removed.
+                    if (EncodedTile cached = cache.get(key))
+                    {
+                        outcome = Outcome::Hit;
+                        stats->hits++;
+                        return cached;
+                    }
+                    if (renderStopping)
+                    {
+                        throw std::runtime_error("shutting down");
+                    }
+
+                    flight = std::make_shared<Flight>();
+                    flight->block = block;
+                    flights.emplace(block, flight);
+                    jobs.push_back({flight});
+                    outcome = Outcome::Miss;
+                    stats->misses++;
+                }
+            }
+            jobReady.notify_one();
+
+            std::unique_lock<std::mutex> lock(flight->mutex);
+            flight->landed.wait(lock, [&flight]
+                                { return flight->finished; });
+            if (flight->failed)
+            {
+                throw std::runtime_error("rendering failed");
+            }
+            auto found = flight->tiles.find(key);
+            return found == flight->tiles.end() ? nullptr : found->second;
+        }
+
+        void renderLoop(int workerId)
+        {
+            mbgl::util::RunLoop loop;
+            WorkerStats &workerStatistics = *workerStats[workerId];
+            BlockRenderer renderer(options, workerStatistics);
+
+            // Loads the style, sprites and glyphs and fills the cache with the
+            // zoom 0 tile before the first request comes in.
+            std::string error;
+            try
+            {
+                renderer.render(0, 0, 0, [this](int output, int zoom, int x, int tmsY, std::string_view data)
+                                {
+                                    EncodedTile tile = std::make_shared<const std::string>(data);
+                                    cache.put({output, zoom, x, (1 << zoom) - 1 - tmsY}, tile);
+                                    writeBack({output, zoom, x, tmsY, std::move(tile)}); });
+            }
+            catch (const std::exception &e)
+            {
+                error = e.what();
+            }
+            {
+                std::lock_guard<std::mutex> lock(warmupMutex);
+                if (!error.empty() && firstWarmupError.empty())
+                {
+                    firstWarmupError = error;
+                }
+                warmedUp++;
+            }
+            warmupDone.notify_all();
+
+            while (true)
+            {
+                std::shared_ptr<Flight> flight;
+                bool failed;
+                {
+                    std::unique_lock<std::mutex> lock(flightMutex);
+                    jobReady.wait(lock, [this]
+                                  { return renderStopping || !jobs.empty(); });
+                    if (jobs.empty())
+                    {
+                        break;
+                    }
+                    flight = jobs.front().flight;
+                    jobs.pop_front();
+
+                    // Whatever is still queued at shutdown is answered with an
+                    // error instead of being rendered.
+                    failed = renderStopping;
+                }
+
+                const TileKey &block = flight->block;
+                auto start = std::chrono::steady_clock::now();
+                if (!failed)
+                {
+                    try
+                    {
+                        renderer.render(block.zoom, block.x, block.y, [this, &flight](int output, int zoom, int x, int tmsY, std::string_view data)
+                                        {
+                                            TileKey key{output, zoom, x, (1 << zoom) - 1 - tmsY};
+                                            EncodedTile tile = std::make_shared<const std::string>(data);
+                                            flight->tiles[key] = tile;
+                                            cache.put(key, tile);
+                                            writeBack({output, zoom, x, tmsY, std::move(tile)}); });
+                    }
+                    catch (const std::exception &e)
+                    {
+                        std::cerr << "Failed to render " << block.zoom << "/" << block.x << "/" << block.y << ": " << e.what() << std::endl;
+                        failed = true;
+                    }
+                }
+                stats->renders++;
+                stats->renderTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+                {
+                    std::lock_guard<std::mutex> lock(flightMutex);
+                    flights.erase(block);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(flight->mutex);
+                    flight->failed = failed;
+                    flight->finished = true;
+                }
+                flight->landed.notify_all();
+            }
+        }
+
+        void writeBack(WriteBackTile &&tile)
+        {
+            if (writers.empty())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(writeBackMutex);
+                writeBackQueue.push_back(std::move(tile));
+            }
+            writeBackReady.notify_one();
+        }
+
+        // Inserts rendered tiles as they come and commits whenever the queue
+        // runs empty, so a stopped server loses nothing it has answered.
+        void writeBackLoop()
+        {
+            while (true)
+            {
+                std::deque<WriteBackTile> pending;
+                {
+                    std::unique_lock<std::mutex> lock(writeBackMutex);
+                    writeBackReady.wait(lock, [this]
+                                        { return writeBackStopping || !writeBackQueue.empty(); });
+                    if (writeBackQueue.empty())
+                    {
+                        return;
+                    }
+                    pending.swap(writeBackQueue);
+                }
+
+                for (const WriteBackTile &tile : pending)
+                {
+                    writers[tile.output]->insertTile(tile.zoom, tile.x, tile.tmsY, tile.data->data(), tile.data->size());
+                }
+
+                std::lock_guard<std::mutex> lock(writeBackMutex);
+                if (writeBackQueue.empty())
+                {
+                    for (auto &writer : writers)
+                    {
+                        writer->commit();
+                    }
+                }
+            }
+        }
+
+        std::string response(int status, const std::string &type, const std::string &body, bool keepAlive, const char *cacheStatus = nullptr) const
+        {
+            const char *reason = status == 200 ? "OK" : status == 404 ? "Not Found"
+                                                    : status == 405   ? "Method Not Allowed"
+                                                                      : "Internal Server Error";
+            std::string out = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n" +
+                              "Content-Type: " + type + "\r\n" +
+                              "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+                              "Access-Control-Allow-Origin: *\r\n" +
+                              (keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+            if (cacheStatus)
+            {
+                out += std::string("X-Tile-Cache: ") + cacheStatus + "\r\n";
+            }
+            return out + "\r\n" + body;
+        }
+
+        static std::string quantilesJSON(const StageHistogram &histogram)
+        {
+            HistogramTotal total;
+            total.add(histogram);
+            std::ostringstream out;
+            out << "{\"count\": " << total.count
+                << ", \"p50_ms\": " << total.quantile(0.5) * 1e3
+                << ", \"p99_ms\": " << total.quantile(0.99) * 1e3 << "}";
+            return out.str();
+        }
+
+        std::string statsJSON()
+        {
+            uint64_t sourceRequests = 0, sourceCacheHits = 0;
+            for (const auto &worker : workerStats)
+            {
+                sourceRequests += worker->sourceRequests;
+                sourceCacheHits += worker->sourceCacheHits;
+            }
+
+            std::ostringstream out;
+            out << "{\n"
+                << "  \"requests\": " << stats->requests << ",\n"
+                << "  \"hits\": " << stats->hits << ",\n"
+                << "  \"misses\": " << stats->misses << ",\n"
+                << "  \"shared\": " << stats->shared << ",\n"
+                << "  \"not_found\": " << stats->notFound << ",\n"
+                << "  \"errors\": " << stats->errors << ",\n"
+                << "  \"renders\": " << stats->renders << ",\n"
+                << "  \"renderers\": " << serve.workers << ",\n"
+                << "  \"cache\": {\"tiles\": " << cache.tiles() << ", \"bytes\": " << cache.bytes() << ", \"max_bytes\": " << serve.cacheBytes << "},\n"
+                << "  \"source_tiles\": {\"requests\": " << sourceRequests << ", \"memory_hits\": " << sourceCacheHits << "},\n"
+                << "  \"latency\": {\n"
+                << "    \"all\": " << quantilesJSON(stats->latency) << ",\n"
+                << "    \"hit\": " << quantilesJSON(stats->hitLatency) << ",\n"
+                << "    \"miss\": " << quantilesJSON(stats->missLatency) << ",\n"
+                << "    \"shared\": " << quantilesJSON(stats->sharedLatency) << "\n"
+                << "  },\n"
+                << "  \"render\": " << quantilesJSON(stats->renderTime) << "\n"
+                << "}\n";
+            return out.str();
+        }
+
+        void printSummary(std::ostream &out)
+        {
+            HistogramTotal all, hit, miss;
+            all.add(stats->latency);
+            hit.add(stats->hitLatency);
+            miss.add(stats->missLatency);
+            out << "Served " << stats->requests << " requests: " << stats->hits << " from the cache, "
+                << stats->misses << " rendered, " << stats->shared << " joined a running render, "
+                << stats->notFound << " not found, " << stats->errors << " failed." << std::endl;
+            out << "Latency p50/p99: " << all.quantile(0.5) * 1e3 << "/" << all.quantile(0.99) * 1e3 << " ms (cached "
+                << hit.quantile(0.5) * 1e3 << "/" << hit.quantile(0.99) * 1e3 << " ms, rendered "
+                << miss.quantile(0.5) * 1e3 << "/" << miss.quantile(0.99) * 1e3 << " ms)" << std::endl;
+        }
+
+        static constexpr int idleSeconds = 10;
+
+        const RenderOptions &options;
+        const ServeOptions &serve;
+        EncodedTileCache cache;
+        std::unique_ptr<ServerStats> stats;
+        std::vector<std::unique_ptr<WorkerStats>> workerStats;
+
+        std::mutex warmupMutex;
+        std::condition_variable warmupDone;
+        int warmedUp = 0;
+        std::string firstWarmupError;
+
+        std::mutex flightMutex;
+        std::condition_variable jobReady;
+        std::unordered_map<TileKey, std::shared_ptr<Flight>, TileKeyHash> flights; // by block
+        std::deque<Job> jobs;
+        bool renderStopping = false;
+
+        std::vector<std::unique_ptr<MBTilesWriter>> writers; // used by the write-back thread only
+        std::mutex writeBackMutex;
+        std::condition_variable writeBackReady;
+        std::deque<WriteBackTile> writeBackQueue;
+        bool writeBackStopping = false;
+    };
+
+} // namespace
+
+int serveTiles(const RenderOptions &options, const ServeOptions &serve)
+{
+    std::signal(SIGINT, requestStop);
+    std::signal(SIGTERM, requestStop);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    TileServer server(options, serve);
+    return server.run();
+}
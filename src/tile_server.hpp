@@ -0,0 +1,32 @@
+#ifndef TILE_SERVER_HPP
+#define TILE_SERVER_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "renderer.hpp"
+
+struct ServeOptions
+{
+    std::string address = "0.0.0.0";
+    int port = 8080;
+    int workers = 1;                   // warm renderers, each a thread with its own Map
+    int connectionThreads = 16;        // requests answered at once
+    size_t cacheBytes = size_t(512) << 20; // encoded tiles kept in memory
+    std::vector<std::string> writeBackPaths; // MBTiles per output every rendered tile is stored in, empty for none
+    bool deduplicate = false;          // layout of newly created write-back files
+};
+
+// Renders tiles on request over HTTP/1.1:
+//   GET /{z}/{x}/{y}.{ext}         a tile of the largest size in the format of {ext}
+//   GET /{size}/{z}/{x}/{y}.{ext}  a tile of that tile size in the format of {ext}
+//   GET /stats                     request counters and latencies as JSON
+// Every renderer loads the style and renders the zoom 0 tile before the
+// server starts listening. A missing tile renders its whole metatile, and all
+// of its tiles go into the cache; concurrent requests for tiles of the same
+// metatile wait for that one render. Runs until SIGINT or SIGTERM and returns
+// the exit code.
+int serveTiles(const RenderOptions &options, const ServeOptions &serve);
+
+#endif // TILE_SERVER_HPP
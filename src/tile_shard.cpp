@@ -0,0 +1,109 @@
+#include "tile_shard.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+#include "pmtiles.hpp"
+#include "tile_scheduler.hpp"
+
+TileShard::TileShard(const std::vector<ScheduleLevel> &levels, const TileCover &area, int maxZoom, int index, int count)
+    : index(index), count(count)
+{
+    if (count == 1)
+    {
+        return;
+    }
+
+    // A chunk of the deepest level has to fit into a single cell, otherwise
+    // whole chunks would be assigned by their corner and the shares drift.
+    int unitZoom = 0;
+    if (!levels.empty())
+    {
+        unitZoom = levels.back().zoom - __builtin_ctz(levels.back().chunkSide);
+    }
+    for (zoom = 0; zoom < unitZoom; zoom++)
+    {
+        if (area.tileCount(zoom) >= cellsPerShard * count)
+        {
+            break;
+        }
+    }
+
+    // Every cell weighed by the max zoom tiles below it, in curve order.
+    std::vector<std::pair<uint64_t, uint64_t>> cells; // curve position, tiles
+    TileRange bounds = area.bounds(zoom);
+    int shift = maxZoom - zoom;
+    uint64_t total = 0;
+    for (int y = bounds.y0; y < bounds.y1; y++)
+    {
+        for (int x = bounds.x0; x < bounds.x1; x++)
+        {
+            if (!area.contains(zoom, x, y))
+            {
+                continue;
+            }
+            uint64_t tiles = area.tileCount(maxZoom, {x << shift, y << shift, (x + 1) << shift, (y + 1) << shift});
+            if (tiles > 0)
+            {
+                cells.emplace_back(pmtilesTileId(zoom, x, y), tiles);
+                total += tiles;
+            }
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+
+    // Shard i starts at the first cell that the running total reaches i/N of
+    // the tiles with.
+    starts.assign(count + 1, UINT64_MAX);
+    starts[0] = 0;
+    uint64_t before = 0;
+    int next = 1;
+    for (const auto &[position, tiles] : cells)
+    {
+        while (next < count && before * count >= total * next)
+        {
+            starts[next++] = position;
+        }
+        before += tiles;
+    }
+
+    uint64_t owned = 0;
+    for (const auto &[position, tiles] : cells)
+    {
+        if (position >= starts[index] && position < starts[index + 1])
+        {
+            owned += tiles;
+        }
+    }
+    share_ = total > 0 ? static_cast<double>(owned) / total : 0.0;
+}
+
+bool TileShard::owns(int tileZoom, int x, int y) const
+{
+    if (count == 1)
+    {
+        return true;
+    }
+
+    int cx = tileZoom >= zoom ? x >> (tileZoom - zoom) : x << (zoom - tileZoom);
+    int cy = tileZoom >= zoom ? y >> (tileZoom - zoom) : y << (zoom - tileZoom);
+    uint64_t position = pmtilesTileId(zoom, cx, cy);
+    return position >= starts[index] && position < starts[index + 1];
+}
+
+void parseShard(const std::string &text, int &index, int &count)
+{
+    size_t slash = text.find('/');
+    if (slash == std::string::npos)
+    {
+        throw std::invalid_argument("Expected i/N, e.g. 2/8.");
+    }
+    int shard = std::stoi(text.substr(0, slash));
+    count = std::stoi(text.substr(slash + 1));
+    if (count < 1 || shard < 1 || shard > count)
+    {
+        throw std::invalid_argument("Expected 1 <= i <= N.");
+    }
+    index = shard - 1;
+}
@@ -0,0 +1,54 @@
+#ifndef TILE_SHARD_HPP
+#define TILE_SHARD_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tile_cover.hpp"
+
+struct ScheduleLevel;
+
+// One of several machines' share of a render. The area is cut into cells at
+// a coarse shard zoom, the cells are ordered along the Hilbert curve, and the
+// curve is split into `count` runs of about the same number of max zoom tiles.
+// A chunk belongs to the shard whose run holds the cell of its north-west
+// tile, so every chunk is rendered by exactly one shard. The partition only
+// depends on the levels, the area, the max zoom and `count`, so every machine
+// computes the same one.
+class TileShard
+{
+public:
+    // The whole render.
+    TileShard() = default;
+
+    // `index` counts from 0.
+    TileShard(const std::vector<ScheduleLevel> &levels, const TileCover &area, int maxZoom, int index, int count);
+
+    bool owns(int zoom, int x, int y) const;
+
+    bool isWhole() const { return count == 1; }
+    int shardIndex() const { return index; }
+    int shardCount() const { return count; }
+    int cellZoom() const { return zoom; }
+
+    // Share of the max zoom tiles in this shard.
+    double share() const { return share_; }
+
+private:
+    // Every shard gets this many cells or more, so the runs can be cut close
+    // to an equal share.
+    static constexpr uint64_t cellsPerShard = 64;
+
+    int index = 0;
+    int count = 1;
+    int zoom = 0;
+    double share_ = 1.0;
+    std::vector<uint64_t> starts; // first curve position of every shard at the cell zoom
+};
+
+// Parses "i/N" with 1 <= i <= N into a 0-based index and a count. Throws
+// std::invalid_argument.
+void parseShard(const std::string &text, int &index, int &count);
+
+#endif // TILE_SHARD_HPP
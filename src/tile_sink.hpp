@@ -0,0 +1,44 @@
+#ifndef TILE_SINK_HPP
+#define TILE_SINK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Where the writer process puts the encoded tiles of one output. Rows are in
+// TMS order throughout, as they arrive from the workers.
+class TileSink
+{
+public:
+    virtual ~TileSink() = default;
+
+    // The data only has to stay valid for the duration of the call.
+    virtual void insertTile(int zoom, int x, int tmsY, const void *data, size_t size) = 0;
+
+    // Records a scheduler chunk as done. It is committed together with, or
+    // after, the tiles inserted before it. Outputs that can't be resumed
+    // ignore it.
+    virtual void markChunkDone(uint64_t chunkIndex) = 0;
+
+    // Reads back a tile inserted earlier. Returns false if there is none.
+    virtual bool readTile(int zoom, int x, int tmsY, std::string &data) = 0;
+
+    // Writes out everything buffered so far.
+    virtual void commit() = 0;
+
+    // Completes the output once all tiles are in. Nothing may be inserted
+    // afterwards.
+    virtual void finish() = 0;
+
+    virtual size_t tileCount() const = 0;
+
+    // Distinct tile contents this sink stored, for outputs that store
+    // identical tiles once.
+    virtual size_t imageCount() const = 0;
+
+    // Time spent inserting and committing, and the tile bytes written in it.
+    virtual double insertSeconds() const = 0;
+    virtual uint64_t byteCount() const = 0;
+};
+
+#endif // TILE_SINK_HPP
@@ -0,0 +1,92 @@
+#include "tile_stream.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+static void writeFully(int fd, const void *buffer, size_t size)
+{
+    const char *bytes = static_cast<const char *>(buffer);
+    while (size > 0)
+    {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "Failed to write tile to writer: " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+// Returns the number of bytes read, which is only short of `size` at EOF.
+static size_t readFully(int fd, void *buffer, size_t size)
+{
+    char *bytes = static_cast<char *>(buffer);
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t count = read(fd, bytes + total, size - total);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            std::cerr << "Failed to read tile from worker: " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        if (count == 0)
+        {
+            break;
+        }
+        total += count;
+    }
+    return total;
+}
+
+void writeTileFrame(int fd, int output, int zoom, int x, int tmsY, std::string_view data)
+{
+    TileFrameHeader header{output, zoom, x, tmsY, static_cast<uint32_t>(data.size())};
+    writeFully(fd, &header, sizeof(header));
+    writeFully(fd, data.data(), data.size());
+}
+
+void writeCheckpointFrame(int fd, uint64_t chunkIndex)
+{
+    TileFrameHeader header{0,
+                           checkpointFrameZoom,
+                           static_cast<int32_t>(chunkIndex >> 32),
+                           static_cast<int32_t>(chunkIndex & 0xffffffffu),
+                           0};
+    writeFully(fd, &header, sizeof(header));
+}
+
+uint64_t checkpointChunkIndex(const TileFrameHeader &header)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(header.x)) << 32) | static_cast<uint32_t>(header.tmsY);
+}
+
+bool readTileFrame(int fd, TileFrameHeader &header, std::string &data)
+{
+    size_t count = readFully(fd, &header, sizeof(header));
+    if (count == 0)
+    {
+        return false;
+    }
+
+    data.resize(count == sizeof(header) ? header.size : 0);
+    if (count != sizeof(header) || readFully(fd, data.data(), data.size()) != data.size())
+    {
+        std::cerr << "Worker closed its pipe in the middle of a tile, dropping it" << std::endl;
+        return false;
+    }
+    return true;
+}
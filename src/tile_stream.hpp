@@ -0,0 +1,33 @@
+#ifndef TILE_STREAM_HPP
+#define TILE_STREAM_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Header sent ahead of every encoded tile on a worker's pipe. The tile row is
+// already in TMS order, so the writer can insert it as-is.
+struct TileFrameHeader
+{
+    int32_t output; // index of the output the tile belongs to
+    int32_t zoom;
+    int32_t x;
+    int32_t tmsY;
+    uint32_t size;
+};
+
+// Frames with this zoom carry no tile but tell the writer that all tiles of
+// the scheduler chunk (x << 32 | tmsY) have been sent.
+constexpr int32_t checkpointFrameZoom = -1;
+
+// Writes one tile to the pipe, blocking until it has been fully handed over.
+void writeTileFrame(int fd, int output, int zoom, int x, int tmsY, std::string_view data);
+
+void writeCheckpointFrame(int fd, uint64_t chunkIndex);
+
+uint64_t checkpointChunkIndex(const TileFrameHeader &header);
+
+// Reads the next tile from the pipe. Returns false once the worker closed it.
+bool readTileFrame(int fd, TileFrameHeader &header, std::string &data);
+
+#endif // TILE_STREAM_HPP
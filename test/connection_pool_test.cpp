@@ -0,0 +1,224 @@
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "connection_pool.hpp"
+
+// Runs a ConnectionPool with two threads on localhost and checks that idle
+// keep-alive connections and clients that send their request head byte by
+// byte neither keep other clients waiting nor stay open for good.
+
+namespace
+{
+
+    int failures = 0;
+
+    void expect(bool condition, const std::string &what)
+    {
+        if (!condition)
+        {
+            std::cerr << "FAILED " << what << std::endl;
+            failures++;
+        }
+    }
+
+    constexpr int idleSeconds = 1;
+
+    int openListener(int &port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+            listen(fd, 64) != 0 || getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+        {
+            std::cerr << "Failed to listen on localhost" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        port = ntohs(address.sin_port);
+        return fd;
+    }
+
+    int connectTo(int port)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            std::cerr << "Failed to connect to localhost:" << port << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        timeval timeout{3, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        return fd;
+    }
+
+    // Reads one response and returns its body, or what went wrong in angle
+    // brackets.
+    std::string readResponse(int fd, std::string *status = nullptr)
+    {
+        std::string received;
+        char buffer[4096];
+        size_t end;
+        while ((end = received.find("\r\n\r\n")) == std::string::npos)
+        {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                return n == 0 ? "<closed>" : "<timeout>";
+            }
+            received.append(buffer, static_cast<size_t>(n));
+        }
+        if (status)
+        {
+            *status = received.substr(0, received.find("\r\n"));
+        }
+        size_t lengthAt = received.find("Content-Length: ");
+        size_t length = lengthAt == std::string::npos ? 0 : std::stoul(received.substr(lengthAt + 16));
+        while (received.size() < end + 4 + length)
+        {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+            {
+                return "<short body>";
+            }
+            received.append(buffer, static_cast<size_t>(n));
+        }
+        return received.substr(end + 4, length);
+    }
+
+    // True if the server closes the connection within `seconds`, reading
+    // and dropping whatever it sends first.
+    bool closedWithin(int fd, int seconds)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+        char buffer[4096];
+        while (std::chrono::steady_clock::now() < deadline)
+        {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n == 0 || (n < 0 && errno == ECONNRESET))
+            {
+                return true;
+            }
+            if (n < 0)
+            {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    void sendText(int fd, const std::string &text)
+    {
+        send(fd, text.data(), text.size(), MSG_NOSIGNAL);
+    }
+
+    // Answers with the request target and closes the connection when asked to.
+    bool echoTarget(int fd, const std::string &head)
+    {
+        size_t start = head.find(' ') + 1;
+        std::string target = head.substr(start, head.find(' ', start) - start);
+        bool keepAlive = head.find("Connection: close") == std::string::npos;
+        sendAll(fd, "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(target.size()) + "\r\n" +
+                        (keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n") + "\r\n" + target);
+        return keepAlive;
+    }
+
+} // namespace
+
+int main()
+{
+    int port;
+    int listenFd = openListener(port);
+    std::atomic<bool> stop{false};
+    ConnectionPool pool(2, idleSeconds, echoTarget);
+    std::thread server([&]
+                       { pool.serve(listenFd, stop); });
+
+    // More idle and half-sent connections than threads.
+    std::vector<int> idle;
+    for (int i = 0; i < 4; i++)
+    {
+        idle.push_back(connectTo(port));
+    }
+    int partial = connectTo(port);
+    sendText(partial, "GET /partial HTTP/1.1\r\nHost: localhost\r\n");
+    int trickle = connectTo(port);
+    std::thread trickler([&]
+                         {
+                             std::string head = "GET /trickle HTTP/1.1\r\nHost: localhost\r\nX-Padding: ";
+                             for (char c : head + std::string(100, 'x'))
+                             {
+                                 if (send(trickle, &c, 1, MSG_NOSIGNAL) != 1)
+                                 {
+                                     return;
+                                 }
+                                 std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                             } });
+
+    auto start = std::chrono::steady_clock::now();
+    int client = connectTo(port);
+    sendText(client, "GET /first HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    expect(readResponse(client) == "/first", "request behind idle connections not answered");
+    expect(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500), "request behind idle connections waited");
+
+    // Keep-alive, then two pipelined requests, then one asking to close.
+    sendText(client, "GET /second HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    expect(readResponse(client) == "/second", "keep-alive request not answered");
+    sendText(client, "GET /third HTTP/1.1\r\n\r\nGET /fourth HTTP/1.1\r\n\r\n");
+    expect(readResponse(client) == "/third", "first pipelined request not answered");
+    expect(readResponse(client) == "/fourth", "second pipelined request not answered");
+    sendText(client, "GET /last HTTP/1.1\r\nConnection: close\r\n\r\n");
+    expect(readResponse(client) == "/last", "closing request not answered");
+    expect(closedWithin(client, 1), "connection not closed on request");
+    close(client);
+
+    // Everyone who didn't finish a request head in time is closed, the
+    // trickling client although it keeps sending.
+    for (int fd : idle)
+    {
+        expect(closedWithin(fd, idleSeconds + 2), "idle connection left open");
+        close(fd);
+    }
+    expect(closedWithin(partial, idleSeconds + 2), "half-sent request left open");
+    expect(closedWithin(trickle, idleSeconds + 2), "trickling request left open");
+    trickler.join();
+    close(partial);
+    close(trickle);
+
+    // Small enough to be read in full, so closing doesn't reset the
+    // connection before the response arrives.
+    int large = connectTo(port);
+    sendText(large, "GET /large HTTP/1.1\r\nX-Padding: " + std::string(17000, 'x'));
+    std::string status;
+    readResponse(large, &status);
+    expect(status == "HTTP/1.1 431 Request Header Fields Too Large", "oversized request head answered with '" + status + "'");
+    close(large);
+
+    int open = connectTo(port);
+    start = std::chrono::steady_clock::now();
+    stop = true;
+    server.join();
+    expect(std::chrono::steady_clock::now() - start < std::chrono::seconds(2), "serve() didn't return after the stop request");
+    expect(closedWithin(open, 1), "open connection not closed at shutdown");
+    close(open);
+    close(listenFd);
+
+    std::cout << (failures == 0 ? "ok" : "FAILED") << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
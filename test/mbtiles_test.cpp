@@ -0,0 +1,237 @@
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <sqlite3.h>
+
+#include "mbtiles.hpp"
+
+// Writes MBTiles files the way a render, a resumed render, an update and a
+// merge do and reads them back.
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+    int failures = 0;
+
+    void expect(bool condition, const std::string &what)
+    {
+        if (!condition)
+        {
+            std::cerr << "FAILED " << what << std::endl;
+            failures++;
+        }
+    }
+
+    void insert(MBTilesWriter &writer, int zoom, int x, int tmsY, const std::string &data)
+    {
+        writer.insertTile(zoom, x, tmsY, data.data(), data.size());
+    }
+
+    std::string readTile(const std::string &path, int zoom, int x, int tmsY)
+    {
+        MBTilesReader reader(path);
+        std::string data;
+        return reader.readTile(zoom, x, tmsY, data) ? data : "<missing>";
+    }
+
+    // An update re-renders some tiles of a finished output. The writer still
+    // sees the chunk checkpoints of the render, which must not need the
+    // progress tables the finished render dropped.
+    void testUpdateFinishedOutput(const fs::path &directory, bool deduplicate)
+    {
+        std::string name = deduplicate ? "update, deduplicated" : "update";
+        std::string path = (directory / (deduplicate ? "update-dedup.mbtiles" : "update.mbtiles")).string();
+
+        createMBTilesDatabase(path.c_str(), ImageFormat::PNG, deduplicate);
+        createRenderProgress(path.c_str(), "params");
+        {
+            MBTilesWriter writer(path.c_str(), deduplicate);
+            insert(writer, 1, 0, 0, "old-a");
+            insert(writer, 1, 1, 0, "old-b");
+            insert(writer, 1, 0, 1, "old-a");
+            writer.markChunkDone(0);
+            writer.finish();
+        }
+        finishRenderProgress(path.c_str());
+        expect(!hasRenderProgress(path.c_str()), name + ": finished render keeps its progress");
+
+        {
+            MBTilesWriter writer(path.c_str(), deduplicate);
+            insert(writer, 1, 0, 0, "new-a");
+            writer.markChunkDone(0);
+            writer.markChunkDone(1);
+            writer.finish();
+        }
+        if (deduplicate)
+        {
+            removeUnusedImages(path.c_str());
+        }
+
+        expect(readTile(path, 1, 0, 0) == "new-a", name + ": updated tile not replaced");
+        expect(readTile(path, 1, 1, 0) == "old-b", name + ": untouched tile changed");
+        expect(readTile(path, 1, 0, 1) == "old-a", name + ": tile sharing the replaced image changed");
+        expect(!hasRenderProgress(path.c_str()), name + ": update left render progress behind");
+    }
+
+    // Chunks recorded before an interruption are there to resume from.
+    void testResumeProgress(const fs::path &directory)
+    {
+        std::string path = (directory / "resume.mbtiles").string();
+        createMBTilesDatabase(path.c_str(), ImageFormat::PNG);
+        createRenderProgress(path.c_str(), "params");
+        {
+            MBTilesWriter writer(path.c_str());
+            insert(writer, 0, 0, 0, "tile");
+            writer.markChunkDone(7);
+            writer.markChunkDone(3);
+        }
+
+        std::vector<uint64_t> completed;
+        expect(loadRenderProgress(path.c_str(), "params", completed) && completed == std::vector<uint64_t>{3, 7},
+               "resume: completed chunks not recorded");
+        expect(!loadRenderProgress(path.c_str(), "other params", completed), "resume: accepted other render options");
+    }
+
+    size_t countRows(const std::string &path, const char *table)
+    {
+        sqlite3 *db;
+        sqlite3_open(path.c_str(), &db);
+        sqlite3_stmt *stmt;
+        sqlite3_prepare_v2(db, (std::string("SELECT COUNT(*) FROM ") + table + ";").c_str(), -1, &stmt, nullptr);
+        size_t rows = sqlite3_step(stmt) == SQLITE_ROW ? static_cast<size_t>(sqlite3_column_int64(stmt, 0)) : 0;
+        sqlite3_finalize(stmt);
+        sqlite3_close(db);
+        return rows;
+    }
+
+    // Identical tiles share one image, also across a resumed render and in
+    // a bulk load, where only the images index exists while writing.
+    void testDeduplication(const fs::path &directory, bool bulkLoad)
+    {
+        std::string name = bulkLoad ? "dedup, bulk load" : "dedup";
+        std::string path = (directory / (bulkLoad ? "dedup-bulk.mbtiles" : "dedup.mbtiles")).string();
+
+        createMBTilesDatabase(path.c_str(), ImageFormat::PNG, true, bulkLoad);
+        {
+            MBTilesWriter writer(path.c_str(), true, bulkLoad);
+            insert(writer, 2, 0, 0, "ocean");
+            insert(writer, 2, 1, 0, "land");
+            insert(writer, 2, 2, 0, "ocean");
+            writer.finish();
+            expect(writer.imageCount() == 2, name + ": counted " + std::to_string(writer.imageCount()) + " images, not 2");
+        }
+        if (!bulkLoad)
+        {
+            MBTilesWriter writer(path.c_str(), true);
+            insert(writer, 2, 3, 0, "ocean");
+            insert(writer, 2, 0, 1, "coast");
+            writer.finish();
+            expect(writer.imageCount() == 1, name + ": resumed writer counted " + std::to_string(writer.imageCount()) + " new images, not 1");
+        }
+
+        size_t expectedImages = bulkLoad ? 2 : 3;
+        expect(countRows(path, "images") == expectedImages, name + ": stored an image twice");
+        expect(readTile(path, 2, 2, 0) == "ocean" && readTile(path, 2, 1, 0) == "land", name + ": tiles read back wrong");
+    }
+
+    // Merges a plain and a deduplicated input that share one tile, which is
+    // taken from the first input.
+    void testMerge(const fs::path &directory, bool deduplicate)
+    {
+        std::string name = deduplicate ? "merge, deduplicated" : "merge";
+        std::string first = (directory / "merge-a.mbtiles").string();
+        std::string second = (directory / "merge-b.mbtiles").string();
+        if (!fs::exists(first))
+        {
+            createMBTilesDatabase(first.c_str(), ImageFormat::PNG);
+            MBTilesWriter a(first.c_str());
+            insert(a, 1, 0, 0, "a");
+            insert(a, 1, 1, 0, "b");
+            a.finish();
+
+            createMBTilesDatabase(second.c_str(), ImageFormat::PNG, true);
+            MBTilesWriter b(second.c_str(), true);
+            insert(b, 1, 0, 0, "overlap");
+            insert(b, 1, 0, 1, "a");
+            insert(b, 1, 1, 1, "c");
+            b.finish();
+        }
+
+        std::string path = (directory / (deduplicate ? "merged-dedup.mbtiles" : "merged.mbtiles")).string();
+        MergeResult result = mergeMBTiles({first, second}, path, deduplicate);
+        expect(result.tiles == 4 && result.duplicates == 1, name + ": merged " + std::to_string(result.tiles) + " tiles with " +
+                                                                std::to_string(result.duplicates) + " duplicates, not 4 with 1");
+        expect(readTile(path, 1, 0, 0) == "a", name + ": overlapping tile not taken from the first input");
+        expect(readTile(path, 1, 1, 0) == "b" && readTile(path, 1, 0, 1) == "a" && readTile(path, 1, 1, 1) == "c",
+               name + ": tiles read back wrong");
+        expect(isDeduplicatedMBTiles(path.c_str()) == deduplicate, name + ": wrong layout");
+        if (deduplicate)
+        {
+            expect(countRows(path, "images") == 3, name + ": stored an image twice or kept the overlapping one");
+        }
+
+        bool threw = false;
+        try
+        {
+            mergeMBTiles({first, (directory / "missing.mbtiles").string()}, (directory / "merged-missing.mbtiles").string(), deduplicate);
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        expect(threw, name + ": accepted a missing input");
+        fs::remove(directory / "merged-missing.mbtiles");
+        expect(!hasRenderProgress(path.c_str()), name + ": output left marked unfinished");
+
+        // A bulk load whose workers didn't all finish still builds its
+        // indexes, but has to be told apart from a finished one.
+        std::string bulk = (directory / (deduplicate ? "bulk-dedup.mbtiles" : "bulk.mbtiles")).string();
+        createMBTilesDatabase(bulk.c_str(), ImageFormat::PNG, false, true);
+        {
+            MBTilesWriter writer(bulk.c_str(), false, true);
+            insert(writer, 1, 0, 0, "d");
+            writer.finish();
+        }
+        std::string mergedBulk = (directory / (deduplicate ? "merged-bulk-dedup.mbtiles" : "merged-bulk.mbtiles")).string();
+        threw = false;
+        try
+        {
+            mergeMBTiles({first, bulk}, mergedBulk, deduplicate);
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        expect(threw, name + ": accepted an unfinished bulk load");
+        fs::remove(mergedBulk);
+
+        finishRenderProgress(bulk.c_str());
+        result = mergeMBTiles({bulk, first}, mergedBulk, deduplicate);
+        expect(result.tiles == 2 && readTile(mergedBulk, 1, 0, 0) == "d", name + ": finished bulk load not merged");
+    }
+
+} // namespace
+
+int main()
+{
+    fs::path directory = fs::temp_directory_path() / ("tilerender-mbtiles-test-" + std::to_string(getpid()));
+    fs::create_directories(directory);
+
+    testUpdateFinishedOutput(directory, false);
+    testUpdateFinishedOutput(directory, true);
+    testResumeProgress(directory);
+    testDeduplication(directory, false);
+    testDeduplication(directory, true);
+    testMerge(directory, false);
+    testMerge(directory, true);
+
+    fs::remove_all(directory);
+    std::cout << (failures == 0 ? "ok" : "FAILED") << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
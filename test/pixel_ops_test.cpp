@@ -0,0 +1,113 @@
+#include <mbgl/util/image.hpp>
+#include <mbgl/util/premultiply.hpp>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <tuple>
+#include <vector>
+
+#include "pixel_ops.hpp"
+
+// Checks every unpremultiply kernel this CPU runs against mbgl's own
+// util::unpremultiply(), bit for bit, for every (channel, alpha) pair, at
+// unaligned addresses and lengths that end in every possible tail.
+
+using namespace mbgl;
+
+namespace
+{
+
+    constexpr size_t guardBytes = 64;
+    constexpr uint8_t guardValue = 0xA5;
+
+    // Pixel i holds alpha i >> 8 and channel values i & 255 in red, a
+    // different permutation of them in green and the complement in blue, so
+    // each channel goes through all 65536 (c, a) pairs.
+    PremultipliedImage allPairs()
+    {
+        PremultipliedImage image({256, 256});
+        for (uint32_t i = 0; i < 65536; i++)
+        {
+            uint8_t *pixel = image.data.get() + i * 4;
+            pixel[0] = static_cast<uint8_t>(i);
+            pixel[1] = static_cast<uint8_t>(i * 167 + 13);
+            pixel[2] = static_cast<uint8_t>(255 - i);
+            pixel[3] = static_cast<uint8_t>(i >> 8);
+        }
+        return image;
+    }
+
+    // Runs `kernel` on `pixels` pixels starting at `first`, with source and
+    // destination shifted by `offset` bytes, and compares the result with
+    // the reference. Bytes around the destination must stay untouched.
+    bool check(const char *name, const char *variant, void (*kernel)(const uint8_t *, uint8_t *, size_t),
+               const PremultipliedImage &source, const UnassociatedImage &expected, size_t channels,
+               size_t first, size_t pixels, size_t offset)
+    {
+        std::vector<uint8_t> src(offset + pixels * 4);
+        std::memcpy(src.data() + offset, source.data.get() + first * 4, pixels * 4);
+        std::vector<uint8_t> dst(guardBytes + offset + pixels * channels + guardBytes, guardValue);
+        uint8_t *out = dst.data() + guardBytes + offset;
+
+        kernel(src.data() + offset, out, pixels);
+
+        for (size_t i = 0; i < pixels; i++)
+        {
+            const uint8_t *want = expected.data.get() + (first + i) * 4;
+            if (std::memcmp(out + i * channels, want, channels) != 0)
+            {
+                const uint8_t *in = source.data.get() + (first + i) * 4;
+                std::cerr << name << " " << variant << ": pixel " << first + i << " (" << int(in[0]) << "," << int(in[1])
+                          << "," << int(in[2]) << "," << int(in[3]) << ") of a run of " << pixels << " at offset " << offset
+                          << " differs from util::unpremultiply()" << std::endl;
+                return false;
+            }
+        }
+        size_t end = guardBytes + offset + pixels * channels;
+        for (size_t i = 0; i < dst.size(); i++)
+        {
+            if ((i < guardBytes + offset || i >= end) && dst[i] != guardValue)
+            {
+                std::cerr << name << " " << variant << ": wrote outside a run of " << pixels << " at offset " << offset << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+} // namespace
+
+int main()
+{
+    PremultipliedImage source = allPairs();
+    PremultipliedImage copy(source.size);
+    std::memcpy(copy.data.get(), source.data.get(), source.size.area() * 4);
+    UnassociatedImage expected = util::unpremultiply(std::move(copy));
+
+    int failures = 0;
+    for (const UnpremultiplyKernel &kernel : unpremultiplyKernels())
+    {
+        for (auto [variant, function, channels] : {std::tuple{"rgba", kernel.rgba, size_t(4)}, std::tuple{"rgb", kernel.rgb, size_t(3)}})
+        {
+            // Every pair in one long run, then short runs of every length up
+            // to a few vectors wide, at every misalignment, spread over the
+            // image so they start at different alphas.
+            bool passed = true;
+            for (size_t offset = 0; offset < 4 && passed; offset++)
+            {
+                passed = check(kernel.name, variant, function, source, expected, channels, 0, 65536, offset);
+                for (size_t pixels = 0; pixels <= 40 && passed; pixels++)
+                {
+                    for (size_t first = 0; first + pixels <= 65536 && passed; first += 4099)
+                    {
+                        passed = check(kernel.name, variant, function, source, expected, channels, first, pixels, offset);
+                    }
+                }
+            }
+            std::cout << (passed ? "ok     " : "FAILED ") << kernel.name << " " << variant << std::endl;
+            failures += passed ? 0 : 1;
+        }
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
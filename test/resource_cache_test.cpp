@@ -0,0 +1,236 @@
+#include <mbgl/storage/online_file_source.hpp>
+#include <mbgl/storage/resource.hpp>
+#include <mbgl/storage/resource_options.hpp>
+#include <mbgl/storage/response.hpp>
+#include <mbgl/util/async_request.hpp>
+#include <mbgl/util/client_options.hpp>
+#include <mbgl/util/run_loop.hpp>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#include "archive_file_source.hpp"
+#include "mbtiles.hpp"
+#include "resource_cache.hpp"
+
+// Fetches a style served on localhost through CachingFileSource and checks
+// that expired entries are revalidated with their ETag instead of being
+// served forever or downloaded again, and that tiles of a local archive are
+// counted and kept in memory by SourceTileFileSource.
+
+using namespace mbgl;
+namespace fs = std::filesystem;
+
+namespace
+{
+
+    int failures = 0;
+
+    void expect(bool condition, const std::string &what)
+    {
+        if (!condition)
+        {
+            std::cerr << "FAILED " << what << std::endl;
+            failures++;
+        }
+    }
+
+    // Serves one style at /style.json, one request per connection. Answers
+    // 304 when the request carries the current ETag.
+    class StyleServer
+    {
+    public:
+        StyleServer()
+        {
+            listenFd = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(address);
+            if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+                listen(listenFd, 16) != 0 || getsockname(listenFd, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+            {
+                std::cerr << "Failed to listen on localhost" << std::endl;
+                std::exit(EXIT_FAILURE);
+            }
+            port = ntohs(address.sin_port);
+            thread = std::thread([this]
+                                 { serve(); });
+        }
+
+        ~StyleServer()
+        {
+            stopping = true;
+            shutdown(listenFd, SHUT_RDWR);
+            close(listenFd);
+            thread.join();
+        }
+
+        std::string url() const { return "http://127.0.0.1:" + std::to_string(port) + "/style.json"; }
+
+        // An expired style has an Expires date in the past rather than
+        // max-age=0, which mbgl would re-request on its own right away.
+        void setStyle(const std::string &body_, const std::string &etag_, bool expired_)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            body = body_;
+            etag = etag_;
+            expired = expired_;
+        }
+
+        std::atomic<int> requests{0};
+        std::atomic<int> notModified{0};
+
+    private:
+        void serve()
+        {
+            while (!stopping)
+            {
+                int fd = accept(listenFd, nullptr, nullptr);
+                if (fd < 0)
+                {
+                    continue;
+                }
+                std::string request;
+                char buffer[4096];
+                ssize_t received;
+                while (request.find("\r\n\r\n") == std::string::npos && (received = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+                {
+                    request.append(buffer, static_cast<size_t>(received));
+                }
+                std::transform(request.begin(), request.end(), request.begin(),
+                               [](unsigned char c)
+                               { return static_cast<char>(std::tolower(c)); });
+
+                std::string response;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    std::string headers = "ETag: \"" + etag + "\"\r\n" +
+                                          (expired ? "Expires: Thu, 01 Jan 1970 00:00:00 GMT\r\n" : "Cache-Control: max-age=3600\r\n") +
+                                          "Connection: close\r\n";
+                    requests++;
+                    if (request.find("if-none-match: \"" + etag + "\"") != std::string::npos)
+                    {
+                        notModified++;
+                        response = "HTTP/1.1 304 Not Modified\r\n" + headers + "\r\n";
+                    }
+                    else
+                    {
+                        response = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+                                   std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+                    }
+                }
+                send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+                close(fd);
+            }
+        }
+
+        int listenFd = -1;
+        int port = 0;
+        std::atomic<bool> stopping{false};
+        std::thread thread;
+        std::mutex mutex;
+        std::string body;
+        std::string etag;
+        bool expired = false;
+    };
+
+    std::string fetch(FileSource &source, const Resource &resource)
+    {
+        std::string data = "<no response>";
+        std::unique_ptr<AsyncRequest> request = source.request(resource, [&](Response response)
+                                                               {
+                                                                   if (response.error)
+                                                                   {
+                                                                       data = "<error " + response.error->message + ">";
+                                                                   }
+                                                                   else if (response.data)
+                                                                   {
+                                                                       data = *response.data;
+                                                                   }
+                                                                   util::RunLoop::Get()->stop(); });
+        util::RunLoop::Get()->run();
+        return data;
+    }
+
+    std::string fetch(FileSource &source, const std::string &url)
+    {
+        return fetch(source, Resource::style(url));
+    }
+
+    // Asks for the same tile of a local MBTiles archive twice, once with a
+    // memory cache in front of the archive and once without.
+    void testArchiveTiles(const fs::path &directory)
+    {
+        fs::create_directories(directory);
+        std::string path = (directory / "source.mbtiles").string();
+        createMBTilesDatabase(path.c_str(), ImageFormat::PNG);
+        {
+            MBTilesWriter writer(path.c_str());
+            writer.insertTile(0, 0, 0, "tile", 4);
+            writer.finish();
+        }
+        Resource tile(Resource::Kind::Tile, "mbtiles://" + path + "/0/0/0");
+
+        WorkerStats cached{};
+        SourceTileFileSource source(std::make_unique<ArchiveFileSource>(), std::make_shared<SourceTileFileSource::Cache>(1 << 20), cached);
+        expect(fetch(source, tile) == "tile", "archive tile not read");
+        expect(fetch(source, tile) == "tile", "archive tile not served again");
+        expect(cached.sourceRequests == 2 && cached.sourceCacheHits == 1,
+               "counted " + std::to_string(cached.sourceRequests) + " archive tile requests and " +
+                   std::to_string(cached.sourceCacheHits) + " memory hits");
+
+        // Without a cache every request goes to the archive but is still counted.
+        WorkerStats uncached{};
+        SourceTileFileSource counting(std::make_unique<ArchiveFileSource>(), nullptr, uncached);
+        expect(fetch(counting, tile) == "tile" && fetch(counting, tile) == "tile", "archive tile not read without a cache");
+        expect(uncached.sourceRequests == 2 && uncached.sourceCacheHits == 0, "uncached archive tile requests not counted");
+    }
+
+} // namespace
+
+int main()
+{
+    util::RunLoop loop;
+    fs::path directory = fs::temp_directory_path() / ("tilerender-resource-cache-test-" + std::to_string(getpid()));
+
+    StyleServer server;
+    WorkerStats stats{};
+    {
+        CachingFileSource source(std::make_unique<OnlineFileSource>(ResourceOptions(), ClientOptions()), directory.string(), stats);
+
+        // Already expired, so every later request has to revalidate.
+        server.setStyle("{\"version\":8,\"name\":\"a\"}", "a", true);
+        expect(fetch(source, server.url()) == "{\"version\":8,\"name\":\"a\"}", "first fetch");
+        expect(server.requests == 1, "first fetch did not reach the server");
+
+        expect(fetch(source, server.url()) == "{\"version\":8,\"name\":\"a\"}", "revalidated entry not served");
+        expect(server.requests == 2 && server.notModified == 1, "expired entry not revalidated with its ETag");
+
+        // A changed style replaces the entry, which is then fresh for an hour.
+        server.setStyle("{\"version\":8,\"name\":\"b\"}", "b", false);
+        expect(fetch(source, server.url()) == "{\"version\":8,\"name\":\"b\"}", "changed style not downloaded");
+        expect(server.requests == 3 && server.notModified == 1, "changed style answered with 304");
+
+        expect(fetch(source, server.url()) == "{\"version\":8,\"name\":\"b\"}", "fresh entry not served");
+        expect(server.requests == 3, "fresh entry went to the server");
+        expect(stats.cacheHits == 1 && stats.cacheMisses == 3,
+               "counted " + std::to_string(stats.cacheHits) + " hits and " + std::to_string(stats.cacheMisses) + " misses");
+    }
+
+    testArchiveTiles(directory / "archive");
+
+    fs::remove_all(directory);
+    std::cout << (failures == 0 ? "ok" : "FAILED") << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}